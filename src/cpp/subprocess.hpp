@@ -2,6 +2,18 @@
 
 #include "subprocess/basic_types.hpp"
 #include "subprocess/pipe.hpp"
+#include "subprocess/IoPool.hpp"
 #include "subprocess/ProcessBuilder.hpp"
+#ifdef __cpp_impl_coroutine
+#include "subprocess/EventLoop.hpp"
+#endif
+#include "subprocess/Pipeline.hpp"
+#include "subprocess/ProcessPool.hpp"
+#include "subprocess/ProcessReactor.hpp"
+#include "subprocess/ProcessReaper.hpp"
+#include "subprocess/ProcessSet.hpp"
+#include "subprocess/ProcessWatcher.hpp"
+#include "subprocess/Metrics.hpp"
+#include "subprocess/Trace.hpp"
 #include "subprocess/shell_utils.hpp"
 #include "subprocess/environ.hpp"
\ No newline at end of file
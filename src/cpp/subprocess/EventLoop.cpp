@@ -0,0 +1,360 @@
+#if !defined(_WIN32) && defined(__cpp_impl_coroutine)
+#include "EventLoop.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "Metrics.hpp"
+
+using namespace subprocess::details;
+
+namespace subprocess {
+    EventLoop::Wait::Wait(EventLoop& loop, const Interest* interests, std::size_t count,
+        Popen* exiting
+    ) : mLoop(&loop), mExiting(exiting) {
+        if (count > kMaxInterests)
+            throw std::invalid_argument("EventLoop::Wait: too many handles");
+        for (std::size_t i = 0; i < count; ++i)
+            mWatches[mCount++] = {this, interests[i].handle, interests[i].write, (unsigned)i, false};
+    }
+
+    EventLoop::Wait::~Wait() {
+        if (mSuspended || mQueued)
+            mLoop->remove(*this);
+    }
+
+    void EventLoop::Wait::await_suspend(std::coroutine_handle<> handle) {
+        mHandle     = handle;
+        mReadyMask  = 0;
+        for (int i = 0; i < mCount; ++i)
+            mWatches[i].wait = this;
+        mLoop->add(*this);
+    }
+
+    void EventLoop::Wait::fire(unsigned bit) {
+        mReadyMask |= 1u << bit;
+        if (!mQueued) {
+            mQueued = true;
+            mLoop->mReady.push_back(this);
+        }
+    }
+
+    ExitWait::ExitWait(EventLoop& loop, Popen& popen, int pidfd)
+        : mPopen(&popen), mWait(loop, nullptr, 0, pidfd < 0? &popen : nullptr) {
+        if (pidfd >= 0)
+            mWait.mWatches[mWait.mCount++] = {&mWait, pidfd, false, 0, false};
+    }
+
+    ExitWait Popen::async_wait() {
+        return EventLoop::current().exit(*this);
+    }
+
+    ExitWait Popen::async_wait(EventLoop& loop) {
+        return loop.exit(*this);
+    }
+
+    EventLoop::EventLoop() {
+#ifdef __linux__
+        mPoller = epoll_create1(EPOLL_CLOEXEC);
+        if (mPoller < 0)
+            throw_os_error("epoll_create1", errno);
+#endif
+    }
+
+    EventLoop::~EventLoop() {
+        if (mPoller >= 0)
+            ::close(mPoller);
+    }
+
+    EventLoop& EventLoop::current() {
+        static thread_local EventLoop loop;
+        return loop;
+    }
+
+    ExitWait EventLoop::exit(Popen& popen) {
+        return ExitWait(*this, popen, popen.pidfd);
+    }
+
+    void EventLoop::add(Wait& wait) {
+#ifdef __linux__
+        for (int i = 0; i < wait.mCount; ++i) {
+            Wait::Watch& watch = wait.mWatches[i];
+            epoll_event event = {};
+            event.events    = watch.write? EPOLLOUT : EPOLLIN;
+            event.data.ptr  = &watch;
+            if (epoll_ctl(mPoller, EPOLL_CTL_ADD, watch.handle, &event) == 0) {
+                watch.added = true;
+            } else if (errno == EPERM) {
+                // regular files are always ready
+                wait.fire(watch.bit);
+            } else {
+                int error = errno;
+                remove(wait);
+                throw_os_error("epoll_ctl", error);
+            }
+        }
+        if (wait.mExiting)
+            mPolled.push_back(&wait);
+#else
+        mPolled.push_back(&wait);
+#endif
+        wait.mSuspended = true;
+        ++mWaiting;
+    }
+
+    void EventLoop::remove(Wait& wait) {
+#ifdef __linux__
+        for (int i = 0; i < wait.mCount; ++i) {
+            Wait::Watch& watch = wait.mWatches[i];
+            if (watch.added)
+                epoll_ctl(mPoller, EPOLL_CTL_DEL, watch.handle, nullptr);
+            watch.added = false;
+        }
+        bool polled = wait.mExiting != nullptr;
+#else
+        bool polled = true;
+#endif
+        if (polled)
+            mPolled.erase(std::remove(mPolled.begin(), mPolled.end(), &wait), mPolled.end());
+        if (wait.mQueued) {
+            mReady.erase(std::remove(mReady.begin(), mReady.end(), &wait), mReady.end());
+            wait.mQueued = false;
+        }
+        if (wait.mSuspended) {
+            wait.mSuspended = false;
+            --mWaiting;
+        }
+    }
+
+    std::size_t EventLoop::run_once(double timeout) {
+        if (!mReady.empty())
+            timeout = 0;
+        bool exiting = std::any_of(mPolled.begin(), mPolled.end(),
+            [](Wait* wait) { return wait->mExiting != nullptr; });
+        // nothing tells us about their exit, check on them regularly
+        if (exiting && (timeout < 0 || timeout > 0.01))
+            timeout = 0.01;
+        int ms = timeout < 0? -1 : (int)std::ceil(timeout*1000);
+#ifdef __linux__
+        epoll_event events[64];
+        int count = epoll_wait(mPoller, events, 64, ms);
+        if (count < 0 && errno != EINTR)
+            throw_os_error("epoll_wait", errno);
+        for (int i = 0; i < count; ++i) {
+            Wait::Watch& watch = *static_cast<Wait::Watch*>(events[i].data.ptr);
+            watch.wait->fire(watch.bit);
+        }
+#else
+        std::vector<pollfd> fds;
+        std::vector<Wait::Watch*> watches;
+        for (Wait* wait : mPolled) {
+            for (int i = 0; i < wait->mCount; ++i) {
+                pollfd pfd = {};
+                pfd.fd      = wait->mWatches[i].handle;
+                pfd.events  = wait->mWatches[i].write? POLLOUT : POLLIN;
+                fds.push_back(pfd);
+                watches.push_back(&wait->mWatches[i]);
+            }
+        }
+        int count = ::poll(fds.data(), fds.size(), ms);
+        if (count < 0 && errno != EINTR)
+            throw_os_error("poll", errno);
+        for (std::size_t i = 0; count > 0 && i < fds.size(); ++i) {
+            if (fds[i].revents != 0)
+                watches[i]->wait->fire(watches[i]->bit);
+        }
+#endif
+        if (exiting) {
+            for (Wait* wait : mPolled) {
+                if (wait->mExiting && wait->mExiting->poll())
+                    wait->fire(0);
+            }
+        }
+
+        // what those resumed queue runs in the next call
+        std::size_t resumed = 0;
+        for (std::size_t pending = mReady.size(); pending > 0 && !mReady.empty(); --pending) {
+            Wait* wait = mReady.front();
+            remove(*wait);
+            ++resumed;
+            wait->mHandle.resume();
+        }
+        return resumed;
+    }
+
+    void EventLoop::run() {
+        while (mWaiting > 0)
+            run_once(-1);
+    }
+
+    Task<ssize_t> async_read(PipeHandle handle, void* buffer, std::size_t size,
+        EventLoop& loop
+    ) {
+        pipe_set_blocking(handle, false);
+        while (true) {
+            ssize_t transferred = ::read(handle, buffer, size);
+            if (transferred >= 0)
+                co_return transferred;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                co_return -1;
+            co_await loop.readable(handle);
+        }
+    }
+
+    Task<ssize_t> async_write(PipeHandle handle, std::string_view data, EventLoop& loop) {
+        pipe_set_blocking(handle, false);
+        std::size_t written = 0;
+        while (written < data.size()) {
+            ssize_t transferred = write_no_sigpipe(handle, data.data() + written,
+                data.size() - written);
+            if (transferred > 0) {
+                written += transferred;
+                continue;
+            }
+            if (transferred < 0 && errno == EINTR)
+                continue;
+            if (transferred < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await loop.writable(handle);
+                continue;
+            }
+            break;
+        }
+        if (written == 0 && !data.empty())
+            co_return -1;
+        co_return (ssize_t)written;
+    }
+
+    namespace {
+        /** @return true if the output is ours to capture, as a pipe */
+        bool take_capture(PipeVar& option) {
+            if (static_cast<PipeVarIndex>(option.index()) != PipeVarIndex::option)
+                return false;
+            PipeOption pipe_option = std::get<PipeOption>(option);
+            if (pipe_option != PipeOption::pipe && pipe_option != PipeOption::memfd)
+                return false;
+            option = PipeOption::pipe;
+            return true;
+        }
+
+        /** Reads what's there. @return false once at EOF or on error */
+        bool read_available(PipeHandle handle, std::string& capture, Popen& popen,
+            CaptureMeter& meter
+        ) {
+            while (true) {
+                ssize_t transferred = pipe_read_append(handle, capture);
+                if (transferred > 0) {
+                    output_seen(popen);
+                    meter.add(transferred);
+                    continue;
+                }
+                if (transferred < 0 && errno == EINTR)
+                    continue;
+                return transferred < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+        }
+
+        /** Writes what fits. @return false once done or on error */
+        bool write_available(PipeHandle handle, std::string_view& input) {
+            while (!input.empty()) {
+                ssize_t transferred = write_no_sigpipe(handle, input.data(), input.size());
+                if (transferred > 0) {
+                    input.remove_prefix(transferred);
+                    metric_add(Metric::input_bytes, transferred);
+                    continue;
+                }
+                if (transferred < 0 && errno == EINTR)
+                    continue;
+                return transferred < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            }
+            return false;
+        }
+    }
+
+    Task<CompletedProcess> async_run(CommandLine command, RunOptions options,
+        EventLoop& loop
+    ) {
+        std::string         input_store;
+        std::string_view    input;
+        bool write_cin = true;
+        switch (static_cast<PipeVarIndex>(options.cin.index())) {
+        case PipeVarIndex::string:
+            input_store = std::move(std::get<std::string>(options.cin));
+            input       = input_store;
+            break;
+        case PipeVarIndex::view:
+            input = std::get<InputView>(options.cin).data;
+            break;
+        default:
+            write_cin = false;
+        }
+        if (write_cin)
+            options.cin = PipeOption::pipe;
+        bool capture_cout   = take_capture(options.cout);
+        bool capture_cerr   = take_capture(options.cerr);
+        bool check          = options.check;
+
+        CompletedProcess completed;
+        completed.args = command;
+        CaptureMeter cout_meter;
+        CaptureMeter cerr_meter;
+        Popen popen(std::move(command), std::move(options));
+        if (write_cin && input.empty())
+            popen.close_cin();
+        for (PipeHandle handle : {write_cin? popen.cin : kBadPipeValue,
+                capture_cout? popen.cout : kBadPipeValue,
+                capture_cerr? popen.cerr : kBadPipeValue}) {
+            if (handle != kBadPipeValue)
+                pipe_set_blocking(handle, false);
+        }
+
+        while (true) {
+            if (write_cin && popen.cin != kBadPipeValue && !write_available(popen.cin, input))
+                popen.close_cin();
+            if (capture_cout && popen.cout != kBadPipeValue
+                && !read_available(popen.cout, completed.cout, popen, cout_meter)) {
+                pipe_close(popen.cout);
+                popen.cout = kBadPipeValue;
+            }
+            if (capture_cerr && popen.cerr != kBadPipeValue
+                && !read_available(popen.cerr, completed.cerr, popen, cerr_meter)) {
+                pipe_close(popen.cerr);
+                popen.cerr = kBadPipeValue;
+            }
+
+            EventLoop::Interest interests[3];
+            std::size_t count = 0;
+            if (write_cin && popen.cin != kBadPipeValue)
+                interests[count++] = {popen.cin, true};
+            if (capture_cout && popen.cout != kBadPipeValue)
+                interests[count++] = {popen.cout, false};
+            if (capture_cerr && popen.cerr != kBadPipeValue)
+                interests[count++] = {popen.cerr, false};
+            if (count == 0)
+                break;
+            co_await loop.any(interests, count);
+        }
+
+        completed.returncode = co_await popen.async_wait(loop);
+        completed.usage = popen.usage;
+        if (check && completed.returncode != 0) {
+            CalledProcessError error("failed to execute " + completed.args[0]);
+            error.cmd           = completed.args;
+            error.returncode    = completed.returncode;
+            error.cout          = completed.cout;
+            error.cerr          = completed.cerr;
+            error.usage         = completed.usage;
+            throw error;
+        }
+        co_return completed;
+    }
+}
+#endif
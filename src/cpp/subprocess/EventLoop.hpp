@@ -0,0 +1,321 @@
+#pragma once
+
+// coroutines need c++20, the rest of the library doesn't
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <initializer_list>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "ProcessBuilder.hpp"
+
+namespace subprocess {
+    template<typename T=void> class Task;
+
+    namespace details {
+        struct TaskPromiseBase {
+            struct FinalAwaiter {
+                bool await_ready() noexcept { return false; }
+                template<typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+                    std::coroutine_handle<> continuation = handle.promise().continuation;
+                    return continuation? continuation : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            FinalAwaiter final_suspend() noexcept { return {}; }
+            void unhandled_exception() { error = std::current_exception(); }
+
+            /** resumed once the task completes */
+            std::coroutine_handle<> continuation;
+            std::exception_ptr      error;
+            bool                    started = false;
+        };
+
+        template<typename T>
+        struct TaskPromise : TaskPromiseBase {
+            Task<T> get_return_object();
+            void return_value(T result) { value.emplace(std::move(result)); }
+            T result() {
+                if (error)
+                    std::rethrow_exception(error);
+                return std::move(*value);
+            }
+            std::optional<T> value;
+        };
+
+        template<>
+        struct TaskPromise<void> : TaskPromiseBase {
+            Task<void> get_return_object();
+            void return_void() {}
+            void result() {
+                if (error)
+                    std::rethrow_exception(error);
+            }
+        };
+    }
+
+    /** Lazily started coroutine producing a T.
+
+        The body runs once the task is co_await'ed, started with start(), or
+        given to EventLoop::run() from outside any coroutine. Exceptions
+        propagate to whoever awaits it.
+    */
+    template<typename T>
+    class Task {
+    public:
+        typedef details::TaskPromise<T> promise_type;
+        typedef std::coroutine_handle<promise_type> Handle;
+
+        Task(){}
+        Task(Task&& other) noexcept : mHandle(std::exchange(other.mHandle, nullptr)) {}
+        Task& operator=(Task&& other) noexcept {
+            if (this != &other) {
+                if (mHandle)
+                    mHandle.destroy();
+                mHandle = std::exchange(other.mHandle, nullptr);
+            }
+            return *this;
+        }
+        Task(const Task&)=delete;
+        Task& operator=(const Task&)=delete;
+        ~Task() {
+            if (mHandle)
+                mHandle.destroy();
+        }
+
+        /** @return true once the body finished */
+        bool done() const { return !mHandle || mHandle.done(); }
+        /** Runs the body until it first suspends, it continues from the
+            loop. co_await the task later for its result. This is how tasks
+            run concurrently.
+        */
+        void start() {
+            if (!mHandle || mHandle.promise().started)
+                return;
+            mHandle.promise().started = true;
+            mHandle.resume();
+        }
+
+        bool await_ready() const noexcept { return done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            mHandle.promise().continuation = awaiting;
+            if (mHandle.promise().started)
+                return std::noop_coroutine();
+            mHandle.promise().started = true;
+            return mHandle;
+        }
+        T await_resume() { return mHandle.promise().result(); }
+
+    private:
+        friend promise_type;
+        friend EventLoop;
+        explicit Task(Handle handle) : mHandle(handle) {}
+        Handle mHandle;
+    };
+
+    namespace details {
+        template<typename T>
+        Task<T> TaskPromise<T>::get_return_object() {
+            return Task<T>(Task<T>::Handle::from_promise(*this));
+        }
+        inline Task<void> TaskPromise<void>::get_return_object() {
+            return Task<void>(Task<void>::Handle::from_promise(*this));
+        }
+    }
+
+    /** Resumes coroutines suspended on pipes and processes.
+
+        One epoll set (poll on non linux) holds the handles the suspended
+        coroutines wait on, process exits are waited on through their pidfd.
+        A suspended coroutine costs its frame and an entry in the set, no
+        thread. Coroutines resume in the thread calling run()/run_once().
+
+        Each handle may be waited on by one coroutine at a time.
+
+        Not thread safe, use it from a single thread. posix only.
+
+        @code
+        Task<void> job(EventLoop& loop) {
+            CompletedProcess completed = co_await async_run({"ls"},
+                RunBuilder().cout(PipeOption::pipe).options, loop);
+            ...
+        }
+        EventLoop loop;
+        loop.run(job(loop));
+        @endcode
+    */
+    class EventLoop {
+    public:
+        /** A handle to wait for, for writing or for reading. */
+        struct Interest {
+            PipeHandle  handle;
+            bool        write = false;
+        };
+
+        /** co_await'ing it suspends until one of the handles is ready.
+
+            The result is a bitmask of the ready handles, bit i for the i-th
+            interest.
+        */
+        class Wait {
+        public:
+            static constexpr int kMaxInterests = 3;
+            Wait(const Wait&)=delete;
+            Wait& operator=(const Wait&)=delete;
+            /** Stops waiting if the awaiting coroutine is destroyed. */
+            ~Wait();
+
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle);
+            unsigned await_resume() const noexcept { return mReadyMask; }
+
+        private:
+            friend EventLoop;
+            friend ExitWait;
+            struct Watch {
+                Wait*       wait;
+                PipeHandle  handle;
+                bool        write;
+                unsigned    bit;
+                bool        added;
+            };
+            Wait(EventLoop& loop, const Interest* interests, std::size_t count,
+                Popen* exiting);
+            void fire(unsigned bit);
+
+            EventLoop*  mLoop;
+            Watch       mWatches[kMaxInterests] = {};
+            int         mCount      = 0;
+            /** process waited on without pidfd, checked regularly */
+            Popen*      mExiting    = nullptr;
+            std::coroutine_handle<> mHandle;
+            unsigned    mReadyMask  = 0;
+            bool        mSuspended  = false;
+            bool        mQueued     = false;
+        };
+
+        EventLoop();
+        ~EventLoop();
+        EventLoop(const EventLoop&)=delete;
+        EventLoop& operator=(const EventLoop&)=delete;
+
+        /** @return the loop of the calling thread, created on first use. */
+        static EventLoop& current();
+
+        /** Suspends until handle has data or EOF to read. */
+        Wait readable(PipeHandle handle) {
+            Interest interest = {handle, false};
+            return Wait(*this, &interest, 1, nullptr);
+        }
+        /** Suspends until handle has room to write, or the reader is gone. */
+        Wait writable(PipeHandle handle) {
+            Interest interest = {handle, true};
+            return Wait(*this, &interest, 1, nullptr);
+        }
+        /** Suspends until any of up to Wait::kMaxInterests handles is ready. */
+        Wait any(std::initializer_list<Interest> interests) {
+            return Wait(*this, interests.begin(), interests.size(), nullptr);
+        }
+        /** Suspends until any of up to Wait::kMaxInterests handles is ready. */
+        Wait any(const Interest* interests, std::size_t count) {
+            return Wait(*this, interests, count, nullptr);
+        }
+        /** Suspends until the process exited, same as Popen::async_wait(). */
+        ExitWait exit(Popen& popen);
+
+        /** Waits for handles to be ready and resumes their coroutines.
+
+            @param timeout  seconds to wait, -1 for no limit.
+
+            @return number of coroutines resumed.
+        */
+        std::size_t run_once(double timeout=-1);
+        /** Runs until no coroutine is waiting. */
+        void run();
+        /** Starts task and runs until it completes.
+
+            @return what the task returned.
+
+            @throw  what the task threw. std::logic_error if the task waits
+                    on something else than this loop.
+        */
+        template<typename T>
+        T run(Task<T> task) {
+            task.start();
+            while (!task.done()) {
+                if (mWaiting == 0)
+                    throw std::logic_error("EventLoop::run: the task is not waiting on this loop");
+                run_once(-1);
+            }
+            return task.mHandle.promise().result();
+        }
+
+        /** @return number of coroutines waiting */
+        std::size_t waiting() const { return mWaiting; }
+
+    private:
+        void add(Wait& wait);
+        void remove(Wait& wait);
+
+        int                 mPoller     = -1;
+        std::size_t         mWaiting    = 0;
+        /** waits that need checking every run_once(), all of them on non linux */
+        std::vector<Wait*>  mPolled;
+        /** waits to resume */
+        std::deque<Wait*>   mReady;
+    };
+
+    /** co_await'ing it suspends until the process exited, the result is
+        the returncode.
+    */
+    class ExitWait {
+    public:
+        bool await_ready() { return mPopen->poll(); }
+        void await_suspend(std::coroutine_handle<> handle) { mWait.await_suspend(handle); }
+        int await_resume() { return mPopen->wait(); }
+
+    private:
+        friend EventLoop;
+        ExitWait(EventLoop& loop, Popen& popen, int pidfd);
+        Popen*          mPopen;
+        EventLoop::Wait mWait;
+    };
+
+    /** Reads up to size bytes once handle has some, without blocking the
+        thread. handle is switched to non blocking mode.
+
+        @return bytes read, 0 on EOF, -1 on error with errno set.
+    */
+    Task<ssize_t> async_read(PipeHandle handle, void* buffer, std::size_t size,
+        EventLoop& loop=EventLoop::current());
+    /** Writes all of data, suspending whenever the pipe is full. handle is
+        switched to non blocking mode. data must stay valid until the task
+        completes.
+
+        @return bytes written, less than data.size() if the reader went away
+                or on error.
+    */
+    Task<ssize_t> async_write(PipeHandle handle, std::string_view data,
+        EventLoop& loop=EventLoop::current());
+    /** subprocess::run() as a coroutine.
+
+        std::string and InputView cin are written, and PipeOption::pipe
+        cout/cerr captured, through loop. PipeOption::memfd is captured as a
+        pipe. Other redirections behave as with Popen. RunOptions::timeout
+        is ignored.
+
+        @throw CalledProcessError   if check is set and the process failed.
+        @throw                      same as Popen's constructor.
+    */
+    Task<CompletedProcess> async_run(CommandLine command, RunOptions options={},
+        EventLoop& loop=EventLoop::current());
+}
+#endif
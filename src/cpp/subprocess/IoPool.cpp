@@ -0,0 +1,672 @@
+#include "IoPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "Metrics.hpp"
+#include "pipe.hpp"
+
+namespace subprocess {
+    namespace {
+        /** background I/O not yet done, for io_pool_drain() */
+        struct ActiveJobs {
+            std::mutex              mutex;
+            std::condition_variable idle;
+            std::size_t             count = 0;
+        };
+
+        /*  Never destroyed, detached windows threads may finish after static
+            destructors ran.
+        */
+        ActiveJobs& active_jobs() {
+            static ActiveJobs* jobs = new ActiveJobs();
+            return *jobs;
+        }
+
+        void job_started() {
+            ActiveJobs& jobs = active_jobs();
+            std::lock_guard<std::mutex> lock(jobs.mutex);
+            ++jobs.count;
+        }
+        void job_done() {
+            ActiveJobs& jobs = active_jobs();
+            std::lock_guard<std::mutex> lock(jobs.mutex);
+            if (--jobs.count == 0)
+                jobs.idle.notify_all();
+        }
+
+        void wait_idle() {
+            ActiveJobs& jobs = active_jobs();
+            std::unique_lock<std::mutex> lock(jobs.mutex);
+            jobs.idle.wait(lock, [&jobs] { return jobs.count == 0; });
+        }
+    }
+
+#ifdef _WIN32
+    void io_pool_drain() {
+        wait_idle();
+    }
+
+    namespace details {
+        IoTask::IoTask(std::thread thread) : mThread(std::move(thread)) {}
+        IoTask::~IoTask() {
+            if (mThread.joinable())
+                mThread.detach();
+        }
+        IoTask& IoTask::operator=(IoTask&& other) {
+            if (mThread.joinable())
+                mThread.detach();
+            mThread = std::move(other.mThread);
+            return *this;
+        }
+        bool IoTask::joinable() const { return mThread.joinable(); }
+        void IoTask::join() { mThread.join(); }
+    }
+
+    namespace {
+        std::size_t g_threads = 1;
+
+        template<typename F>
+        details::IoTask start(F function) {
+            job_started();
+            return details::IoTask(std::thread([function(std::move(function))]() mutable {
+                details::HelperThreadMetric helper;
+                function();
+                job_done();
+            }));
+        }
+
+        void write_all(PipeHandle output, const char* data, std::size_t size) {
+            std::size_t pos = 0;
+            while (pos < size) {
+                ssize_t transfered = pipe_write(output, data + pos, size - pos);
+                if (transfered <= 0)
+                    break;
+                pos += transfered;
+            }
+            details::metric_add(details::Metric::input_bytes, pos);
+        }
+    }
+
+    void io_pool_set_threads(std::size_t threads) {
+        g_threads = std::max<std::size_t>(threads, 1);
+    }
+    std::size_t io_pool_threads() {
+        return g_threads;
+    }
+    void io_pool_shutdown() {
+        io_pool_drain();
+    }
+
+    namespace details {
+        IoTask io_read(PipeHandle input, std::ostream* output) {
+            return start([=]() {
+                std::vector<char> buffer(64*1024);
+                while (true) {
+                    ssize_t transfered = pipe_read(input, &buffer[0], buffer.size());
+                    if (transfered <= 0)
+                        break;
+                    output->write(&buffer[0], transfered);
+                    metric_add(Metric::stream_bytes, transfered);
+                }
+                pipe_close(input);
+            });
+        }
+        IoTask io_read(PipeHandle input, FILE* output) {
+            return start([=]() {
+                std::vector<char> buffer(64*1024);
+                while (true) {
+                    ssize_t transfered = pipe_read(input, &buffer[0], buffer.size());
+                    if (transfered <= 0)
+                        break;
+                    fwrite(&buffer[0], 1, transfered, output);
+                    metric_add(Metric::file_bytes, transfered);
+                }
+                pipe_close(input);
+            });
+        }
+        IoTask io_discard(PipeHandle input) {
+            return start([=]() {
+                std::vector<char> buffer(64*1024);
+                while (true) {
+                    ssize_t transfered = pipe_read(input, &buffer[0], buffer.size());
+                    if (transfered <= 0)
+                        break;
+                    metric_add(Metric::discard_bytes, transfered);
+                }
+                pipe_close(input);
+            });
+        }
+        IoTask io_write(std::string input, PipeHandle output) {
+            return start([input(std::move(input)), output]() {
+                write_all(output, input.data(), input.size());
+                pipe_close(output);
+            });
+        }
+        IoTask io_write_view(std::string_view input, PipeHandle output) {
+            return start([=]() {
+                write_all(output, input.data(), input.size());
+                pipe_close(output);
+            });
+        }
+        IoTask io_write(std::istream* input, PipeHandle output) {
+            return start([=]() {
+                std::vector<char> buffer(64*1024);
+                while (true) {
+                    input->read(&buffer[0], buffer.size());
+                    ssize_t transfered = input->gcount();
+                    if (input->bad())
+                        break;
+                    if (transfered <= 0) {
+                        if (input->eof())
+                            break;
+                        continue;
+                    }
+                    write_all(output, &buffer[0], transfered);
+                }
+                pipe_close(output);
+            });
+        }
+        IoTask io_write(FILE* input, PipeHandle output) {
+            return start([=]() {
+                std::vector<char> buffer(64*1024);
+                while (true) {
+                    ssize_t transfered = fread(&buffer[0], 1, buffer.size(), input);
+                    if (transfered <= 0)
+                        break;
+                    write_all(output, &buffer[0], transfered);
+                }
+                pipe_close(output);
+            });
+        }
+    }
+#else
+    namespace details {
+        /** One stream serviced by a pool thread. */
+        struct IoJob {
+            virtual ~IoJob(){}
+            /** Moves what it can without blocking on handle.
+
+                @return true once done.
+            */
+            virtual bool ready(std::vector<char>& buffer)=0;
+
+            void finish() {
+                pipe_close(handle);
+                handle = kBadPipeValue;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    done = true;
+                }
+                finished.notify_all();
+                job_done();
+            }
+
+            PipeHandle          handle  = kBadPipeValue;
+            /** handle is written to, otherwise read from */
+            bool                write   = false;
+            /** guards done */
+            std::mutex              mutex;
+            std::condition_variable finished;
+            bool                    done    = false;
+        };
+
+        IoTask::~IoTask() {}
+        IoTask& IoTask::operator=(IoTask&& other) {
+            mJob = std::move(other.mJob);
+            return *this;
+        }
+        bool IoTask::joinable() const {
+            return mJob != nullptr;
+        }
+        void IoTask::join() {
+            {
+                std::unique_lock<std::mutex> lock(mJob->mutex);
+                IoJob& job = *mJob;
+                job.finished.wait(lock, [&job] { return job.done; });
+            }
+            mJob.reset();
+        }
+    }
+
+    namespace {
+        using details::IoJob;
+
+        bool again() {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        /** @return false if fd stopped taking data, its reader is gone */
+        bool write_all(int fd, const char* data, std::size_t size) {
+            while (size > 0) {
+                ssize_t transferred = details::write_no_sigpipe(fd, data, size);
+                if (transferred < 0 && errno == EINTR)
+                    continue;
+                if (transferred <= 0)
+                    return false;
+                data += transferred;
+                size -= transferred;
+            }
+            return true;
+        }
+
+        struct StringSource : IoJob {
+            std::string         store;
+            std::string_view    data;
+
+            bool ready(std::vector<char>&) override {
+                while (!data.empty()) {
+                    ssize_t transferred = details::write_no_sigpipe(handle, data.data(), data.size());
+                    if (transferred > 0) {
+                        data.remove_prefix(transferred);
+                        details::metric_add(details::Metric::input_bytes, transferred);
+                        continue;
+                    }
+                    if (transferred < 0 && errno == EINTR)
+                        continue;
+                    return !(transferred < 0 && again());
+                }
+                return true;
+            }
+        };
+
+        struct Sink : IoJob {
+            /** nullptr to throw away */
+            std::ostream*   stream  = nullptr;
+
+            bool ready(std::vector<char>& buffer) override {
+                while (true) {
+                    ssize_t transferred = ::read(handle, buffer.data(), buffer.size());
+                    if (transferred > 0) {
+                        if (stream)
+                            stream->write(buffer.data(), transferred);
+                        details::metric_add(stream? details::Metric::stream_bytes
+                            : details::Metric::discard_bytes, transferred);
+                        continue;
+                    }
+                    if (transferred < 0 && errno == EINTR)
+                        continue;
+                    return !(transferred < 0 && again());
+                }
+            }
+        };
+
+        /** Serviced by a thread of its own, see start_thread(). */
+        struct ThreadJob : IoJob {
+            bool ready(std::vector<char>&) override { return true; }
+
+            bool finished() {
+                std::lock_guard<std::mutex> lock(mutex);
+                return done;
+            }
+
+            std::thread thread;
+        };
+
+        /*  Threads of the jobs no pool thread can service. Kept so they can
+            be joined rather than left running past main().
+        */
+        struct JobThreads {
+            ~JobThreads() { join(true); }
+
+            void add(std::shared_ptr<ThreadJob> job) {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(std::move(job));
+            }
+
+            /** Joins the threads that are done, or all of them. */
+            void join(bool all) {
+                std::vector<std::shared_ptr<ThreadJob>> joining;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    auto keep = std::partition(jobs.begin(), jobs.end(),
+                        [all](const std::shared_ptr<ThreadJob>& job) {
+                            return !all && !job->finished();
+                        });
+                    joining.assign(std::make_move_iterator(keep),
+                        std::make_move_iterator(jobs.end()));
+                    jobs.erase(keep, jobs.end());
+                }
+                for (auto& job : joining)
+                    job->thread.join();
+            }
+
+            std::mutex  mutex;
+            std::vector<std::shared_ptr<ThreadJob>> jobs;
+        };
+
+        JobThreads g_job_threads;
+
+        /*  Runs function(handle) on a thread of its own, for reading and
+            writing istreams and FILE*s that may block, which a pool thread
+            must not.
+        */
+        template<typename F>
+        details::IoTask start_thread(PipeHandle handle, F function) {
+            // so threads of finished jobs don't pile up
+            g_job_threads.join(false);
+            auto job = std::make_shared<ThreadJob>();
+            job->handle = handle;
+            job_started();
+            // g_job_threads keeps the job alive until the thread is joined
+            job->thread = std::thread([job = job.get(), function(std::move(function))]() mutable {
+                details::HelperThreadMetric helper;
+                function(job->handle);
+                job->finish();
+            });
+            g_job_threads.add(job);
+            return details::IoTask(std::move(job));
+        }
+
+        /** Writes what read(buffer, size) returns until it returns 0. */
+        template<typename Read>
+        void write_from(PipeHandle output, Read read) {
+            std::vector<char> buffer(64*1024);
+            while (std::size_t transferred = read(buffer.data(), buffer.size())) {
+                // no point reading on once the child stopped reading
+                if (!write_all(output, buffer.data(), transferred))
+                    return;
+                details::metric_add(details::Metric::input_bytes, transferred);
+            }
+        }
+
+        /** A pool thread and the streams it services. */
+        struct Worker {
+            Worker();
+            ~Worker();
+            void add(std::shared_ptr<IoJob> job);
+            void stop();
+            void run();
+            void adopt();
+            void watch(IoJob& job);
+            void finish(IoJob& job);
+
+            std::mutex          mutex;
+            std::vector<std::shared_ptr<IoJob>> incoming;
+            bool                stopping = false;
+            /** jobs assigned, for picking the least busy worker */
+            std::atomic<std::size_t> load{0};
+            int                 poller = -1;
+            /** self pipe to wake the thread up */
+            int                 wakeup[2] = {-1, -1};
+            std::unordered_map<IoJob*, std::shared_ptr<IoJob>> jobs;
+            std::vector<char>   buffer;
+            std::thread         thread;
+        };
+
+        Worker::Worker() {
+            buffer.resize(64*1024);
+#ifdef __linux__
+            poller = epoll_create1(EPOLL_CLOEXEC);
+            if (poller < 0)
+                details::throw_os_error("epoll_create1", errno);
+#endif
+            if (::pipe(wakeup) < 0) {
+                int error = errno;
+                if (poller >= 0)
+                    ::close(poller);
+                details::throw_os_error("pipe", error);
+            }
+            for (int fd : wakeup) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            }
+#ifdef __linux__
+            epoll_event event = {};
+            event.events    = EPOLLIN;
+            event.data.ptr  = nullptr;
+            epoll_ctl(poller, EPOLL_CTL_ADD, wakeup[0], &event);
+#endif
+            thread = std::thread([this] { run(); });
+        }
+
+        Worker::~Worker() {
+            stop();
+            if (poller >= 0)
+                ::close(poller);
+            ::close(wakeup[0]);
+            ::close(wakeup[1]);
+        }
+
+        void Worker::add(std::shared_ptr<IoJob> job) {
+            ++load;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                incoming.push_back(std::move(job));
+            }
+            char byte = 0;
+            while (::write(wakeup[1], &byte, 1) < 0 && errno == EINTR)
+                ;
+        }
+
+        void Worker::stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            char byte = 0;
+            while (::write(wakeup[1], &byte, 1) < 0 && errno == EINTR)
+                ;
+            if (thread.joinable())
+                thread.join();
+            // abandoned, whoever joins them is let go
+            for (auto& job : incoming)
+                job->finish();
+            incoming.clear();
+            for (auto& pair : jobs)
+                pair.first->finish();
+            jobs.clear();
+        }
+
+        void Worker::watch(IoJob& job) {
+#ifdef __linux__
+            epoll_event event = {};
+            event.events    = job.write? EPOLLOUT : EPOLLIN;
+            event.data.ptr  = &job;
+            if (epoll_ctl(poller, EPOLL_CTL_ADD, job.handle, &event) < 0) {
+                // a regular file never blocks, a bad handle fails right away
+                while (!job.ready(buffer))
+                    ;
+                finish(job);
+            }
+#endif
+        }
+
+        void Worker::finish(IoJob& job) {
+#ifdef __linux__
+            epoll_ctl(poller, EPOLL_CTL_DEL, job.handle, nullptr);
+#endif
+            --load;
+            auto it = jobs.find(&job);
+            std::shared_ptr<IoJob> keep = std::move(it->second);
+            jobs.erase(it);
+            job.finish();
+        }
+
+        void Worker::adopt() {
+            char bytes[64];
+            while (::read(wakeup[0], bytes, sizeof(bytes)) > 0)
+                ;
+            std::vector<std::shared_ptr<IoJob>> adopted;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                adopted.swap(incoming);
+            }
+            for (auto& job : adopted) {
+                IoJob& ref = *job;
+                jobs[&ref] = std::move(job);
+                pipe_set_blocking(ref.handle, false);
+                // most input fits in the pipe right away
+                if (ref.ready(buffer))
+                    finish(ref);
+                else
+                    watch(ref);
+            }
+        }
+
+        void Worker::run() {
+            details::HelperThreadMetric helper;
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (stopping)
+                        return;
+                }
+#ifdef __linux__
+                epoll_event events[64];
+                int count = epoll_wait(poller, events, 64, -1);
+                for (int i = 0; i < count; ++i) {
+                    IoJob* job = static_cast<IoJob*>(events[i].data.ptr);
+                    if (job == nullptr)
+                        adopt();
+                    else if (job->ready(buffer))
+                        finish(*job);
+                }
+#else
+                std::vector<pollfd> fds(1);
+                std::vector<IoJob*> polled(1, nullptr);
+                fds[0].fd       = wakeup[0];
+                fds[0].events   = POLLIN;
+                for (auto& pair : jobs) {
+                    pollfd pfd = {};
+                    pfd.fd      = pair.first->handle;
+                    pfd.events  = pair.first->write? POLLOUT : POLLIN;
+                    fds.push_back(pfd);
+                    polled.push_back(pair.first);
+                }
+                int count = ::poll(fds.data(), fds.size(), -1);
+                for (std::size_t i = 0; count > 0 && i < fds.size(); ++i) {
+                    if (fds[i].revents == 0)
+                        continue;
+                    if (polled[i] == nullptr)
+                        adopt();
+                    else if (polled[i]->ready(buffer))
+                        finish(*polled[i]);
+                }
+#endif
+            }
+        }
+
+        struct Pool {
+            ~Pool() { shutdown(); }
+
+            void submit(std::shared_ptr<IoJob> job) {
+                std::lock_guard<std::mutex> guard(lifecycle);
+                if (workers.empty()) {
+                    for (std::size_t i = 0; i < threads; ++i)
+                        workers.push_back(std::make_unique<Worker>());
+                }
+                job_started();
+                Worker* least = workers[0].get();
+                for (auto& worker : workers) {
+                    if (worker->load < least->load)
+                        least = worker.get();
+                }
+                least->add(std::move(job));
+            }
+
+            void shutdown() {
+                std::lock_guard<std::mutex> guard(lifecycle);
+                workers.clear();
+            }
+
+            std::mutex          lifecycle;
+            std::size_t         threads = 1;
+            std::vector<std::unique_ptr<Worker>> workers;
+        };
+
+        Pool g_pool;
+
+        details::IoTask submit(std::shared_ptr<IoJob> job, PipeHandle handle, bool write) {
+            job->handle = handle;
+            job->write  = write;
+            g_pool.submit(job);
+            return details::IoTask(std::move(job));
+        }
+    }
+
+    void io_pool_set_threads(std::size_t threads) {
+        io_pool_drain();
+        std::lock_guard<std::mutex> guard(g_pool.lifecycle);
+        g_pool.workers.clear();
+        g_pool.threads = std::max<std::size_t>(threads, 1);
+    }
+
+    std::size_t io_pool_threads() {
+        std::lock_guard<std::mutex> guard(g_pool.lifecycle);
+        return g_pool.threads;
+    }
+
+    void io_pool_drain() {
+        wait_idle();
+        g_job_threads.join(false);
+    }
+
+    void io_pool_shutdown() {
+        g_pool.shutdown();
+        g_job_threads.join(true);
+    }
+
+    namespace details {
+        IoTask io_read(PipeHandle input, std::ostream* output) {
+            auto sink = std::make_shared<Sink>();
+            sink->stream = output;
+            return submit(std::move(sink), input, false);
+        }
+        IoTask io_read(PipeHandle input, FILE* output) {
+            // what's already buffered must land before what we forward
+            fflush(output);
+            int fd = fileno(output);
+            return start_thread(input, [fd](PipeHandle handle) {
+                metric_add(Metric::file_bytes, pipe_forward(handle, fd));
+            });
+        }
+        IoTask io_discard(PipeHandle input) {
+            return submit(std::make_shared<Sink>(), input, false);
+        }
+        IoTask io_write(std::string input, PipeHandle output) {
+            auto source = std::make_shared<StringSource>();
+            source->store   = std::move(input);
+            source->data    = source->store;
+            return submit(std::move(source), output, true);
+        }
+        IoTask io_write_view(std::string_view input, PipeHandle output) {
+            auto source = std::make_shared<StringSource>();
+            source->data = input;
+            return submit(std::move(source), output, true);
+        }
+        IoTask io_write(std::istream* input, PipeHandle output) {
+            return start_thread(output, [input](PipeHandle handle) {
+                write_from(handle, [input](char* buffer, std::size_t size) -> std::size_t {
+                    if (input->bad() || input->eof())
+                        return 0;
+                    input->read(buffer, size);
+                    return input->gcount();
+                });
+            });
+        }
+        IoTask io_write(FILE* input, PipeHandle output) {
+            return start_thread(output, [input](PipeHandle handle) {
+                write_from(handle, [input](char* buffer, std::size_t size) {
+                    return fread(buffer, 1, size, input);
+                });
+            });
+        }
+    }
+#endif
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "basic_types.hpp"
+
+namespace subprocess {
+    /** Sets how many threads service background I/O.
+
+        Redirections to std::string, InputView, std::istream*, std::ostream*
+        and FILE* and pipe_ignore_and_close() are serviced in the
+        background. On posix all but std::istream* and FILE* are serviced by
+        a fixed set of threads each running a poll loop over non blocking
+        pipes, so no thread is created per stream. The default is 1 thread.
+        An std::ostream* of yours that blocks delays the other streams of
+        its thread, use more threads if yours do.
+
+        Reading an std::istream* or FILE* and writing to a FILE* may block
+        with nothing to poll, so each of those gets a thread of its own.
+        These threads are tracked and joined once done, by io_pool_drain(),
+        io_pool_shutdown() and at exit, none outlives the program.
+
+        A running pool is drained and restarted with the new count.
+
+        On windows each stream still gets its own thread.
+    */
+    void io_pool_set_threads(std::size_t threads);
+    /** @return number of threads the pool runs with */
+    std::size_t io_pool_threads();
+    /** Waits until all background I/O started so far is done, that is until
+        every output reached EOF and every input was written.
+    */
+    void io_pool_drain();
+    /** Stops the pool threads. Background I/O still pending is abandoned
+        and its pipes closed. The threads of std::istream* and FILE*
+        redirections can't be interrupted, they are waited for. The pool
+        starts again when next needed. Also done when the program exits.
+
+        On windows it's the same as io_pool_drain().
+    */
+    void io_pool_shutdown();
+
+    namespace details {
+        struct IoJob;
+
+        /** Background I/O of one stream, joined like a std::thread. Letting
+            it go without join() leaves the I/O running.
+        */
+        class IoTask {
+        public:
+            IoTask(){}
+            ~IoTask();
+            IoTask(IoTask&&)=default;
+            IoTask& operator=(IoTask&& other);
+            IoTask(const IoTask&)=delete;
+            IoTask& operator=(const IoTask&)=delete;
+
+            bool joinable() const;
+            /** Waits for the I/O to be done, its pipe is closed by then. */
+            void join();
+
+#ifdef _WIN32
+            explicit IoTask(std::thread thread);
+        private:
+            std::thread mThread;
+#else
+            explicit IoTask(std::shared_ptr<IoJob> job) : mJob(std::move(job)) {}
+        private:
+            std::shared_ptr<IoJob> mJob;
+#endif
+        };
+
+        /** Reads input until EOF into output, then closes input. */
+        IoTask io_read(PipeHandle input, std::ostream* output);
+        /** Reads input until EOF into output, then closes input. */
+        IoTask io_read(PipeHandle input, FILE* output);
+        /** Reads input until EOF and throws it away, then closes input. */
+        IoTask io_discard(PipeHandle input);
+        /** Writes all of input to output, then closes output. */
+        IoTask io_write(std::string input, PipeHandle output);
+        /** Writes all of input to output, then closes output. input must
+            stay valid until joined.
+        */
+        IoTask io_write_view(std::string_view input, PipeHandle output);
+        /** Writes input until EOF to output, then closes output. */
+        IoTask io_write(std::istream* input, PipeHandle output);
+        /** Writes input until EOF to output, then closes output. */
+        IoTask io_write(FILE* input, PipeHandle output);
+    }
+}
@@ -0,0 +1,304 @@
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace subprocess {
+    namespace {
+        /** @return index of the highest set bit, value must not be 0 */
+        int highest_bit(std::uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+            return 63 - __builtin_clzll(value);
+#else
+            int bit = 0;
+            while (value >>= 1)
+                ++bit;
+            return bit;
+#endif
+        }
+    }
+
+    std::size_t Histogram::bucket_of(double seconds) {
+        if (!(seconds > 0))
+            return 0;
+        double micros = seconds*1e6;
+        if (micros >= std::ldexp(1.0, kMaxPower))
+            return kBuckets - 1;
+        std::uint64_t value = (std::uint64_t)micros;
+        if (value < (std::uint64_t)kSubBuckets)
+            return (std::size_t)value;
+        int power = highest_bit(value);
+        std::size_t sub = (value >> (power - 3)) & (kSubBuckets - 1);
+        return kSubBuckets + (power - 3)*kSubBuckets + sub;
+    }
+
+    double Histogram::bucket_limit(std::size_t bucket) {
+        if (bucket < (std::size_t)kSubBuckets)
+            return (bucket + 1)/1e6;
+        int power       = (int)((bucket - kSubBuckets)/kSubBuckets) + 3;
+        std::size_t sub = (bucket - kSubBuckets) % kSubBuckets;
+        return std::ldexp((double)(kSubBuckets + sub + 1), power - 3)/1e6;
+    }
+
+    double Histogram::percentile(double fraction) const {
+        if (count == 0)
+            return 0;
+        std::uint64_t rank = (std::uint64_t)std::ceil(std::clamp(fraction, 0.0, 1.0)*count);
+        rank = std::max<std::uint64_t>(rank, 1);
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < buckets.size(); ++i) {
+            seen += buckets[i];
+            if (seen >= rank)
+                return std::min(bucket_limit(i), max);
+        }
+        return max;
+    }
+
+    double Histogram::mean() const {
+        return count == 0? 0 : sum/count;
+    }
+
+    namespace {
+        using details::Metric;
+        constexpr std::size_t kMetricCount = (std::size_t)Metric::count;
+
+        /** Histogram updated by one thread, read by snapshots. */
+        struct AtomicHistogram {
+            void record(double seconds) {
+                std::uint64_t nanos = seconds > 0? (std::uint64_t)(seconds*1e9) : 0;
+                buckets[Histogram::bucket_of(seconds)].fetch_add(1, std::memory_order_relaxed);
+                count.fetch_add(1, std::memory_order_relaxed);
+                sum.fetch_add(nanos, std::memory_order_relaxed);
+                // only the owning thread writes, no need to compare and swap
+                if (nanos > max.load(std::memory_order_relaxed))
+                    max.store(nanos, std::memory_order_relaxed);
+            }
+            void add_to(Histogram& histogram) const {
+                std::uint64_t total = count.load(std::memory_order_relaxed);
+                if (total == 0)
+                    return;
+                if (histogram.buckets.empty())
+                    histogram.buckets.resize(Histogram::kBuckets);
+                for (std::size_t i = 0; i < Histogram::kBuckets; ++i)
+                    histogram.buckets[i] += buckets[i].load(std::memory_order_relaxed);
+                histogram.count += total;
+                histogram.sum   += sum.load(std::memory_order_relaxed)/1e9;
+                histogram.max   = std::max(histogram.max,
+                    max.load(std::memory_order_relaxed)/1e9);
+            }
+            void add_to(AtomicHistogram& other) const {
+                for (std::size_t i = 0; i < Histogram::kBuckets; ++i)
+                    other.buckets[i] += buckets[i].load(std::memory_order_relaxed);
+                other.count += count.load(std::memory_order_relaxed);
+                other.sum   += sum.load(std::memory_order_relaxed);
+                other.max   = std::max(other.max.load(), max.load(std::memory_order_relaxed));
+            }
+
+            std::atomic<std::uint64_t> buckets[Histogram::kBuckets];
+            std::atomic<std::uint64_t> count{0};
+            /** nanoseconds */
+            std::atomic<std::uint64_t> sum{0};
+            /** nanoseconds */
+            std::atomic<std::uint64_t> max{0};
+        };
+
+        struct ProgramHistograms {
+            AtomicHistogram spawn_latency;
+            AtomicHistogram reap_latency;
+            AtomicHistogram run_duration;
+        };
+
+        /*  Counters of one thread. Only the owning thread writes to them and
+            inserts into programs, snapshots read.
+        */
+        struct ThreadMetrics {
+            ProgramHistograms& program(const std::string& name) {
+                // we are the only writer, looking up without the lock is fine
+                auto it = programs.find(name);
+                if (it != programs.end())
+                    return *it->second;
+                auto histograms = std::make_unique<ProgramHistograms>();
+                ProgramHistograms& result = *histograms;
+                std::lock_guard<std::mutex> lock(mutex);
+                programs.emplace(name, std::move(histograms));
+                return result;
+            }
+            /** Adds everything to other. Hold mutex of both. */
+            void add_to(ThreadMetrics& other) const {
+                for (std::size_t i = 0; i < kMetricCount; ++i)
+                    other.counters[i] += counters[i].load(std::memory_order_relaxed);
+                for (auto& pair : programs) {
+                    auto& target = other.programs[pair.first];
+                    if (!target)
+                        target = std::make_unique<ProgramHistograms>();
+                    pair.second->spawn_latency.add_to(target->spawn_latency);
+                    pair.second->reap_latency.add_to(target->reap_latency);
+                    pair.second->run_duration.add_to(target->run_duration);
+                }
+            }
+
+            std::atomic<std::int64_t> counters[kMetricCount];
+            /** guards inserting into programs against snapshots */
+            std::mutex  mutex;
+            std::unordered_map<std::string, std::unique_ptr<ProgramHistograms>> programs;
+        };
+
+        struct Registry {
+            std::mutex                  mutex;
+            std::vector<ThreadMetrics*> threads;
+            /** what exited threads counted */
+            ThreadMetrics               retired;
+        };
+
+        /*  Never destroyed, helper threads may still count after static
+            destructors ran.
+        */
+        Registry& registry() {
+            static Registry* registry = new Registry();
+            return *registry;
+        }
+
+        struct ThreadSlot {
+            ~ThreadSlot() {
+                if (!metrics)
+                    return;
+                Registry& reg = registry();
+                std::lock_guard<std::mutex> lock(reg.mutex);
+                metrics->add_to(reg.retired);
+                reg.threads.erase(std::find(reg.threads.begin(), reg.threads.end(), metrics));
+                delete metrics;
+                metrics = nullptr;
+                retired = true;
+            }
+            ThreadMetrics* metrics = nullptr;
+            /** destroyed, later counts of the thread go to reg.retired */
+            bool retired = false;
+        };
+        thread_local ThreadSlot t_slot;
+
+        /*  Calls update with the metrics of this thread, or with reg.retired
+            under reg.mutex once the slot is gone, destructors running at
+            thread exit may still count.
+        */
+        template <typename Update>
+        void update_metrics(Update update) {
+            if (t_slot.retired) {
+                Registry& reg = registry();
+                std::lock_guard<std::mutex> lock(reg.mutex);
+                update(reg.retired);
+                return;
+            }
+            if (!t_slot.metrics) {
+                auto metrics = new ThreadMetrics();
+                Registry& reg = registry();
+                std::lock_guard<std::mutex> lock(reg.mutex);
+                reg.threads.push_back(metrics);
+                t_slot.metrics = metrics;
+            }
+            update(*t_slot.metrics);
+        }
+
+        std::string program_name(const CommandLine& args) {
+            if (args.empty())
+                return {};
+            const std::string& program = args[0];
+            std::size_t slash = program.find_last_of("/\\");
+            return slash == std::string::npos? program : program.substr(slash + 1);
+        }
+
+        std::int64_t counter(const std::int64_t* counters, Metric metric) {
+            return counters[(std::size_t)metric];
+        }
+    }
+
+    MetricsSnapshot metrics_snapshot() {
+        std::int64_t counters[kMetricCount] = {};
+        MetricsSnapshot snapshot;
+        auto add = [&](ThreadMetrics& metrics) {
+            for (std::size_t i = 0; i < kMetricCount; ++i)
+                counters[i] += metrics.counters[i].load(std::memory_order_relaxed);
+            for (auto& pair : metrics.programs) {
+                ProgramMetrics& program = snapshot.programs[pair.first];
+                pair.second->spawn_latency.add_to(program.spawn_latency);
+                pair.second->reap_latency.add_to(program.reap_latency);
+                pair.second->run_duration.add_to(program.run_duration);
+            }
+        };
+        Registry& reg = registry();
+        {
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            add(reg.retired);
+            for (ThreadMetrics* metrics : reg.threads) {
+                std::lock_guard<std::mutex> programs_lock(metrics->mutex);
+                add(*metrics);
+            }
+        }
+        snapshot.spawned            = counter(counters, Metric::spawned);
+        snapshot.running            = counter(counters, Metric::running);
+        snapshot.zombie             = counter(counters, Metric::zombie);
+        snapshot.failed             = counter(counters, Metric::failed);
+        snapshot.spawn_errors       = counter(counters, Metric::spawn_errors);
+        snapshot.helper_threads     = counter(counters, Metric::helper_threads);
+        snapshot.sink_bytes.capture = counter(counters, Metric::capture_bytes);
+        snapshot.sink_bytes.stream  = counter(counters, Metric::stream_bytes);
+        snapshot.sink_bytes.file    = counter(counters, Metric::file_bytes);
+        snapshot.sink_bytes.discard = counter(counters, Metric::discard_bytes);
+        snapshot.sink_bytes.callback = counter(counters, Metric::callback_bytes);
+        snapshot.sink_bytes.input   = counter(counters, Metric::input_bytes);
+        snapshot.capture_buffered   = counter(counters, Metric::capture_buffered);
+        return snapshot;
+    }
+
+    namespace details {
+        void metric_add(Metric metric, std::int64_t value) {
+            update_metrics([&](ThreadMetrics& metrics) {
+                metrics.counters[(std::size_t)metric].fetch_add(value,
+                    std::memory_order_relaxed);
+            });
+        }
+
+        void metric_spawned(const CommandLine& args, double latency) {
+            update_metrics([&](ThreadMetrics& metrics) {
+                metrics.counters[(std::size_t)Metric::spawned].fetch_add(1, std::memory_order_relaxed);
+                metrics.counters[(std::size_t)Metric::running].fetch_add(1, std::memory_order_relaxed);
+                metrics.program(program_name(args)).spawn_latency.record(latency);
+            });
+        }
+
+        void metric_collected(const CommandLine& args, int returncode, bool zombie,
+            double run_duration, double reap_latency
+        ) {
+            Metric gauge = zombie? Metric::zombie : Metric::running;
+            update_metrics([&](ThreadMetrics& metrics) {
+                metrics.counters[(std::size_t)gauge].fetch_sub(1, std::memory_order_relaxed);
+                if (returncode != 0)
+                    metrics.counters[(std::size_t)Metric::failed].fetch_add(1, std::memory_order_relaxed);
+                ProgramHistograms& program = metrics.program(program_name(args));
+                program.run_duration.record(run_duration);
+                if (reap_latency >= 0)
+                    program.reap_latency.record(reap_latency);
+            });
+        }
+
+        CaptureMeter::~CaptureMeter() {
+            if (mBuffered != 0)
+                metric_add(Metric::capture_buffered, -mBuffered);
+        }
+
+        void CaptureMeter::add(std::size_t bytes) {
+            if (bytes == 0)
+                return;
+            update_metrics([&](ThreadMetrics& metrics) {
+                metrics.counters[(std::size_t)Metric::capture_bytes].fetch_add(bytes,
+                    std::memory_order_relaxed);
+                metrics.counters[(std::size_t)Metric::capture_buffered].fetch_add(bytes,
+                    std::memory_order_relaxed);
+            });
+            mBuffered += bytes;
+        }
+    }
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "basic_types.hpp"
+
+namespace subprocess {
+    /** Log linear histogram of durations, in the style of HdrHistogram.
+
+        Below 8us each microsecond gets a bucket, above each power of two is
+        split in 8 buckets, so a value is known to within 12.5%. Durations
+        of more than 2^41us (25 days) land in the last bucket.
+    */
+    struct Histogram {
+        static constexpr int            kSubBuckets = 8;
+        static constexpr int            kMaxPower   = 41;
+        static constexpr std::size_t    kBuckets    = kSubBuckets
+            + (kMaxPower - 3)*kSubBuckets;
+
+        /** @return bucket seconds falls in */
+        static std::size_t bucket_of(double seconds);
+        /** @return seconds where bucket ends, exclusive */
+        static double bucket_limit(std::size_t bucket);
+
+        /** @return smallest recorded value that fraction (0..1) of values
+                    are at most, as the end of its bucket but no more than
+                    max. 0 if nothing was recorded.
+        */
+        double percentile(double fraction) const;
+        /** @return average of the recorded values, 0 if there are none */
+        double mean() const;
+
+        /** number of values per bucket, empty if count is 0 */
+        std::vector<std::uint64_t> buckets;
+        std::uint64_t   count   = 0;
+        /** seconds, sum of the values */
+        double          sum     = 0;
+        /** seconds, largest value */
+        double          max     = 0;
+    };
+
+    /** Histograms of one executable, keyed by the file name of args[0] */
+    struct ProgramMetrics {
+        /** from starting the spawn to having the pid */
+        Histogram spawn_latency;
+        /** from the exit being seen to its Popen collecting it. Only known
+            while the reaper runs, and on windows. Without the reaper a
+            posix exit is seen by being collected.
+        */
+        Histogram reap_latency;
+        /** from spawn to the exit being collected, ProcessUsage::wall_time */
+        Histogram run_duration;
+    };
+
+    /** Bytes moved through each kind of redirection */
+    struct SinkBytes {
+        /** read into std::string captures, PipeOption::memfd included */
+        std::int64_t capture    = 0;
+        /** read into std::ostream* */
+        std::int64_t stream     = 0;
+        /** read into FILE* */
+        std::int64_t file       = 0;
+        /** read and thrown away, pipe_ignore_and_close() */
+        std::int64_t discard    = 0;
+        /** handed to ProcessWatcher callbacks */
+        std::int64_t callback   = 0;
+        /** written to cin, from any source */
+        std::int64_t input      = 0;
+    };
+
+    /** Library wide counters, see metrics_snapshot(). Gauges and counts
+        are over the whole program since it started.
+    */
+    struct MetricsSnapshot {
+        /** processes started */
+        std::int64_t    spawned         = 0;
+        /** started, exit not seen yet */
+        std::int64_t    running         = 0;
+        /** exited and not yet collected by their Popen. Only seen while the
+            reaper runs, without it a posix exit is seen by being collected.
+        */
+        std::int64_t    zombie          = 0;
+        /** collected with a non zero returncode, killed by a signal included */
+        std::int64_t    failed          = 0;
+        /** starts that threw, CommandNotFoundError included */
+        std::int64_t    spawn_errors    = 0;
+        /** threads the library runs for background I/O and reaping */
+        std::int64_t    helper_threads  = 0;
+        SinkBytes       sink_bytes;
+        /** bytes held in captures of processes still being serviced */
+        std::int64_t    capture_buffered = 0;
+        std::map<std::string, ProgramMetrics> programs;
+    };
+
+    /** @return the current metrics, safe to call from any thread.
+
+        Metrics are always on. Each thread updates its own atomic counters
+        with relaxed adds, a snapshot sums them up. A counter updated while
+        the snapshot is taken may or may not be included.
+    */
+    MetricsSnapshot metrics_snapshot();
+
+    namespace details {
+        enum class Metric {
+            spawned,
+            running,
+            zombie,
+            failed,
+            spawn_errors,
+            helper_threads,
+            capture_bytes,
+            stream_bytes,
+            file_bytes,
+            discard_bytes,
+            callback_bytes,
+            input_bytes,
+            capture_buffered,
+            count
+        };
+
+        /** Adds value to a counter of the calling thread. */
+        void metric_add(Metric metric, std::int64_t value=1);
+        /** A process of args was started, taking latency seconds. */
+        void metric_spawned(const CommandLine& args, double latency);
+        /** The exit of a process of args was collected by its Popen.
+
+            @param zombie       it was counted as a zombie rather than running.
+            @param reap_latency seconds since the exit was seen, -1 if unknown.
+        */
+        void metric_collected(const CommandLine& args, int returncode, bool zombie,
+            double run_duration, double reap_latency);
+
+        /** Counts bytes read into a capture, as buffered until destroyed. */
+        class CaptureMeter {
+        public:
+            CaptureMeter(){}
+            ~CaptureMeter();
+            CaptureMeter(CaptureMeter&& other) : mBuffered(other.mBuffered) {
+                other.mBuffered = 0;
+            }
+            CaptureMeter(const CaptureMeter&)=delete;
+            CaptureMeter& operator=(const CaptureMeter&)=delete;
+
+            void add(std::size_t bytes);
+        private:
+            std::int64_t mBuffered = 0;
+        };
+
+        /** Counts the thread as a helper thread while it lives. */
+        class HelperThreadMetric {
+        public:
+            HelperThreadMetric() { metric_add(Metric::helper_threads, 1); }
+            ~HelperThreadMetric() { metric_add(Metric::helper_threads, -1); }
+            HelperThreadMetric(const HelperThreadMetric&)=delete;
+            HelperThreadMetric& operator=(const HelperThreadMetric&)=delete;
+        };
+    }
+}
@@ -1,6 +1,10 @@
 #pragma once
 
+#if __cplusplus >= 202002L
+#include <span>
+#endif
 #include <string>
+#include <string_view>
 #include <variant>
 #include <iostream>
 #include <cstdio>
@@ -9,17 +13,35 @@
 #include "pipe.hpp"
 
 namespace subprocess {
+    /** Data for cin borrowed from the caller, nothing is copied.
+
+        The memory must stay valid until the process has been fed all of it,
+        that is until run() returns or the Popen is waited on / destroyed.
+    */
+    struct InputView {
+        InputView(std::string_view data) : data(data) {}
+#if __cplusplus >= 202002L
+        InputView(std::span<const std::byte> data)
+            : data(reinterpret_cast<const char*>(data.data()), data.size()) {}
+#endif
+
+        std::string_view data;
+    };
+
     enum class PipeVarIndex {
         option,
         string,
         handle,
         istream,
         ostream,
-        file
+        file,
+        view,
+        shared_input
     };
 
     typedef std::variant<PipeOption, std::string, PipeHandle,
-        std::istream*, std::ostream*, FILE*> PipeVar;
+        std::istream*, std::ostream*, FILE*, InputView,
+        const SharedInput*> PipeVar;
 
 
     inline PipeOption get_pipe_option(const PipeVar& option) {
@@ -0,0 +1,102 @@
+#include "Pipeline.hpp"
+
+#include <stdexcept>
+#include <tuple>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+namespace subprocess {
+    Pipeline::Pipeline(std::initializer_list<CommandLine> commands) {
+        for (auto& command : commands)
+            add(command, {});
+    }
+
+    Pipeline& Pipeline::add(CommandLine command, RunOptions options) {
+        mStages.push_back({std::move(command), std::move(options)});
+        return *this;
+    }
+
+    std::vector<Popen> Pipeline::start(std::vector<Stage> stages) const {
+        if (stages.empty())
+            throw std::invalid_argument("Pipeline: no stages");
+        std::vector<Popen> processes;
+        processes.reserve(stages.size());
+        try {
+            // read end of the pipe the next stage reads from
+            PipePair previous;
+            for (std::size_t i = 0; i < stages.size(); ++i) {
+                RunOptions& options = stages[i].options;
+                PipePair next;
+                if (i > 0)
+                    options.cin = previous.input;
+                if (i+1 < stages.size()) {
+                    next = pipe_create(false);
+#if defined(__linux__)
+                    if (mPipeSize > 0)
+                        fcntl(next.output, F_SETPIPE_SZ, (int)mPipeSize);
+#endif
+                    options.cout = next.output;
+                }
+                processes.emplace_back(stages[i].command, std::move(options));
+                // the child has its ends, ours would keep the pipe open
+                previous.close();
+                next.close_output();
+                previous = std::move(next);
+            }
+        } catch (...) {
+            for (auto& process : processes)
+                process.kill();
+            throw;
+        }
+        return processes;
+    }
+
+    std::vector<Popen> Pipeline::popen() const {
+        return start(mStages);
+    }
+
+    CompletedPipeline Pipeline::run() const {
+        std::vector<Stage> stages = mStages;
+#ifndef _WIN32
+        for (std::size_t i = 0; i+1 < stages.size(); ++i) {
+            // nobody reads it until the last stage is done
+            PipeVar& cerr = stages[i].options.cerr;
+            if (static_cast<PipeVarIndex>(cerr.index()) == PipeVarIndex::option
+                && std::get<PipeOption>(cerr) == PipeOption::pipe)
+                cerr = PipeOption::memfd;
+        }
+#endif
+        std::vector<Popen> processes = start(stages);
+        processes.front().close_cin();
+
+        CompletedPipeline completed;
+        completed.stages.resize(processes.size());
+        // the last stage first, it's the one that drains the rest
+        for (std::size_t i = processes.size(); i-- > 0;) {
+            CompletedProcess& stage = completed.stages[i];
+            std::tie(stage.cout, stage.cerr) = processes[i].communicate();
+            stage.returncode    = processes[i].returncode;
+            stage.usage         = processes[i].usage;
+            stage.args          = stages[i].command;
+        }
+        completed.returncode = 0;
+        for (auto it = completed.stages.rbegin(); it != completed.stages.rend(); ++it) {
+            if (it->returncode == 0)
+                continue;
+            completed.returncode = it->returncode;
+            if (mCheck) {
+                CalledProcessError error("failed to execute " + it->args[0]);
+                error.cmd           = it->args;
+                error.returncode    = it->returncode;
+                error.cout          = it->cout;
+                error.cerr          = it->cerr;
+                error.usage         = it->usage;
+                throw error;
+            }
+            break;
+        }
+        return completed;
+    }
+}
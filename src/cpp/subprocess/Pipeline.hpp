@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+
+#include "ProcessBuilder.hpp"
+
+namespace subprocess {
+    /** Result of Pipeline::run(), one CompletedProcess per stage. */
+    struct CompletedPipeline {
+        std::vector<CompletedProcess> stages;
+        /** Like bash's pipefail: returncode of the last stage that failed, 0
+            if all succeeded.
+        */
+        int returncode = -1;
+
+        /** @return captured cout of the last stage */
+        const std::string& cout() const { return stages.back().cout; }
+        explicit operator bool() const {
+            return returncode == 0;
+        }
+    };
+
+    /** Commands connected like a shell's `a | b | c`.
+
+        Each stage's cout is connected to the next stage's cin by a pipe
+        going directly from child to child, the data never passes through
+        us. On posix every end stays close-on-exec in the parent, only the
+        child's dup2 onto stdin or stdout makes it inheritable, and it's
+        closed as soon as the stage using it started. So each child only
+        holds its own ends, processes spawned concurrently by other threads
+        hold none, and EOF propagates as it would in a shell. On windows an
+        end is inheritable while its stage is being created, a process
+        another thread creates at that moment may hold it.
+
+        The RunOptions of a stage apply as usual, except cin of all but the
+        first stage and cout of all but the last stage, which are the pipes.
+
+        @code
+        auto completed = Pipeline()
+            .add({"git", "log", "--format=%an"})
+            .add({"sort"})
+            .add({"uniq", "-c"}, RunBuilder().cout(PipeOption::pipe).options)
+            .run();
+        @endcode
+    */
+    class Pipeline {
+    public:
+        Pipeline(){}
+        /** Stages with default RunOptions */
+        Pipeline(std::initializer_list<CommandLine> commands);
+
+        /** Adds a stage reading the cout of the previous one. */
+        Pipeline& add(CommandLine command, RunOptions options);
+        /** Adds a stage reading the cout of the previous one. */
+        Pipeline& add(RunBuilder stage) {
+            return add(std::move(stage.command), std::move(stage.options));
+        }
+        /** Capacity in bytes to set for the pipes between stages, 0 leaves
+            the system default. Bigger pipes mean fewer context switches for
+            bulk data. linux only, ignored elsewhere.
+        */
+        Pipeline& pipe_size(std::size_t size) { mPipeSize = size; return *this; }
+        /** run() throws CalledProcessError if any stage fails. */
+        Pipeline& check(bool check) { mCheck = check; return *this; }
+
+        /** Starts all the stages.
+
+            @return a Popen per stage, in order.
+
+            @throw same as Popen's constructor. Stages already started are
+                   killed.
+        */
+        std::vector<Popen> popen() const;
+        /** Starts all stages and waits for them to complete.
+
+            PipeOption::pipe cout of the last stage and cerr of any stage
+            are captured. cerr of all but the last stage goes through
+            PipeOption::memfd on posix so no stage blocks on it. A cin pipe of
+            the first stage is closed.
+
+            @throw CalledProcessError   if check is set and a stage failed,
+                                        for the last stage that failed.
+        */
+        CompletedPipeline run() const;
+
+        std::size_t size() const { return mStages.size(); }
+
+    private:
+        struct Stage {
+            CommandLine command;
+            RunOptions  options;
+        };
+        std::vector<Popen> start(std::vector<Stage> stages) const;
+
+        std::vector<Stage>  mStages;
+        std::size_t         mPipeSize   = 0;
+        bool                mCheck      = false;
+    };
+}
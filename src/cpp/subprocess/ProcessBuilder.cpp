@@ -1,7 +1,7 @@
 #include "ProcessBuilder.hpp"
 
 #ifdef _WIN32
-
+#include <psapi.h>
 #else
 #include <spawn.h>
 #if defined(__APPLE__) || defined(__FreeBSD__)
@@ -11,14 +11,31 @@
 #endif
 #include <errno.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#endif
 #endif
 
 #include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <tuple>
 #include <thread>
 #include <mutex>
 #include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <sstream>
 
+#include "Metrics.hpp"
+#include "ProcessReaper.hpp"
+#include "Trace.hpp"
 #include "shell_utils.hpp"
 #include "utf8_to_utf16.hpp"
 
@@ -45,25 +62,86 @@ namespace subprocess {
             message += std::strerror(errno_code);
             throw OSError(message);
         }
+#ifndef _WIN32
+#if defined(__linux__) && !defined(SYS_pidfd_open)
+        // same number on every architecture, missing from older headers
+        #define SYS_pidfd_open 434
+#endif
+#if defined(__linux__) && !defined(SYS_pidfd_send_signal)
+        #define SYS_pidfd_send_signal 424
+#endif
+        int pidfd_open(pid_t pid) {
+#if defined(__linux__)
+            // ENOSYS on kernels older than 5.3, callers fall back to polling
+            int fd = (int)syscall(SYS_pidfd_open, pid, 0);
+            return fd < 0? -1 : fd;
+#else
+            (void)pid;
+            return -1;
+#endif
+        }
+
+        bool wait_for_exit(pid_t pid, int pidfd, double seconds) {
+            timespec ts = {};
+            timespec* timeout = nullptr;
+            if (seconds >= 0) {
+                ts.tv_sec   = (time_t)seconds;
+                ts.tv_nsec  = (long)((seconds - (double)ts.tv_sec)*1e9);
+                timeout     = &ts;
+            }
+#if defined(__linux__)
+            if (pidfd >= 0) {
+                pollfd pfd = {};
+                pfd.fd      = pidfd;
+                pfd.events  = POLLIN;
+                int ret = ppoll(&pfd, 1, timeout, nullptr);
+                if (ret < 0 && errno != EINTR)
+                    throw_os_error("ppoll", errno);
+                return ret > 0;
+            }
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+            (void)pidfd;
+            int queue = kqueue();
+            if (queue >= 0) {
+                struct kevent change;
+                struct kevent event;
+                EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, nullptr);
+                int ret = kevent(queue, &change, 1, &event, 1, timeout);
+                int error = errno;
+                ::close(queue);
+                if (ret < 0) {
+                    // ESRCH: already exited before we could register
+                    if (error == ESRCH)
+                        return true;
+                    if (error != EINTR)
+                        throw_os_error("kevent", error);
+                    return false;
+                }
+                if (ret > 0 && (event.flags & EV_ERROR))
+                    return event.data == ESRCH;
+                return ret > 0;
+            }
+#endif
+            (void)pid;
+            (void)pidfd;
+            // nothing the kernel can wake us up with, nap for a bit instead
+            sleep_seconds(seconds < 0? 0.001 : std::min(seconds, 0.001));
+            return false;
+        }
+#endif
     }
     double monotonic_seconds() {
-        static bool needs_init = true;
-        static std::chrono::steady_clock::time_point begin;
-        static double last_value = 0;
-        if (needs_init) {
-            begin = std::chrono::steady_clock::now();
-            needs_init = false;
-        }
-        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-        std::chrono::duration<double> duration = now - begin;
-        double result = duration.count();
+        // called from helper threads too, a function local static is
+        // initialized thread safely. steady_clock never goes backwards.
+        static const std::chrono::steady_clock::time_point begin
+            = std::chrono::steady_clock::now();
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - begin;
+        return duration.count();
+    }
 
-        // some OS's have bugs and not exactly monotonic. Or perhaps there is
-        // floating point errors or something. I don't know.
-        if (result < last_value)
-            return last_value;
-        last_value = result;
-        return result;
+    double system_seconds() {
+        std::chrono::duration<double> duration = std::chrono::system_clock::now().time_since_epoch();
+        return duration.count();
     }
 
     double sleep_seconds(double seconds) {
@@ -89,75 +167,7 @@ namespace subprocess {
     private:
         PipeHandle mHandle;
     };
-    std::thread pipe_thread(PipeHandle input, std::ostream* output) {
-        return std::thread([=]() {
-            AutoClosePipe autoclose(input);
-            std::vector<char> buffer(2048);
-            while (true) {
-                ssize_t transfered = pipe_read(input, &buffer[0], buffer.size());
-                if (transfered <= 0)
-                    break;
-                output->write(&buffer[0], transfered);
-            }
-        });
-    }
-
-    std::thread pipe_thread(PipeHandle input, FILE* output) {
-        return std::thread([=]() {
-            AutoClosePipe autoclose(input);
-            std::vector<char> buffer(2048);
-            while (true) {
-                ssize_t transfered = pipe_read(input, &buffer[0], buffer.size());
-                if (transfered <= 0)
-                    break;
-                fwrite(&buffer[0], 1, transfered, output);
-            }
-        });
-    }
-    std::thread pipe_thread(FILE* input, PipeHandle output) {
-        return std::thread([=]() {
-            AutoClosePipe autoclose(output);
-            std::vector<char> buffer(2048);
-            while (true) {
-                ssize_t transfered = fread(&buffer[0], 1, buffer.size(), input);
-                if (transfered <= 0)
-                    break;
-                pipe_write(output, &buffer[0], transfered);
-            }
-        });
-    }
-    std::thread pipe_thread(std::string& input, PipeHandle output) {
-        return std::thread([input(move(input)), output]() {
-            AutoClosePipe autoclose(output);
-
-            std::size_t pos = 0;
-            while (pos < input.size()) {
-                ssize_t transfered = pipe_write(output, input.c_str()+pos, input.size() - pos);
-                if (transfered <= 0)
-                    break;
-                pos += transfered;
-            }
-        });
-    }
-    std::thread pipe_thread(std::istream* input, PipeHandle output) {
-        return std::thread([=]() {
-            AutoClosePipe autoclose(output);
-            std::vector<char> buffer(2048);
-            while (true) {
-                input->read(&buffer[0], buffer.size());
-                ssize_t transfered = input->gcount();
-                if (input->bad())
-                    break;
-                if (transfered <= 0) {
-                    if (input->eof())
-                        break;
-                    continue;
-                }
-                pipe_write(output, &buffer[0], transfered);
-            }
-        });
-    }
-    std::thread setup_redirect_stream(PipeHandle input, PipeVar& output) {
+    details::IoTask setup_redirect_stream(PipeHandle input, PipeVar& output) {
         PipeVarIndex index = static_cast<PipeVarIndex>(output.index());
 
         switch (index) {
@@ -166,16 +176,18 @@ namespace subprocess {
         case PipeVarIndex::option: break;
         case PipeVarIndex::string: // doesn't make sense
         case PipeVarIndex::istream: // doesn't make sense
+        case PipeVarIndex::view:
+        case PipeVarIndex::shared_input:
             throw std::domain_error("expected something to output to");
         case PipeVarIndex::ostream:
-            return pipe_thread(input, std::get<std::ostream*>(output));
+            return details::io_read(input, std::get<std::ostream*>(output));
         case PipeVarIndex::file:
-            return pipe_thread(input, std::get<FILE*>(output));
+            return details::io_read(input, std::get<FILE*>(output));
         }
         return {};
     }
 
-    std::thread setup_redirect_stream(PipeVar& input, PipeHandle output) {
+    details::IoTask setup_redirect_stream(PipeVar& input, PipeHandle output) {
         PipeVarIndex index = static_cast<PipeVarIndex>(input.index());
 
         switch (index) {
@@ -183,13 +195,22 @@ namespace subprocess {
         case PipeVarIndex::handle:
         case PipeVarIndex::option: break;
         case PipeVarIndex::string:
-            return pipe_thread(std::get<std::string>(input), output);
+            return details::io_write(std::move(std::get<std::string>(input)), output);
         case PipeVarIndex::istream:
-            return pipe_thread(std::get<std::istream*>(input), output);
+            return details::io_write(std::get<std::istream*>(input), output);
         case PipeVarIndex::ostream:
             throw std::domain_error("reading from std::ostream doesn't make sense");
         case PipeVarIndex::file:
-            return pipe_thread(std::get<FILE*>(input), output);
+            return details::io_write(std::get<FILE*>(input), output);
+        case PipeVarIndex::view:
+            return details::io_write_view(std::get<InputView>(input).data, output);
+        case PipeVarIndex::shared_input:
+#ifdef _WIN32
+            return details::io_write_view(std::get<const SharedInput*>(input)->data(), output);
+#else
+            // the child reads the file itself
+            break;
+#endif
         }
 
         return {};
@@ -216,6 +237,19 @@ namespace subprocess {
             if (builder.cin_pipe == kBadPipeValue)
                 throw std::invalid_argument("bad pipe value for cin");
         }
+#ifndef _WIN32
+        // each child gets its own handle & offset into the shared file
+        PipeHandle shared_handle = kBadPipeValue;
+        if (std::holds_alternative<const SharedInput*>(options.cin)) {
+            const SharedInput* shared = std::get<const SharedInput*>(options.cin);
+            if (shared == nullptr)
+                throw std::invalid_argument("Popen constructor: SharedInput is null");
+            shared_handle       = shared->open();
+            builder.cin_option  = PipeOption::specific;
+            builder.cin_pipe    = shared_handle;
+        }
+        AutoClosePipe shared_cin(shared_handle);
+#endif
         if (builder.cout_option == PipeOption::specific) {
             builder.cout_pipe = std::get<PipeHandle>(options.cout);
             if (builder.cout_pipe == kBadPipeValue)
@@ -227,16 +261,25 @@ namespace subprocess {
                 throw std::invalid_argument("Popen constructor: bad pipe value for cout");
         }
 
+#ifdef _WIN32
+        // no anonymous files to redirect to, capture through a pipe instead
+        if (builder.cout_option == PipeOption::memfd)
+            builder.cout_option = PipeOption::pipe;
+        if (builder.cerr_option == PipeOption::memfd)
+            builder.cerr_option = PipeOption::pipe;
+#endif
         builder.new_process_group = options.new_process_group;
-        builder.env = options.env;
+        builder.env = std::move(options.env);
+        builder.env_overlay = std::move(options.env_overlay);
         builder.cwd = options.cwd;
+        builder.spawn_backend = options.spawn_backend;
 
         *this = builder.run_command(command);
 
         cin_thread = setup_redirect_stream(options.cin, cin);
         cout_thread = setup_redirect_stream(cout, options.cout);
         cerr_thread = setup_redirect_stream(cerr, options.cerr);
-        // the background thread will take ownership and auto close the pipe
+        // the background I/O takes ownership and closes the pipe
         if (cin_thread.joinable())
             cin = kBadPipeValue;
         if (cout_thread.joinable())
@@ -257,11 +300,16 @@ namespace subprocess {
 
         pid = other.pid;
         returncode = other.returncode;
+        usage = other.usage;
         args = std::move(other.args);
 
 #ifdef _WIN32
         process_info = other.process_info;
         other.process_info = {0};
+#else
+        pidfd = other.pidfd;
+        other.pidfd = -1;
+        exit_state = std::move(other.exit_state);
 #endif
 
         other.cin = kBadPipeValue;
@@ -269,6 +317,7 @@ namespace subprocess {
         other.cerr = kBadPipeValue;
         other.pid = 0;
         other.returncode = -1000;
+        other.usage = {};
 
         cin_thread = std::move(other.cin_thread);
         cout_thread = std::move(other.cout_thread);
@@ -280,12 +329,15 @@ namespace subprocess {
         close();
     }
     void Popen::close() {
-        if (cin_thread.joinable())
-            cin_thread.join();
-        if (cout_thread.joinable())
-            cout_thread.join();
-        if (cerr_thread.joinable())
-            cerr_thread.join();
+        if (cin_thread.joinable() || cout_thread.joinable() || cerr_thread.joinable()) {
+            details::TraceSpan span("join", pid);
+            if (cin_thread.joinable())
+                cin_thread.join();
+            if (cout_thread.joinable())
+                cout_thread.join();
+            if (cerr_thread.joinable())
+                cerr_thread.join();
+        }
         if (cin != kBadPipeValue)
             pipe_close(cin);
         if (cout != kBadPipeValue)
@@ -296,16 +348,64 @@ namespace subprocess {
 
         // do this to not have zombie processes.
         if (pid) {
-            wait();
 #ifdef _WIN32
+            wait();
             CloseHandle(process_info.hProcess);
             CloseHandle(process_info.hThread);
+#else
+            // the reaper collects it whenever it exits
+            if (!exit_state || exit_state->state == details::ExitState::kDetached) {
+                wait();
+            } else if (exit_state->tally.exchange(details::ExitState::kTallyReleased)
+                    == details::ExitState::kTallyZombie) {
+                details::metric_add(details::Metric::zombie, -1);
+            }
 #endif
         }
+#ifndef _WIN32
+        if (exit_state)
+            exit_state = nullptr;
+        else if (pidfd >= 0)
+            ::close(pidfd);
+        pidfd = -1;
+#endif
         pid = 0;
         returncode = kBadReturnCode;
+        usage = {};
         args.clear();
     }
+
+    void Popen::finish_usage() {
+        double now = monotonic_seconds();
+        usage.wall_time = now - usage.start_monotonic;
+        // known already when the reaper or windows saw the exit
+        double reap_latency = -1;
+        if (usage.exit_time == 0)
+            usage.exit_time = system_seconds();
+        else
+            reap_latency = std::max(0.0, system_seconds() - usage.exit_time);
+        usage.collected = true;
+        bool zombie = false;
+#ifndef _WIN32
+        zombie = exit_state && exit_state->tally.exchange(
+            details::ExitState::kTallyReleased) == details::ExitState::kTallyZombie;
+#endif
+        details::metric_collected(args, returncode, zombie, usage.wall_time, reap_latency);
+        if (details::trace_on()) {
+            details::trace_span("process", usage.start_monotonic, now, pid,
+                "returncode " + std::to_string(returncode), pid);
+        }
+    }
+
+    namespace details {
+        void output_seen(Popen& popen) {
+            if (popen.usage.first_output >= 0)
+                return;
+            popen.usage.first_output = monotonic_seconds() - popen.usage.start_monotonic;
+            if (trace_on())
+                trace_instant("first output", popen.pid);
+        }
+    }
 #ifdef _WIN32
     std::string lastErrorString() {
         LPTSTR lpMsgBuf = nullptr;
@@ -397,6 +497,34 @@ namespace subprocess {
         }
     }
 
+    PipeHandle Popen::exit_handle() const {
+        return process_info.hProcess? process_info.hProcess : kBadPipeValue;
+    }
+
+    /** @return 100ns FILETIME units as seconds */
+    static double filetime_seconds(const FILETIME& time) {
+        ULARGE_INTEGER value;
+        value.LowPart   = time.dwLowDateTime;
+        value.HighPart  = time.dwHighDateTime;
+        return value.QuadPart/1e7;
+    }
+
+    /** Fills usage from the exited process. */
+    static void collect_usage(HANDLE process, ProcessUsage& usage) {
+        FILETIME creation, exit, kernel, user;
+        if (GetProcessTimes(process, &creation, &exit, &kernel, &user)) {
+            usage.user_cpu      = filetime_seconds(user);
+            usage.system_cpu    = filetime_seconds(kernel);
+            // FILETIME counts from 1601, 11644473600 seconds before 1970
+            usage.exit_time     = filetime_seconds(exit) - 11644473600.0;
+        }
+        PROCESS_MEMORY_COUNTERS memory = {};
+        if (K32GetProcessMemoryInfo(process, &memory, sizeof(memory))) {
+            usage.max_rss       = memory.PeakWorkingSetSize;
+            usage.minor_faults  = memory.PageFaultCount;
+        }
+    }
+
     bool Popen::poll() {
         if (returncode != kBadReturnCode)
             return true;
@@ -408,22 +536,29 @@ namespace subprocess {
             throw OSError("unkown error wait_for_process failed");
         }
         returncode = exit_code;
+        collect_usage(process_info.hProcess, usage);
+        finish_usage();
         return true;
     }
 
     int Popen::wait(double timeout) {
         if (returncode != kBadReturnCode)
             return returncode;
+        details::TraceSpan span("wait", pid);
         DWORD ms = timeout < 0 ? INFINITE : (DWORD)(timeout*1000.0);
         DWORD exit_code = 0;
         DWORD result = wait_for_process(process_info.hProcess, &exit_code, ms);
         if (result == WAIT_TIMEOUT) {
-            throw TimeoutExpired("timeout of " + std::to_string(ms) + " expired");
+            TimeoutExpired expired("timeout of " + std::to_string(ms) + " expired");
+            expired.usage = usage;
+            throw expired;
         } else if (result != WAIT_OBJECT_0) {
             throw OSError("unkown error wait_for_process failed");
         }
 
         returncode = exit_code;
+        collect_usage(process_info.hProcess, usage);
+        finish_usage();
         return returncode;
     }
 
@@ -447,12 +582,158 @@ namespace subprocess {
         }
         return success;
     }
+
+    std::pair<std::string, std::string> Popen::communicate(std::string_view input, double timeout) {
+        // no poll() for anonymous pipes on windows, threads it is.
+        double deadline = timeout < 0? -1 : monotonic_seconds() + timeout;
+        std::string cout_data;
+        std::string cerr_data;
+        std::thread cin_thread;
+        std::thread cout_thread;
+        std::thread cerr_thread;
+        // threads still exchanging, so the timeout can cover them
+        std::mutex running_mutex;
+        std::condition_variable running_changed;
+        int running = 0;
+        auto start = [&](std::thread& thread, auto function) {
+            {
+                std::lock_guard<std::mutex> lock(running_mutex);
+                ++running;
+            }
+            thread = std::thread([&, function]() {
+                function();
+                std::lock_guard<std::mutex> lock(running_mutex);
+                --running;
+                running_changed.notify_all();
+            });
+        };
+        if (cin != kBadPipeValue) {
+            start(cin_thread, [&]() {
+                details::HelperThreadMetric helper;
+                std::size_t pos = 0;
+                while (pos < input.size()) {
+                    ssize_t transferred = pipe_write(cin, input.data() + pos, input.size() - pos);
+                    if (transferred <= 0)
+                        break;
+                    pos += transferred;
+                }
+                details::metric_add(details::Metric::input_bytes, pos);
+                close_cin();
+            });
+        }
+        std::mutex first_output_mutex;
+        details::CaptureMeter cout_meter;
+        details::CaptureMeter cerr_meter;
+        auto read_output = [&](PipeHandle& handle, std::string& data,
+            details::CaptureMeter& meter
+        ) {
+            details::HelperThreadMetric helper;
+            char first[1];
+            if (pipe_read(handle, first, sizeof(first)) == 1) {
+                {
+                    std::lock_guard<std::mutex> lock(first_output_mutex);
+                    details::output_seen(*this);
+                }
+                data.assign(first, 1);
+                data += pipe_read_all(handle);
+                meter.add(data.size());
+            }
+            if (details::trace_on())
+                details::trace_instant(&handle == &cout? "cout EOF" : "cerr EOF", pid);
+            pipe_close(handle);
+            handle = kBadPipeValue;
+        };
+        if (cout != kBadPipeValue)
+            start(cout_thread, [&]() { read_output(cout, cout_data, cout_meter); });
+        if (cerr != kBadPipeValue)
+            start(cerr_thread, [&]() { read_output(cerr, cerr_data, cerr_meter); });
+        bool timed_out = false;
+        {
+            std::unique_lock<std::mutex> lock(running_mutex);
+            while (running > 0 && !timed_out) {
+                if (deadline < 0) {
+                    running_changed.wait(lock);
+                    continue;
+                }
+                double remaining = deadline - monotonic_seconds();
+                timed_out = remaining <= 0;
+                if (!timed_out)
+                    running_changed.wait_for(lock, std::chrono::duration<double>(remaining));
+            }
+            // ReadFile & WriteFile only return early once cancelled. A thread
+            // not blocked yet when cancelled is cancelled again.
+            while (running > 0) {
+                for (std::thread* thread : {&cin_thread, &cout_thread, &cerr_thread}) {
+                    if (thread->joinable())
+                        CancelSynchronousIo(thread->native_handle());
+                }
+                running_changed.wait_for(lock, std::chrono::milliseconds(10));
+            }
+        }
+        for (std::thread* thread : {&cin_thread, &cout_thread, &cerr_thread}) {
+            if (thread->joinable())
+                thread->join();
+        }
+        try {
+            if (timed_out) {
+                TimeoutExpired error("timeout of " + std::to_string(timeout) + " seconds expired");
+                error.usage = usage;
+                throw error;
+            }
+            wait(deadline < 0? -1 : std::max(0.0, deadline - monotonic_seconds()));
+        } catch (TimeoutExpired& expired) {
+            expired.cmd     = args;
+            expired.timeout = timeout;
+            expired.cout    = std::move(cout_data);
+            expired.cerr    = std::move(cerr_data);
+            expired.usage   = usage;
+            throw;
+        }
+        return {std::move(cout_data), std::move(cerr_data)};
+    }
 #else
+    PipeHandle Popen::exit_handle() const {
+        return pidfd >= 0? pidfd : kBadPipeValue;
+    }
+
+    static double timeval_seconds(const struct timeval& time) {
+        return time.tv_sec + time.tv_usec/1e6;
+    }
+
+    /** Fills usage from what the kernel reported when reaping. */
+    static void collect_usage(const struct rusage& resources, ProcessUsage& usage) {
+        usage.user_cpu      = timeval_seconds(resources.ru_utime);
+        usage.system_cpu    = timeval_seconds(resources.ru_stime);
+#ifdef __APPLE__
+        // bytes on mac, kilobytes elsewhere
+        usage.max_rss       = resources.ru_maxrss;
+#else
+        usage.max_rss       = (int64_t)resources.ru_maxrss*1024;
+#endif
+        usage.minor_faults          = resources.ru_minflt;
+        usage.major_faults          = resources.ru_majflt;
+        usage.voluntary_switches    = resources.ru_nvcsw;
+        usage.involuntary_switches  = resources.ru_nivcsw;
+    }
+
     bool Popen::poll() {
         if (returncode != kBadReturnCode)
             return true;
+        if (exit_state) {
+            switch (exit_state->state.load(std::memory_order_acquire)) {
+            case details::ExitState::kRunning:
+                return false;
+            case details::ExitState::kExited:
+                returncode = exit_state->returncode;
+                collect_usage(exit_state->usage, usage);
+                usage.exit_time = system_seconds() - (monotonic_seconds() - exit_state->exited);
+                finish_usage();
+                return true;
+            }
+        }
         int exit_code;
-        auto child = waitpid(pid, &exit_code, WNOHANG);
+        struct rusage resources = {};
+        auto child = wait4(pid, &exit_code, WNOHANG, &resources);
         if (child == 0)
             return false;
         if (child > 0) {
@@ -463,16 +744,37 @@ namespace subprocess {
             } else {
                 returncode = 1;
             }
+            collect_usage(resources, usage);
+            finish_usage();
         }
         return child > 0;
     }
     int Popen::wait(double timeout) {
         if (returncode != kBadReturnCode)
             return returncode;
+        details::TraceSpan span("wait", pid);
+        auto throw_timeout = [&]() {
+            TimeoutExpired expired("timeout of " + std::to_string(timeout) + " seconds expired");
+            expired.cmd     = args;
+            expired.timeout = timeout;
+            expired.usage   = usage;
+            throw expired;
+        };
+        double deadline = monotonic_seconds() + timeout;
+        if (exit_state) {
+            if (!exit_state->wait(timeout))
+                throw_timeout();
+            if (poll())
+                return returncode;
+            // the reaper stopped, wait on our own for the rest
+            if (timeout >= 0)
+                timeout = std::max(0.0, deadline - monotonic_seconds());
+        }
         if (timeout < 0) {
             int exit_code;
+            struct rusage resources = {};
             while (true) {
-                pid_t child = waitpid(pid, &exit_code,0);
+                pid_t child = wait4(pid, &exit_code, 0, &resources);
                 if (child == -1 && errno == EINTR) {
                     continue;
                 }
@@ -488,23 +790,382 @@ namespace subprocess {
             } else {
                 returncode = 1;
             }
+            collect_usage(resources, usage);
+            finish_usage();
             return returncode;
         }
-        StopWatch watch;
-
-        while (watch.seconds() < timeout) {
-            if (poll())
-                return returncode;
-            sleep_seconds(0.00001);
+        while (!poll()) {
+            double remaining = deadline - monotonic_seconds();
+            if (remaining <= 0)
+                throw_timeout();
+            details::wait_for_exit(pid, pidfd, remaining);
         }
-        throw TimeoutExpired("no time");
+        return returncode;
     }
 
     bool Popen::send_signal(int signum) {
-        if (returncode != kBadReturnCode)
+        // takes in an exit the reaper already collected, the pid may be
+        // someone else's by now
+        if (pid == 0 || poll())
             return false;
+#if defined(__linux__)
+        // can't reach another process even if the pid was reused
+        if (pidfd >= 0) {
+            if (syscall(SYS_pidfd_send_signal, pidfd, signum, nullptr, 0) == 0)
+                return true;
+            if (errno != ENOSYS)
+                return false;
+        }
+#endif
         return ::kill(pid, signum) == 0;
     }
+
+    namespace {
+        /** Where communicate() gets the data for cin from.
+
+            Reading never blocks exchange(): a FILE* with a fileno is
+            polled and read no further than what's waiting, any other
+            FILE* or std::istream but a std::stringbuf is pumped into a
+            pipe by a helper thread.
+        */
+        struct InputSource {
+            std::string_view    data;
+            std::istream*       stream  = nullptr;
+            FILE*               file    = nullptr;
+            /** polled for more once data is used up, the fileno of file or
+                the pipe pump fills. kBadPipeValue when there's none.
+            */
+            PipeHandle          source  = kBadPipeValue;
+            /** fills source, which is ours to close */
+            std::thread         pump;
+            bool                pumped  = false;
+            std::string         chunk;
+
+            InputSource(){}
+            InputSource(const InputSource&)=delete;
+            InputSource& operator=(const InputSource&)=delete;
+            ~InputSource() {
+                close_pump();
+            }
+            void close_pump() {
+                if (!pumped)
+                    return;
+                // the pump stops at its next write
+                if (source != kBadPipeValue)
+                    pipe_close(source);
+                source = kBadPipeValue;
+                pumped = false;
+                if (pump.joinable())
+                    pump.join();
+            }
+
+            void start() {
+                if (stream && dynamic_cast<std::stringbuf*>(stream->rdbuf()))
+                    return;
+                if (file && fileno(file) >= 0) {
+                    source = fileno(file);
+                    return;
+                }
+                if (!stream && !file)
+                    return;
+                PipePair pipe = pipe_create();
+                source = pipe.input;
+                pumped = true;
+                pipe.disown_input();
+                pump = std::thread([stream = stream, file = file, output = pipe.output]() {
+                    details::HelperThreadMetric metric;
+                    char buffer[64*1024];
+                    while (true) {
+                        std::size_t size;
+                        if (stream) {
+                            stream->read(buffer, sizeof(buffer));
+                            size = stream->gcount();
+                        } else {
+                            size = fread(buffer, 1, sizeof(buffer), file);
+                        }
+                        if (size == 0)
+                            break;
+                        std::size_t offset = 0;
+                        while (offset < size) {
+                            ssize_t written = details::write_no_sigpipe(output,
+                                buffer + offset, size - offset);
+                            if (written < 0 && errno == EINTR)
+                                continue;
+                            if (written <= 0)
+                                break;
+                            offset += written;
+                        }
+                        // exchange() closed its end
+                        if (offset < size)
+                            break;
+                    }
+                    pipe_close(output);
+                });
+                pipe.disown_output();
+                stream  = nullptr;
+                file    = nullptr;
+            }
+            /** Left to finish its read on its own, the deadline passed. */
+            void abandon() {
+                if (pump.joinable())
+                    pump.detach();
+            }
+
+            /** @return true while data must come from source first */
+            bool waiting() const {
+                return data.empty() && source != kBadPipeValue;
+            }
+            /** @return true once there's nothing more to write */
+            bool exhausted() {
+                return next().empty() && !waiting();
+            }
+            /** Reads what source has, call once it's readable. */
+            void fill() {
+                std::size_t size = 64*1024;
+                ssize_t transferred;
+                if (file) {
+                    // no more than what's waiting, so fread() won't block
+                    int available = 0;
+                    if (ioctl(source, FIONREAD, &available) == 0)
+                        size = std::min<std::size_t>(size, std::max(available, 1));
+                    chunk.resize(size);
+                    transferred = fread(&chunk[0], 1, size, file);
+                } else {
+                    chunk.resize(size);
+                    transferred = ::read(source, &chunk[0], size);
+                    if (transferred < 0 && (errno == EINTR || errno == EAGAIN))
+                        return;
+                }
+                if (transferred <= 0) {
+                    close_pump();
+                    source  = kBadPipeValue;
+                    file    = nullptr;
+                    return;
+                }
+                chunk.resize(transferred);
+                data = chunk;
+            }
+            /** @return bytes to write next, empty once exhausted or while waiting() */
+            std::string_view next() {
+                if (!data.empty() || source != kBadPipeValue || (!stream && !file))
+                    return data;
+                // a std::stringbuf, never blocks
+                chunk.resize(64*1024);
+                stream->read(&chunk[0], chunk.size());
+                chunk.resize(stream->gcount());
+                if (chunk.empty())
+                    stream = nullptr;
+                data = chunk;
+                return data;
+            }
+            void consume(std::size_t size) {
+                data.remove_prefix(size);
+                details::metric_add(details::Metric::input_bytes, size);
+            }
+        };
+
+        /** Where communicate() puts the data read from cout/cerr. */
+        struct OutputSink {
+            std::ostream*   stream  = nullptr;
+            FILE*           file    = nullptr;
+            /** fileno of file while splice() to it works, otherwise -1 */
+            int             splice_fd = -1;
+            std::string     capture;
+            /** PipeOption::memfd output, collected once the process exited */
+            PipeHandle      memfd   = kBadPipeValue;
+            /** map memfd into mapping rather than copy it into capture */
+            bool            map     = false;
+            std::shared_ptr<const MappedFile> mapping;
+            details::CaptureMeter meter;
+
+            /** Takes handle if it's a file, polling it would never block. */
+            void take_memfd(PipeHandle& handle) {
+                struct stat info;
+                if (handle == kBadPipeValue || fstat(handle, &info) != 0
+                    || !S_ISREG(info.st_mode))
+                    return;
+                memfd   = handle;
+                handle  = kBadPipeValue;
+            }
+            void drain_memfd() {
+                if (memfd == kBadPipeValue)
+                    return;
+                if (map) {
+                    mapping = std::make_shared<MappedFile>(memfd);
+                    details::metric_add(details::Metric::capture_bytes, mapping->view().size());
+                } else {
+                    struct stat info;
+                    if (fstat(memfd, &info) == 0)
+                        capture.reserve(capture.size() + info.st_size);
+                    char buffer[64*1024];
+                    off_t offset = 0;
+                    ssize_t transferred;
+                    while ((transferred = ::pread(memfd, buffer, sizeof(buffer), offset)) > 0) {
+                        write(buffer, transferred);
+                        offset += transferred;
+                    }
+                }
+                pipe_close(memfd);
+                memfd = kBadPipeValue;
+            }
+
+            void set_file(FILE* output) {
+                file = output;
+                // what's already buffered must land before what we splice
+                fflush(file);
+                splice_fd = fileno(file);
+            }
+
+            void write(const char* data, std::size_t size) {
+                if (stream) {
+                    stream->write(data, size);
+                    details::metric_add(details::Metric::stream_bytes, size);
+                } else if (file) {
+                    fwrite(data, 1, size, file);
+                    details::metric_add(details::Metric::file_bytes, size);
+                } else {
+                    capture.append(data, size);
+                    meter.add(size);
+                }
+            }
+        };
+
+        /*  Services cin, cout, cerr of popen from this thread until they
+            are all closed and the process exits, or deadline passes.
+        */
+        void exchange(Popen& popen, InputSource& input, OutputSink& cout_sink,
+            OutputSink& cerr_sink, double deadline, double timeout
+        ) {
+            auto throw_timeout = [&]() {
+                TimeoutExpired expired("timeout of " + std::to_string(timeout) + " seconds expired");
+                input.abandon();
+                for (OutputSink* sink : {&cout_sink, &cerr_sink}) {
+                    sink->map = false;
+                    sink->drain_memfd();
+                }
+                expired.cmd     = popen.args;
+                expired.timeout = timeout;
+                expired.cout    = std::move(cout_sink.capture);
+                expired.cerr    = std::move(cerr_sink.capture);
+                expired.usage   = popen.usage;
+                throw expired;
+            };
+            cout_sink.take_memfd(popen.cout);
+            cerr_sink.take_memfd(popen.cerr);
+            input.start();
+            if (input.exhausted())
+                popen.close_cin();
+            for (PipeHandle handle : {popen.cin, popen.cout, popen.cerr}) {
+                if (handle != kBadPipeValue)
+                    pipe_set_blocking(handle, false);
+            }
+
+            char buffer[64*1024];
+            PipeHandle& cin     = popen.cin;
+            PipeHandle& cout    = popen.cout;
+            PipeHandle& cerr    = popen.cerr;
+            while (cin != kBadPipeValue || cout != kBadPipeValue || cerr != kBadPipeValue) {
+                pollfd fds[3];
+                PipeHandle* handles[3];
+                nfds_t count = 0;
+                for (PipeHandle* handle : {&cin, &cout, &cerr}) {
+                    if (*handle == kBadPipeValue)
+                        continue;
+                    fds[count] = {};
+                    fds[count].fd       = *handle;
+                    fds[count].events   = handle == &cin? POLLOUT : POLLIN;
+                    // nothing to write until the source has more
+                    if (handle == &cin && input.waiting()) {
+                        fds[count].fd       = input.source;
+                        fds[count].events   = POLLIN;
+                    }
+                    handles[count]      = handle;
+                    ++count;
+                }
+                int ms = -1;
+                if (deadline >= 0) {
+                    double remaining = deadline - monotonic_seconds();
+                    if (remaining <= 0)
+                        throw_timeout();
+                    ms = (int)std::ceil(remaining*1000);
+                }
+                int ret = ::poll(fds, count, ms);
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                if (ret < 0)
+                    details::throw_os_error("poll", errno);
+                for (nfds_t i = 0; i < count; ++i) {
+                    if (fds[i].revents == 0)
+                        continue;
+                    PipeHandle& handle = *handles[i];
+                    if (&handle == &cin && input.waiting()) {
+                        input.fill();
+                        if (input.exhausted())
+                            popen.close_cin();
+                        continue;
+                    }
+                    if (&handle == &cin) {
+                        std::string_view data = input.next();
+                        ssize_t transferred = details::write_no_sigpipe(cin,
+                            data.data(), data.size());
+                        if (transferred > 0)
+                            input.consume(transferred);
+                        bool again = transferred < 0 && (errno == EAGAIN || errno == EINTR);
+                        if ((transferred < 0 && !again) || input.exhausted())
+                            popen.close_cin();
+                        continue;
+                    }
+                    OutputSink& sink = &handle == &cout? cout_sink : cerr_sink;
+                    ssize_t transferred;
+                    if (sink.splice_fd >= 0) {
+                        transferred = details::pipe_splice(handle, sink.splice_fd, 1024*1024);
+                        if (transferred < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                            sink.splice_fd = -1;
+                            continue;
+                        }
+                        if (transferred > 0)
+                            details::metric_add(details::Metric::file_bytes, transferred);
+                    } else if (sink.stream || sink.file) {
+                        transferred = ::read(handle, buffer, sizeof(buffer));
+                        if (transferred > 0)
+                            sink.write(buffer, transferred);
+                    } else {
+                        transferred = details::pipe_read_append(handle, sink.capture);
+                        if (transferred > 0)
+                            sink.meter.add(transferred);
+                    }
+                    if (transferred > 0)
+                        details::output_seen(popen);
+                    if (transferred < 0 && (errno == EAGAIN || errno == EINTR))
+                        continue;
+                    if (transferred <= 0) {
+                        if (details::trace_on())
+                            details::trace_instant(&handle == &cout? "cout EOF" : "cerr EOF", popen.pid);
+                        pipe_close(handle);
+                        handle = kBadPipeValue;
+                    }
+                }
+            }
+
+            try {
+                popen.wait(deadline < 0? -1 : std::max(0.0, deadline - monotonic_seconds()));
+            } catch (TimeoutExpired&) {
+                throw_timeout();
+            }
+            cout_sink.drain_memfd();
+            cerr_sink.drain_memfd();
+        }
+    }
+
+    std::pair<std::string, std::string> Popen::communicate(std::string_view input, double timeout) {
+        InputSource source;
+        source.data = input;
+        OutputSink cout_sink;
+        OutputSink cerr_sink;
+        double deadline = timeout < 0? -1 : monotonic_seconds() + timeout;
+        exchange(*this, source, cout_sink, cerr_sink, deadline, timeout);
+        return {std::move(cout_sink.capture), std::move(cerr_sink.capture)};
+    }
 #endif
     bool Popen::terminate() {
         return send_signal(PSIGTERM);
@@ -541,115 +1202,145 @@ namespace subprocess {
 
     CompletedProcess run(Popen& popen, bool check) {
         CompletedProcess completed;
-        std::thread cout_thread;
-        std::thread cerr_thread;
-        if (popen.cout != kBadPipeValue) {
-            cout_thread = std::thread([&]() {
-                try {
-                    completed.cout = pipe_read_all(popen.cout);
-                } catch (...) {
-                }
-                pipe_close(popen.cout);
-                popen.cout = kBadPipeValue;
-            });
-        }
-        if (popen.cerr != kBadPipeValue) {
-            cerr_thread = std::thread([&]() {
-                try {
-                    completed.cerr = pipe_read_all(popen.cerr);
-                } catch (...) {
-                }
-                pipe_close(popen.cerr);
-                popen.cerr = kBadPipeValue;
-            });
-        }
-
-        if (cout_thread.joinable()) {
-            cout_thread.join();
-        }
-        if (cerr_thread.joinable()) {
-            cerr_thread.join();
-        }
-
-        popen.wait();
+        std::tie(completed.cout, completed.cerr) = popen.communicate();
         completed.returncode = popen.returncode;
+        completed.usage = popen.usage;
         completed.args = CommandLine(popen.args.begin()+1, popen.args.end());
-        if (check) {
+        if (check && completed.returncode != 0) {
             CalledProcessError error("failed to execute " + popen.args[0]);
             error.cmd           = popen.args;
             error.returncode    = completed.returncode;
-            error.cout          = std::move(completed.cout);
-            error.cerr          = std::move(completed.cerr);
+            error.cout          = completed.cout_view();
+            error.cerr          = completed.cerr_view();
+            error.usage         = completed.usage;
             throw error;
         }
         return completed;
     }
 
+    /*  Sends each signal of the schedule in turn giving the process grace
+        seconds to exit, then SIGKILL.
+    */
+    static void escalate_termination(Popen& popen, const std::vector<SignalStep>& schedule) {
+        for (const SignalStep& step : schedule) {
+            if (popen.poll())
+                return;
+            popen.send_signal(step.signal);
+            try {
+                popen.wait(step.grace);
+                return;
+            } catch (TimeoutExpired&) {
+            }
+        }
+        popen.kill();
+        popen.wait();
+    }
+
     CompletedProcess run(CommandLine command, RunOptions options) {
-        Popen popen(command, std::move(options));
+        // one deadline for spawning, writing, reading & waiting
+        double deadline = options.timeout < 0? -1 : monotonic_seconds() + options.timeout;
+        double timeout  = options.timeout;
+        bool check      = options.check;
+        std::vector<SignalStep> schedule = std::move(options.timeout_escalation);
         CompletedProcess completed;
-        std::thread cout_thread;
-        std::thread cerr_thread;
-        if (popen.cout != kBadPipeValue) {
-            cout_thread = std::thread([&]() {
-                try {
-                    completed.cout = pipe_read_all(popen.cout);
-                } catch (...) {
-                }
-                pipe_close(popen.cout);
-                popen.cout = kBadPipeValue;
-            });
+        auto throw_timeout = [&](TimeoutExpired& expired, Popen& popen) {
+            subprocess::TimeoutExpired timeout_error("subprocess::run timeout reached");
+            timeout_error.cmd = command;
+            timeout_error.timeout = timeout;
+            timeout_error.cout = std::move(expired.cout);
+            timeout_error.cerr = std::move(expired.cerr);
+            // terminated by now, so it's all there
+            timeout_error.usage = popen.usage;
+            throw timeout_error;
+        };
+
+#ifdef _WIN32
+        // communicate() writes it from this thread, no need for Popen's thread
+        std::string input_store;
+        std::string_view input;
+        if (std::holds_alternative<std::string>(options.cin)) {
+            input_store = std::move(std::get<std::string>(options.cin));
+            input = input_store;
+            options.cin = PipeOption::pipe;
+        } else if (std::holds_alternative<InputView>(options.cin)) {
+            input = std::get<InputView>(options.cin).data;
+            options.cin = PipeOption::pipe;
         }
-        if (popen.cerr != kBadPipeValue) {
-            cerr_thread = std::thread([&]() {
-                try {
-                    completed.cerr = pipe_read_all(popen.cerr);
-                } catch (...) {
-                }
-                pipe_close(popen.cerr);
-                popen.cerr = kBadPipeValue;
-            });
+        Popen popen(command, std::move(options));
+        try {
+            double remaining = deadline < 0? -1 : std::max(0.0, deadline - monotonic_seconds());
+            std::tie(completed.cout, completed.cerr) = popen.communicate(input, remaining);
+        } catch (subprocess::TimeoutExpired& expired) {
+            escalate_termination(popen, schedule);
+            throw_timeout(expired, popen);
         }
-
-        if (cout_thread.joinable()) {
-            cout_thread.join();
+#else
+        /*  Every redirection is serviced by exchange() on this thread so the
+            deadline covers all of it. Popen only gets pipes.
+        */
+        std::string input;
+        InputSource source;
+        switch (static_cast<PipeVarIndex>(options.cin.index())) {
+        case PipeVarIndex::string:
+            input = std::move(std::get<std::string>(options.cin));
+            source.data = input;
+            options.cin = PipeOption::pipe;
+            break;
+        case PipeVarIndex::view:
+            source.data = std::get<InputView>(options.cin).data;
+            options.cin = PipeOption::pipe;
+            break;
+        case PipeVarIndex::istream:
+            source.stream = std::get<std::istream*>(options.cin);
+            options.cin = PipeOption::pipe;
+            break;
+        case PipeVarIndex::file:
+            source.file = std::get<FILE*>(options.cin);
+            options.cin = PipeOption::pipe;
+            break;
+        default:
+            break;
         }
-        if (cerr_thread.joinable()) {
-            cerr_thread.join();
+        OutputSink cout_sink;
+        OutputSink cerr_sink;
+        cout_sink.map = cerr_sink.map = options.map_output;
+        cout_sink.capture.reserve(options.expected_output_size);
+        for (auto pair : {std::make_pair(&options.cout, &cout_sink),
+                std::make_pair(&options.cerr, &cerr_sink)}) {
+            PipeVar& option = *pair.first;
+            if (std::holds_alternative<std::ostream*>(option)) {
+                pair.second->stream = std::get<std::ostream*>(option);
+                option = PipeOption::pipe;
+            } else if (std::holds_alternative<FILE*>(option)) {
+                pair.second->set_file(std::get<FILE*>(option));
+                option = PipeOption::pipe;
+            }
         }
-
+        Popen popen(command, std::move(options));
         try {
-            popen.wait(options.timeout);
+            exchange(popen, source, cout_sink, cerr_sink, deadline, timeout);
         } catch (subprocess::TimeoutExpired& expired) {
-            popen.send_signal(subprocess::SigNum::PSIGTERM);
-            /*  python source code sends SIGKILL, we'll be a bit more nice.
-                give it a bit of time to terminate. This is more practical.
-            */
-            try {
-                popen.wait(1.0/20.0);
-            } catch (subprocess::TimeoutExpired& expired) {
-                popen.kill();
-            }
-            popen.wait();
-            subprocess::TimeoutExpired timeout("subprocess::run timeout reached");
-            timeout.cmd = command;
-            timeout.timeout = options.timeout;
-            timeout.cout = std::move(completed.cout);
-            timeout.cerr = std::move(completed.cerr);
-            throw timeout;
+            escalate_termination(popen, schedule);
+            throw_timeout(expired, popen);
         }
+        completed.cout      = std::move(cout_sink.capture);
+        completed.cerr      = std::move(cerr_sink.capture);
+        completed.cout_map  = std::move(cout_sink.mapping);
+        completed.cerr_map  = std::move(cerr_sink.mapping);
+#endif
 
         completed.returncode = popen.returncode;
+        completed.usage = popen.usage;
         completed.args = command;
-        if (options.check && completed.returncode != 0) {
+        if (check && completed.returncode != 0) {
             CalledProcessError error("failed to execute " + command[0]);
             error.cmd           = command;
             error.returncode    = completed.returncode;
-            error.cout          = std::move(completed.cout);
-            error.cerr          = std::move(completed.cerr);
+            error.cout          = completed.cout_view();
+            error.cerr          = completed.cerr_view();
+            error.usage         = completed.usage;
             throw error;
         }
         return completed;
     }
-
 }
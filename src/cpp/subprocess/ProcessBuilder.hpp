@@ -1,10 +1,15 @@
 #pragma once
 
 #include <initializer_list>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <utility>
 
+#include "environ.hpp"
+#include "IoPool.hpp"
 #include "pipe.hpp"
 #include "PipeVar.hpp"
 
@@ -22,6 +27,37 @@ namespace subprocess {
             RunOptions
     */
 
+    /** How a child process is created on posix. Ignored on windows.
+
+        All of them share the parents memory until exec so spawn cost
+        doesn't grow with the size of the parent. Pick one per workload
+        with subprocess_bench spawn_backends.
+    */
+    enum class SpawnBackend {
+        /** posix_spawn when it can do everything requested, vfork otherwise */
+        automatic,
+        /** libc posix_spawn(). */
+        posix_spawn,
+        /** vfork() + execve() done by this library. */
+        vfork,
+        /** linux only clone(CLONE_VM|CLONE_VFORK|CLONE_PIDFD). The pidfd
+            is handed back by the kernel with the pid, no pidfd_open needed.
+            Falls back to vfork on kernels older than 5.2.
+        */
+        clone_pidfd
+    };
+
+    /** @return true if backend can be used on this platform. */
+    bool spawn_backend_available(SpawnBackend backend);
+
+    /** A signal to send and how many seconds to give the process to exit
+        before moving on to the next step.
+    */
+    struct SignalStep {
+        int     signal;
+        double  grace;
+    };
+
     struct RunOptions {
         /** Option for cin, data to pipe to cin.  or created handle to use.
 
@@ -70,8 +106,19 @@ namespace subprocess {
 
         /** Timeout in seconds. Raise TimeoutExpired.
 
-            Only available if you use subprocess_run. If timeout is reached
-            process is killed() SIGKILL style, TimeoutExpired is thrown.
+            Only available if you use subprocess_run. The timeout covers the
+            whole run including writing cin & reading cout/cerr. If timeout
+            is reached the process is stopped per timeout_escalation and
+            TimeoutExpired is thrown with the output captured so far.
+
+            A std::istream* cin, or a FILE* cin without a file descriptor,
+            is read by a helper thread since reading it may block. At the
+            timeout the helper is abandoned in the read it's in, so such a
+            stream must stay valid until that read returns.
+
+            On windows std::istream*, std::ostream* and FILE* redirections
+            run on threads of the Popen the timeout doesn't cover. They end
+            once the stopped process closed its pipes.
         */
         double timeout  = -1;
         /** Set to true for subprocess::run() to throw exception. Ignored when
@@ -80,10 +127,41 @@ namespace subprocess {
         bool        check   = false;
         /** If empty inherits from current process */
         EnvMap      env;
+        /** Changes applied on top of env, or the current environment if env
+            is empty. Cheaper than a full env when only a few variables
+            differ.
+        */
+        EnvOverlay  env_overlay;
 
+        /** How the process is created on posix. */
+        SpawnBackend spawn_backend = SpawnBackend::automatic;
 
+        /** Signals subprocess::run() sends on timeout, in order, waiting
+            grace seconds after each for the process to exit. SIGKILL is
+            sent when the schedule is exhausted.
+        */
+        std::vector<SignalStep> timeout_escalation = {{PSIGTERM, 1.0/20.0}};
+
+        /** With PipeOption::memfd output, run() maps the file into
+            CompletedProcess::cout_map/cerr_map instead of copying it into
+            cout/cerr.
+        */
+        bool map_output = false;
+
+        /** Expected size in bytes of captured cout. run() sizes its buffer
+            for it up front instead of growing into it.
+        */
+        std::size_t expected_output_size = 0;
     };
+    class EventLoop;
+    class ExitWait;
     class ProcessBuilder;
+    class ProcessReactor;
+    class ProcessSet;
+    struct SpawnPlan;
+    namespace details {
+        struct ExitState;
+    }
     /** Active running process.
 
         Similar design of subprocess.Popen. In c++ I didn't like
@@ -136,6 +214,8 @@ namespace subprocess {
         pid_t       pid         = 0;
         /** The exit value of the process. Valid once process is completed */
         int         returncode  = kBadReturnCode;
+        /** Resources used by the process, filled in along with returncode */
+        ProcessUsage usage;
         std::string cwd;
         CommandLine args;
 
@@ -158,14 +238,45 @@ namespace subprocess {
             ignore_output() to spawn threads to ignore the output preventing a
             deadlock. You can also troll the child by closing your end.
 
+            On linux the wait sleeps in the kernel on a pidfd, on mac/BSD on a
+            kqueue. No CPU is burned while waiting regardless of the timeout.
+
             @param timeout  timeout in seconds. Raises TimeoutExpired on
-                            timeout. NOT IMPLEMENTED, WILL WAIT FOREVER.
+                            timeout. -1 to wait forever.
             @return returncode
 
             @throw OSError          If there was an os level error call OS API's
             @throw TimeoutExpired   If the timeout has expired.
         */
         int wait(double timeout=-1);
+        /** Writes input to cin, reads cout & cerr until EOF and waits for the
+            process. Similar to python's Popen.communicate().
+
+            On posix everything happens on the calling thread with non-blocking
+            pipes and poll(), no helper threads are created.
+
+            @param input    Data to send to cin, cin is closed afterwards.
+                            Ignored if cin is not a pipe.
+            @param timeout  Seconds for the whole exchange, -1 to wait forever.
+
+            @return {cout, cerr} data. Empty if the stream is not a pipe.
+
+            @throw TimeoutExpired   with the output read so far. The process is
+                                    left running.
+            @throw OSError          If there was an os level error.
+        */
+        std::pair<std::string, std::string> communicate(
+            std::string_view input={}, double timeout=-1);
+#if !defined(_WIN32) && defined(__cpp_impl_coroutine)
+        /** co_await popen.async_wait() suspends the coroutine until the
+            process exited and returns the returncode. The thread is free
+            meanwhile, see EventLoop. posix & c++20 only.
+
+            @param loop loop to wait in, EventLoop::current() if not given.
+        */
+        ExitWait async_wait();
+        ExitWait async_wait(EventLoop& loop);
+#endif
         /** Send the signal to the process.
 
             On windows SIGKILL does TerminateProcess, SIGINT sends CTRL_C_EVENT,
@@ -187,6 +298,17 @@ namespace subprocess {
 
         /** Destructs the object and initializes to basic state */
         void close();
+        /** Handle that becomes ready once the process exits, to add to
+            your own event loop next to cin/cout/cerr.
+
+            On linux it's the pidfd, readable on exit. On windows the process
+            handle, signaled on exit. Call poll() once it's ready to collect
+            the returncode. Owned by Popen, don't close it.
+
+            @return kBadPipeValue if there is none, before linux 5.3 and on
+                    other posix systems.
+        */
+        PipeHandle exit_handle() const;
         /** Closes the cin pipe */
         void close_cin() {
             if (cin != kBadPipeValue) {
@@ -194,18 +316,31 @@ namespace subprocess {
                 cin = kBadPipeValue;
             }
         }
+        friend EventLoop;
         friend ProcessBuilder;
+        friend ProcessReactor;
+        friend ProcessSet;
+        friend SpawnPlan;
     private:
         void init(CommandLine& command, RunOptions& options);
-        /*  In order to avoid deadlock across processes, a thread is used. A
-            reference to the thread is needed to wait for it to properly close
-            down and release the resources.
+        /** Marks usage collected, after the OS specific fields are set. */
+        void finish_usage();
+        /*  In order to avoid deadlock across processes, redirections are
+            serviced in the background by the I/O pool. They are joined to
+            wait for them to properly close down and release the resources.
         */
-        std::thread cin_thread;
-        std::thread cout_thread;
-        std::thread cerr_thread;
+        details::IoTask cin_thread;
+        details::IoTask cout_thread;
+        details::IoTask cerr_thread;
 #ifdef _WIN32
         PROCESS_INFORMATION process_info;
+#else
+        /*  pidfd of the child on linux 5.3+, -1 otherwise. Used to sleep in
+            the kernel until the process exits.
+        */
+        int pidfd = -1;
+        /*  Set when the reaper collects the exit, which then owns pidfd. */
+        std::shared_ptr<details::ExitState> exit_state;
 #endif
     };
 
@@ -232,8 +367,11 @@ namespace subprocess {
         bool new_process_group            = false;
         /** If empty inherits from current process */
         EnvMap      env;
+        /** Changes on top of env or the current environment */
+        EnvOverlay  env_overlay;
         std::string cwd;
         CommandLine command;
+        SpawnBackend spawn_backend        = SpawnBackend::automatic;
 
         std::string windows_command();
         std::string windows_args();
@@ -245,6 +383,46 @@ namespace subprocess {
         Popen run_command(const CommandLine& command);
     };
 
+    /** A ProcessBuilder compiled for starting the same command many times.
+
+        The program is resolved, argv & envp are flattened into one arena and
+        the redirection plan is worked out once. spawn() only does the work
+        that differs per process: creating pipes and starting it.
+
+        Arguments equal to kPlaceholder are filled in by spawn(args), so one
+        template can run the same tool over different inputs.
+
+        Immutable once constructed, spawn() may be called from many threads at
+        once. Handles given for PipeOption::specific must stay open for as
+        long as the template is used.
+    */
+    class SpawnTemplate {
+    public:
+        static constexpr const char* kPlaceholder = "{}";
+
+        /** @param command  command to compile, builder.command if empty.
+
+            @throw CommandNotFoundError if the program can't be found.
+        */
+        explicit SpawnTemplate(const ProcessBuilder& builder, CommandLine command={});
+
+        /** Starts a process.
+
+            @param args values for the kPlaceholder arguments in order. If
+                        empty kPlaceholder arguments are passed as is.
+
+            @throw  std::invalid_argument if args doesn't match the number of
+                    placeholders. Same as ProcessBuilder::run_command.
+        */
+        Popen spawn(const std::vector<std::string>& args={}) const;
+
+        /** @return the resolved program */
+        const std::string& program() const;
+        std::size_t placeholder_count() const;
+    private:
+        std::shared_ptr<const SpawnPlan> mPlan;
+    };
+
     /** If you have stuff to pipe this will run the process to completion.
 
         This will read stdout/stderr if they exist and store in cout, cerr.
@@ -300,8 +478,19 @@ namespace subprocess {
         RunBuilder& cwd(std::string cwd) {options.cwd = cwd; return *this;}
         /** Sets the environment to use. Default is current environment if unset */
         RunBuilder& env(const EnvMap& env) {options.env = env; return *this;}
+        /** Sets changes to the environment, see RunOptions::env_overlay */
+        RunBuilder& env_overlay(const EnvOverlay& overlay) {options.env_overlay = overlay; return *this;}
         /** Timeout to use for run() invocation only. */
         RunBuilder& timeout(double timeout) {options.timeout = timeout; return *this;}
+        /** Signals to send on timeout before resorting to SIGKILL. */
+        RunBuilder& timeout_escalation(std::vector<SignalStep> schedule) {
+            options.timeout_escalation = std::move(schedule);
+            return *this;
+        }
+        /** Map PipeOption::memfd output instead of copying it. */
+        RunBuilder& map_output(bool map) {options.map_output = map; return *this;}
+        /** Expected size of captured cout, see RunOptions::expected_output_size */
+        RunBuilder& expected_output_size(std::size_t size) {options.expected_output_size = size; return *this;}
         /** Set to true to run as new process group. On windows the new process
             has CTRL+C handler disabled so CTRL+C or sending SIGINT won't kill
             the process. If you want to send CTRL+C you will need to make a new
@@ -309,6 +498,8 @@ namespace subprocess {
             new process and giving process id back to parent process for use.
          */
         RunBuilder& new_process_group(bool new_group) {options.new_process_group = new_group; return *this;}
+        /** Sets how the process is created on posix. */
+        RunBuilder& spawn_backend(SpawnBackend backend) {options.spawn_backend = backend; return *this;}
         operator RunOptions() const {return options;}
 
         /** Runs the command already configured.
@@ -325,6 +516,14 @@ namespace subprocess {
 
     /** @return seconds went by from some origin monotonically increasing. */
     double monotonic_seconds();
+    /** @return seconds since the epoch by the system clock */
+    double system_seconds();
+    namespace details {
+        /** Sets usage.first_output of popen if this is the first output
+            read from it.
+        */
+        void output_seen(Popen& popen);
+    }
     /** Sleep for a number of seconds.
 
         @param seconds  The number of seconds to sleep for.
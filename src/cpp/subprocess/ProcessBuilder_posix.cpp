@@ -3,93 +3,431 @@
 
 #include <spawn.h>
 #include <cstring>
-#include <mutex>
+#include <stdexcept>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/wait.h>
+#else
+#include <wait.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "environ.hpp"
+#include "Metrics.hpp"
+#include "ProcessReaper.hpp"
+#include "Trace.hpp"
 
-extern "C" char **environ;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+    // chdir happens in the child, no need to touch the parent's cwd
+    #define SUBPROCESS_HAVE_ADDCHDIR 1
+#else
+    #define SUBPROCESS_HAVE_ADDCHDIR 0
+#endif
 
-using std::nullptr_t;
+extern "C" char **environ;
 
 using namespace subprocess::details;
 
-namespace {
-    struct cstring_vector {
-        typedef char* value_type;
-        ~cstring_vector() {
-            clear();
-        }
-        void clear() {
-            for (char* ptr : m_list) {
-                if (ptr)
-                    free(ptr);
-            }
-            m_list.clear();
-        }
+namespace subprocess {
+    /*  The file actions to perform in the child. Recorded so each backend
+        can replay them in its own way.
+    */
+    struct FileActions {
+        enum class Type { dup2, close, chdir };
+        struct Action {
+            Type        type;
+            int         fd;
+            int         newfd;
+            const char* path;
+        };
 
-        void reserve(std::size_t size) {
-            m_list.reserve(size);
+        void adddup2(int fd, int newfd) {
+            list.push_back({Type::dup2, fd, newfd, nullptr});
         }
-        void push_back(const std::string& str) {
-            push_back(str.c_str());
+        void addclose(int fd) {
+            list.push_back({Type::close, fd, -1, nullptr});
         }
-        void push_back(nullptr_t) {
-            m_list.push_back(nullptr);
+        void addchdir(const char* path) {
+            list.push_back({Type::chdir, -1, -1, path});
         }
-        void push_back(const char* str) {
-            char* copy = str? strdup(str) : nullptr;
-            m_list.push_back(copy);
+
+        std::vector<Action> list;
+    };
+
+    struct PosixFileActions {
+        PosixFileActions(const FileActions& file_actions) {
+            int result = posix_spawn_file_actions_init(&actions);
+            throw_os_error("posix_spawn_file_actions_init", result);
+            for (auto& action : file_actions.list) {
+                switch (action.type) {
+                case FileActions::Type::dup2:
+                    result = posix_spawn_file_actions_adddup2(&actions, action.fd, action.newfd);
+                    throw_os_error("posix_spawn_file_actions_adddup2", result);
+                    break;
+                case FileActions::Type::close:
+                    result = posix_spawn_file_actions_addclose(&actions, action.fd);
+                    throw_os_error("posix_spawn_file_actions_addclose", result);
+                    break;
+                case FileActions::Type::chdir:
+#if SUBPROCESS_HAVE_ADDCHDIR
+                    result = posix_spawn_file_actions_addchdir_np(&actions, action.path);
+                    throw_os_error("posix_spawn_file_actions_addchdir_np", result);
+#else
+                    throw std::domain_error("posix_spawn can't change directory on this platform");
+#endif
+                    break;
+                }
+            }
         }
-        void push_back_owned(char* str) {
-            m_list.push_back(str);
+        ~PosixFileActions() {
+            posix_spawn_file_actions_destroy(&actions);
         }
-        value_type& operator[](std::size_t index) {
-            return m_list[index];
+
+        posix_spawn_file_actions_t* get() {return &actions;}
+        posix_spawn_file_actions_t actions;
+    };
+
+    /** Everything the child needs, all prepared before the fork. */
+    struct SpawnRequest {
+        const char*         program;
+        char* const*        argv;
+        char* const*        envp;
+        const FileActions*  actions;
+        /** start the child with an empty signal mask */
+        bool                clear_sigmask;
+    };
+
+    bool spawn_backend_available(SpawnBackend backend) {
+        switch (backend) {
+        case SpawnBackend::automatic:
+        case SpawnBackend::posix_spawn:
+        case SpawnBackend::vfork:
+            return true;
+        case SpawnBackend::clone_pidfd:
+#if defined(__linux__) && defined(CLONE_PIDFD)
+            return true;
+#else
+            return false;
+#endif
         }
-        char** data() {
-            return &m_list[0];
+        return false;
+    }
+
+    static SpawnBackend resolve_backend(SpawnBackend backend, bool needs_chdir) {
+        if (!spawn_backend_available(backend))
+            return SpawnBackend::vfork;
+        if (backend == SpawnBackend::automatic || backend == SpawnBackend::posix_spawn) {
+            if (needs_chdir && !SUBPROCESS_HAVE_ADDCHDIR)
+                return SpawnBackend::vfork;
+            return SpawnBackend::posix_spawn;
         }
-        std::vector<char*> m_list;
+        return backend;
+    }
+
+    static pid_t spawn_posix_spawn(const SpawnRequest& request) {
+        PosixFileActions actions(*request.actions);
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        struct SpawnAttr {
+            SpawnAttr(posix_spawnattr_t& attributes) {
+                this->attributes = &attributes;
+            }
+            ~SpawnAttr() {
+                posix_spawnattr_destroy(attributes);
+            }
+
+            void setflags(short flags) {
+                int ret = posix_spawnattr_setflags(attributes, flags);
+                throw_os_error("posix_spawnattr_setflags", ret);
+            }
+            posix_spawnattr_t* attributes;
+        } attributes_raii(attributes);
+#if 0
+        // I can't think of a nice way to make this configurable.
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+        sigset_t signal_mask;
+        sigemptyset(&signal_mask);
+        posix_spawnattr_setsigmask(&attributes, &signal_mask);
+#endif
+        int flags = request.clear_sigmask? POSIX_SPAWN_SETSIGMASK : 0;
+#ifdef POSIX_SPAWN_USEVFORK
+        flags |= POSIX_SPAWN_USEVFORK;
+#endif
+        attributes_raii.setflags(flags);
+        pid_t pid;
+        int ret = posix_spawn(&pid, request.program, actions.get(), &attributes,
+            request.argv, request.envp);
+        if(ret != 0)
+            throw SpawnError("posix_spawn failed with error: " + std::string(strerror(ret)));
+        return pid;
+    }
+
+    /*  Shared by the vfork & clone backends. The child borrows our memory
+        until execve so nothing in here may allocate or touch locks.
+    */
+    struct ChildContext {
+        const SpawnRequest* request;
+        const sigset_t*     parent_sigmask;
+        volatile int        error;
     };
 
-}
+    [[noreturn]] static void exec_child(ChildContext& context) noexcept {
+        const SpawnRequest& request = *context.request;
+        // a handler running now would run parent code on the parent's memory
+        for (int signum = 1; signum < NSIG; ++signum) {
+            struct sigaction action;
+            if (sigaction(signum, nullptr, &action) != 0)
+                continue;
+            if (action.sa_handler == SIG_IGN || action.sa_handler == SIG_DFL)
+                continue;
+            action.sa_handler = SIG_DFL;
+            action.sa_flags = 0;
+            sigemptyset(&action.sa_mask);
+            sigaction(signum, &action, nullptr);
+        }
+        for (auto& action : request.actions->list) {
+            int ret = 0;
+            switch (action.type) {
+            case FileActions::Type::dup2:
+                if (action.fd == action.newfd) {
+                    // same as posix_spawn, it just becomes inheritable
+                    int flags = fcntl(action.fd, F_GETFD);
+                    ret = flags < 0? -1 : fcntl(action.fd, F_SETFD, flags & ~FD_CLOEXEC);
+                } else {
+                    ret = ::dup2(action.fd, action.newfd);
+                }
+                break;
+            case FileActions::Type::close:
+                // closing something already closed is not an error
+                ::close(action.fd);
+                break;
+            case FileActions::Type::chdir:
+                ret = ::chdir(action.path);
+                break;
+            }
+            if (ret < 0) {
+                context.error = errno;
+                _exit(127);
+            }
+        }
+        sigset_t empty;
+        sigemptyset(&empty);
+        pthread_sigmask(SIG_SETMASK,
+            request.clear_sigmask? &empty : context.parent_sigmask, nullptr);
+        execve(request.program, request.argv, request.envp);
+        context.error = errno;
+        _exit(127);
+    }
 
+    /*  Blocks all signals in the calling thread until destruction so none
+        are delivered to the child while it shares our memory.
+    */
+    struct BlockSignals {
+        BlockSignals() {
+            sigset_t all;
+            sigfillset(&all);
+            pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+        }
+        ~BlockSignals() {
+            pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+        }
+        sigset_t old_mask;
+    };
 
-namespace subprocess {
-    struct FileActions {
-        FileActions() {
-            int result = posix_spawn_file_actions_init(&actions);
-            throw_os_error("posix_spawn_file_actions_init", result);
+    static void check_child_error(const char* backend, pid_t pid, int error) {
+        if (error == 0)
+            return;
+        if (pid > 0) {
+            // the child already _exit()ed, reap it
+            int status;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
         }
-        ~FileActions() {
-            int result = posix_spawn_file_actions_destroy(&actions);
-            throw_os_error("posix_spawn_file_actions_destroy", result);
+        throw SpawnError(std::string(backend) + " failed with error: " + strerror(error));
+    }
+
+    static pid_t spawn_vfork(const SpawnRequest& request) {
+        pid_t pid;
+        int error;
+        {
+            BlockSignals block;
+            ChildContext context = {&request, &block.old_mask, 0};
+            pid = vfork();
+            if (pid == 0)
+                exec_child(context);
+            error = pid < 0? errno : context.error;
         }
+        check_child_error("vfork", pid, error);
+        return pid;
+    }
 
-        void adddup2(int fd, int newfd) {
-            int result = posix_spawn_file_actions_adddup2(&actions, fd, newfd);
-            throw_os_error("posix_spawn_file_actions_adddup2", result);
+#if defined(__linux__) && defined(CLONE_PIDFD)
+    static int clone_child(void* context) {
+        exec_child(*static_cast<ChildContext*>(context));
+    }
+
+    static pid_t spawn_clone_pidfd(const SpawnRequest& request, int& pidfd) {
+        // only used until execve, the parent is suspended until then
+        constexpr std::size_t kStackSize = 64*1024;
+        void* stack = mmap(nullptr, kStackSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED)
+            throw_os_error("mmap", errno);
+        pid_t pid;
+        int error;
+        pidfd = -1;
+        {
+            BlockSignals block;
+            ChildContext context = {&request, &block.old_mask, 0};
+            pid = clone(clone_child, static_cast<char*>(stack) + kStackSize,
+                CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &context, &pidfd);
+            error = pid < 0? errno : context.error;
         }
-        void addclose(int fd) {
-            int result = posix_spawn_file_actions_addclose(&actions, fd);
-            throw_os_error("posix_spawn_file_actions_addclose", result);
+        munmap(stack, kStackSize);
+        if (pid < 0 && (error == EINVAL || error == ENOSYS)) {
+            // CLONE_PIDFD needs linux 5.2
+            pidfd = -1;
+            return spawn_vfork(request);
         }
+        if (error != 0 && pidfd >= 0) {
+            ::close(pidfd);
+            pidfd = -1;
+        }
+        check_child_error("clone", pid, error);
+        return pid;
+    }
+#endif
 
-        posix_spawn_file_actions_t* get() {return &actions;}
-        posix_spawn_file_actions_t actions;
+#ifndef _WIN32
+    /** @return an anonymous in memory file for PipeOption::memfd */
+    static int create_memfd(const char* name) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+        int memfd = memfd_create(name, MFD_CLOEXEC);
+        if (memfd >= 0)
+            return memfd;
+        if (errno != ENOSYS)
+            throw_os_error("memfd_create", errno);
+#endif
+        std::string dir = subprocess::getenv("TMPDIR");
+        std::string path = (dir.empty()? "/tmp" : dir) + "/" + name + "-XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd < 0)
+            throw_os_error("mkstemp", errno);
+        unlink(path.c_str());
+        pipe_set_inheritable(fd, false);
+        return fd;
+    }
+
+    /*  Everything about starting a command that doesn't change between
+        processes: the resolved program, argv & envp flattened into one
+        arena and the redirection plan.
+    */
+    struct SpawnPlan {
+        SpawnPlan() {}
+        // argv & envp point into arena
+        SpawnPlan(const SpawnPlan&)=delete;
+        SpawnPlan& operator=(const SpawnPlan&)=delete;
+
+        CommandLine         command;
+        std::string         program;
+        std::vector<char>   arena;
+        std::vector<char*>  argv;
+        /** indices into argv of SpawnTemplate::kPlaceholder arguments */
+        std::vector<std::size_t> placeholders;
+        /** empty to use env_overlay or inherit environ */
+        std::vector<char*>  envp;
+        EnvOverlay          env_overlay;
+
+        PipeOption  cin_option;
+        PipeOption  cout_option;
+        PipeOption  cerr_option;
+        PipeHandle  cin_pipe;
+        PipeHandle  cout_pipe;
+        PipeHandle  cerr_pipe;
+        std::string cwd;
+        bool        new_process_group;
+        SpawnBackend backend;
+
+        /** Starts the process with argv instead of the planned one. */
+        Popen spawn(char* const* argv, CommandLine args) const;
     };
 
-#ifndef _WIN32
-    Popen ProcessBuilder::run_command(const CommandLine& command) {
+    static void make_plan(const ProcessBuilder& builder, const CommandLine& command,
+        SpawnPlan& plan
+    ) {
         if (command.empty()) {
             throw std::invalid_argument("command should not be empty");
         }
         std::string program = find_program(command[0]);
         if(program.empty()) {
+            details::metric_add(details::Metric::spawn_errors);
             throw CommandNotFoundError("command not found " + command[0]);
         }
+        // PATH may have relative entries, those are relative to our cwd
+        if (!builder.cwd.empty())
+            program = abspath(program);
+
+        plan.command    = command;
+        plan.program    = program;
+
+        std::vector<std::size_t> offsets;
+        auto add = [&](const char* str, std::size_t size) {
+            offsets.push_back(plan.arena.size());
+            plan.arena.insert(plan.arena.end(), str, str + size);
+            plan.arena.push_back('\0');
+        };
+        add(program.c_str(), program.size());
+        for (std::size_t i = 1; i < command.size(); ++i)
+            add(command[i].c_str(), command[i].size());
+        std::size_t env_start = offsets.size();
+        EnvMap env_store;
+        const EnvMap* env = &builder.env;
+        if (!builder.env.empty() && !builder.env_overlay.empty()) {
+            env_store = builder.env;
+            builder.env_overlay.apply(env_store);
+            env = &env_store;
+        }
+        for (auto& pair : *env) {
+            offsets.push_back(plan.arena.size());
+            plan.arena.insert(plan.arena.end(), pair.first.begin(), pair.first.end());
+            plan.arena.push_back('=');
+            plan.arena.insert(plan.arena.end(), pair.second.begin(), pair.second.end());
+            plan.arena.push_back('\0');
+        }
+        // arena won't grow anymore, pointers into it are stable
+        for (std::size_t i = 0; i < env_start; ++i) {
+            plan.argv.push_back(&plan.arena[offsets[i]]);
+            if (i > 0 && command[i] == SpawnTemplate::kPlaceholder)
+                plan.placeholders.push_back(i);
+        }
+        plan.argv.push_back(nullptr);
+        if (!builder.env.empty()) {
+            for (std::size_t i = env_start; i < offsets.size(); ++i)
+                plan.envp.push_back(&plan.arena[offsets[i]]);
+            plan.envp.push_back(nullptr);
+        } else {
+            // flattened on spawn so changes through cenv are seen
+            plan.env_overlay = builder.env_overlay;
+        }
 
+        plan.cin_option         = builder.cin_option;
+        plan.cout_option        = builder.cout_option;
+        plan.cerr_option        = builder.cerr_option;
+        plan.cin_pipe           = builder.cin_pipe;
+        plan.cout_pipe          = builder.cout_pipe;
+        plan.cerr_pipe          = builder.cerr_pipe;
+        plan.cwd                = builder.cwd;
+        plan.new_process_group  = builder.new_process_group;
+        plan.backend            = resolve_backend(builder.spawn_backend, !builder.cwd.empty());
+    }
+
+    Popen SpawnPlan::spawn(char* const* argv, CommandLine args) const {
+        const SpawnPlan& plan = *this;
         Popen process;
         PipePair cin_pair;
         PipePair cout_pair;
@@ -97,135 +435,121 @@ namespace subprocess {
 
         FileActions actions;
 
-        if (cin_option == PipeOption::close)
+        if (plan.cin_option == PipeOption::close)
             actions.addclose(kStdInValue);
-        else if (cin_option == PipeOption::specific) {
-            if (this->cin_pipe == kBadPipeValue) {
+        else if (plan.cin_option == PipeOption::specific) {
+            if (plan.cin_pipe == kBadPipeValue) {
                 throw std::invalid_argument("ProcessBuilder: bad pipe value for cin");
             }
 
-            pipe_set_inheritable(this->cin_pipe, true);
-            actions.adddup2(this->cin_pipe, kStdInValue);
-            actions.addclose(this->cin_pipe);
-        } else if (cin_option == PipeOption::pipe) {
-            cin_pair = pipe_create(true);
+            // dup2 clears close-on-exec in the child only, a concurrent
+            // spawn mustn't inherit it and hold a pipe open
+            actions.adddup2(plan.cin_pipe, kStdInValue);
+            if (plan.cin_pipe != kStdInValue)
+                actions.addclose(plan.cin_pipe);
+        } else if (plan.cin_option == PipeOption::pipe) {
+            cin_pair = pipe_create(false);
             actions.addclose(cin_pair.output);
             actions.adddup2(cin_pair.input, kStdInValue);
             actions.addclose(cin_pair.input);
             process.cin = cin_pair.output;
-            pipe_set_inheritable(process.cin, false);
         }
 
 
-        if (cout_option == PipeOption::close)
+        if (plan.cout_option == PipeOption::close)
             actions.addclose(kStdOutValue);
-        else if (cout_option == PipeOption::pipe) {
-            cout_pair = pipe_create(true);
+        else if (plan.cout_option == PipeOption::pipe) {
+            cout_pair = pipe_create(false);
             actions.addclose(cout_pair.input);
             actions.adddup2(cout_pair.output, kStdOutValue);
             actions.addclose(cout_pair.output);
             process.cout = cout_pair.input;
-            pipe_set_inheritable(process.cout, false);
-        } else if (cout_option == PipeOption::cerr) {
+        } else if (plan.cout_option == PipeOption::memfd) {
+            cout_pair = PipePair(create_memfd("subprocess-cout"), kBadPipeValue);
+            actions.adddup2(cout_pair.input, kStdOutValue);
+            process.cout = cout_pair.input;
+        } else if (plan.cout_option == PipeOption::cerr) {
             // we have to wait until stderr is setup first
-        } else if (cout_option == PipeOption::specific) {
-            if (this->cout_pipe == kBadPipeValue) {
+        } else if (plan.cout_option == PipeOption::specific) {
+            if (plan.cout_pipe == kBadPipeValue) {
                 throw std::invalid_argument("ProcessBuilder: bad pipe value for cout");
             }
-            pipe_set_inheritable(this->cout_pipe, true);
-            actions.adddup2(this->cout_pipe, kStdOutValue);
-            actions.addclose(this->cout_pipe);
+            actions.adddup2(plan.cout_pipe, kStdOutValue);
+            if (plan.cout_pipe != kStdOutValue)
+                actions.addclose(plan.cout_pipe);
         }
 
-        if (cerr_option == PipeOption::close) {
+        if (plan.cerr_option == PipeOption::close) {
             actions.addclose(kStdErrValue);
-        } else if (cerr_option == PipeOption::pipe) {
-            cerr_pair = pipe_create(true);
+        } else if (plan.cerr_option == PipeOption::pipe) {
+            cerr_pair = pipe_create(false);
             actions.addclose(cerr_pair.input);
             actions.adddup2(cerr_pair.output, kStdErrValue);
             actions.addclose(cerr_pair.output);
             process.cerr = cerr_pair.input;
-            pipe_set_inheritable(process.cerr, false);
-        } else if (cerr_option == PipeOption::cout) {
+        } else if (plan.cerr_option == PipeOption::memfd) {
+            cerr_pair = PipePair(create_memfd("subprocess-cerr"), kBadPipeValue);
+            actions.adddup2(cerr_pair.input, kStdErrValue);
+            process.cerr = cerr_pair.input;
+        } else if (plan.cerr_option == PipeOption::cout) {
             actions.adddup2(kStdOutValue, kStdErrValue);
-        } else if (cerr_option == PipeOption::specific) {
-            if (this->cerr_pipe == kBadPipeValue) {
+        } else if (plan.cerr_option == PipeOption::specific) {
+            if (plan.cerr_pipe == kBadPipeValue) {
                 throw std::invalid_argument("ProcessBuilder: bad pipe value for cerr");
             }
 
-            pipe_set_inheritable(this->cerr_pipe, true);
-            actions.adddup2(this->cerr_pipe, kStdErrValue);
-            actions.addclose(this->cerr_pipe);
+            actions.adddup2(plan.cerr_pipe, kStdErrValue);
+            if (plan.cerr_pipe != kStdErrValue)
+                actions.addclose(plan.cerr_pipe);
         }
 
-        if (cout_option == PipeOption::cerr) {
+        if (plan.cout_option == PipeOption::cerr) {
             actions.adddup2(kStdErrValue, kStdOutValue);
         }
-        pid_t pid;
-        cstring_vector args;
-        args.reserve(command.size()+1);
-        args.push_back(program);
-        for(size_t i = 1; i < command.size(); ++i) {
-            args.push_back(command[i]);
-        }
-        args.push_back(nullptr);
-        char** env = environ;
-        cstring_vector env_store;
-        if (!this->env.empty()) {
-            for (auto& pair : this->env) {
-                std::string line = pair.first + "=" + pair.second;
-                env_store.push_back(line);
-            }
-            env_store.push_back(nullptr);
-            env = &env_store[0];
-        }
+        if (!plan.cwd.empty())
+            actions.addchdir(plan.cwd.c_str());
 
-        posix_spawnattr_t attributes;
-        posix_spawnattr_init(&attributes);
-        struct SpawnAttr {
-            SpawnAttr(posix_spawnattr_t& attributes) {
-                this->attributes = &attributes;
-            }
-            ~SpawnAttr() {
-                int ret = posix_spawnattr_destroy(attributes);
-                throw_os_error("posix_spawnattr_destroy", ret);
-            }
+        SpawnRequest request;
+        request.program         = argv[0];
+        request.argv            = argv;
+        request.envp            = environ;
+        std::shared_ptr<const EnvBlock> env_block;
+        if (!plan.envp.empty()) {
+            request.envp = plan.envp.data();
+        } else if (!plan.env_overlay.empty()) {
+            env_block = plan.env_overlay.block();
+            request.envp = env_block->envp.data();
+        }
+        request.actions         = &actions;
+        request.clear_sigmask   = plan.new_process_group;
 
-            void setflags(short flags) {
-                int ret = posix_spawnattr_setflags(attributes, flags);
-                throw_os_error("posix_spawnattr_setflags", ret);
-            }
-            posix_spawnattr_t* attributes;
-        } attributes_raii(attributes);
-#if 0
-        // I can't think of a nice way to make this configurable.
-        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
-        sigset_t signal_mask;
-        sigemptyset(&signal_mask);
-        posix_spawnattr_setsigmask(&attributes, &signal_mask);
+        pid_t pid   = 0;
+        int pidfd   = -1;
+        details::TraceSpan span("spawn");
+        process.usage.start_time        = system_seconds();
+        process.usage.start_monotonic   = monotonic_seconds();
+        try {
+            switch (plan.backend) {
+            case SpawnBackend::automatic:
+            case SpawnBackend::posix_spawn:
+                pid = spawn_posix_spawn(request);
+                break;
+            case SpawnBackend::vfork:
+                pid = spawn_vfork(request);
+                break;
+            case SpawnBackend::clone_pidfd:
+#if defined(__linux__) && defined(CLONE_PIDFD)
+                pid = spawn_clone_pidfd(request, pidfd);
+#else
+                pid = spawn_vfork(request);
 #endif
-        int flags = this->new_process_group? POSIX_SPAWN_SETSIGMASK : 0;
-#ifdef POSIX_SPAWN_USEVFORK
-        flags |= POSIX_SPAWN_USEVFORK;
-#endif
-        attributes_raii.setflags(flags);
-        {
-            /*  I should have gone with vfork() :(
-                TODO: reimplement with vfork for thread safety.
-
-                this locking solution should work in practice just fine.
-            */
-            static std::mutex mutex;
-            std::unique_lock<std::mutex> lock(mutex);
-            CwdGuard cwdGuard;
-            if (!this->cwd.empty())
-                subprocess::setcwd(this->cwd);
-            int ret = posix_spawn(&pid, args[0], actions.get(), &attributes, &args[0], env);
-            if(ret != 0)
-                throw SpawnError("posix_spawn failed with error: " + std::string(strerror(ret)));
-        }
-        args.clear();
-        env_store.clear();
+                break;
+            }
+        } catch (...) {
+            details::metric_add(details::Metric::spawn_errors);
+            throw;
+        }
+        details::metric_spawned(args, monotonic_seconds() - process.usage.start_monotonic);
         if (cin_pair)
             cin_pair.close_input();
         if (cout_pair)
@@ -238,10 +562,53 @@ namespace subprocess {
         cout_pair.disown();
         cerr_pair.disown();
         process.pid = pid;
-        process.args = command;
+        span.pid    = pid;
+        if (span.active())
+            span.detail = details::trace_command(args);
+        // the child can't be reaped before we get here so pid can't be reused
+        process.pidfd = pidfd >= 0? pidfd : pidfd_open(pid);
+        process.exit_state = reaper_watch(pid, process.pidfd);
+        process.args = std::move(args);
         return process;
     }
 
+    Popen ProcessBuilder::run_command(const CommandLine& command) {
+        SpawnPlan plan;
+        make_plan(*this, command, plan);
+        return plan.spawn(plan.argv.data(), command);
+    }
+
+    SpawnTemplate::SpawnTemplate(const ProcessBuilder& builder, CommandLine command) {
+        auto plan = std::make_shared<SpawnPlan>();
+        make_plan(builder, command.empty()? builder.command : command, *plan);
+        mPlan = std::move(plan);
+    }
+
+    std::size_t SpawnTemplate::placeholder_count() const {
+        return mPlan->placeholders.size();
+    }
+
+    const std::string& SpawnTemplate::program() const {
+        return mPlan->program;
+    }
+
+    Popen SpawnTemplate::spawn(const std::vector<std::string>& args) const {
+        const SpawnPlan& plan = *mPlan;
+        if (args.empty())
+            return plan.spawn(plan.argv.data(), plan.command);
+        if (args.size() != plan.placeholders.size())
+            throw std::invalid_argument("SpawnTemplate::spawn: expected "
+                + std::to_string(plan.placeholders.size()) + " arguments");
+        std::vector<char*> argv = plan.argv;
+        CommandLine command = plan.command;
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            std::size_t index   = plan.placeholders[i];
+            argv[index]         = const_cast<char*>(args[i].c_str());
+            command[index]      = args[i];
+        }
+        return plan.spawn(argv.data(), std::move(command));
+    }
+
 #endif
 }
 #endif
\ No newline at end of file
@@ -10,6 +10,8 @@
 #include "shell_utils.hpp"
 #include "environ.hpp"
 #include "utf8_to_utf16.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
 
 static STARTUPINFO g_startupInfo;
 static bool g_startupInfoInit = false;
@@ -26,6 +28,10 @@ bool disable_inherit(subprocess::PipeHandle handle) {
 }
 
 namespace subprocess {
+    bool spawn_backend_available(SpawnBackend backend) {
+        // there is only CreateProcess
+        return backend == SpawnBackend::automatic;
+    }
 
     Popen ProcessBuilder::run_command(const CommandLine& command) {
         static_assert(sizeof(wchar_t) == 2, "wchar_t must be of size 2");
@@ -33,6 +39,7 @@ namespace subprocess {
 
         std::string program = find_program(command[0]);
         if(program.empty()) {
+            details::metric_add(details::Metric::spawn_errors);
             throw CommandNotFoundError("command not found " + command[0]);
         }
         init_startup_info();
@@ -116,6 +123,7 @@ namespace subprocess {
 
         void* env = nullptr;
         std::u16string envblock;
+        std::shared_ptr<const EnvBlock> env_shared;
         if (!this->env.empty()) {
             /*  if you use ansi there is a 37K size limit. So we use unicode
                 which is almost utf16.
@@ -125,8 +133,13 @@ namespace subprocess {
                 This won't work as expected if somewhere there is a multibyte
                 utf-16 char (4-bytes total).
             */
-            envblock = create_env_block(this->env);
+            EnvMap env_map = this->env;
+            env_overlay.apply(env_map);
+            envblock = create_env_block(env_map);
             env = (void*)envblock.data();
+        } else if (!env_overlay.empty()) {
+            env_shared = env_overlay.block();
+            env = (void*)env_shared->block.data();
         }
         DWORD process_flags = CREATE_UNICODE_ENVIRONMENT;
         if (this->new_process_group) {
@@ -137,6 +150,9 @@ namespace subprocess {
         // Create the child process.
         std::u16string cmd_args{ utf8_to_utf16(args) };
         cmd_args.reserve(MAX_PATH+1);
+        details::TraceSpan span("spawn");
+        process.usage.start_time        = system_seconds();
+        process.usage.start_monotonic   = monotonic_seconds();
         bSuccess = CreateProcessW(
           (LPCWSTR)utf8_to_utf16(program).c_str(),
           (LPWSTR)cmd_args.data(),                                                      // command line
@@ -149,7 +165,11 @@ namespace subprocess {
           &siStartInfo,                                                                 // STARTUPINFO pointer
           &process.process_info);                                                       // receives PROCESS_INFORMATION
 
+        double spawn_latency = monotonic_seconds() - process.usage.start_monotonic;
         process.pid = process.process_info.dwProcessId;
+        span.pid    = process.pid;
+        if (span.active())
+            span.detail = details::trace_command(command);
         if (cin_pair)
             cin_pair.close_input();
         if (cout_pair)
@@ -170,10 +190,65 @@ namespace subprocess {
 
         process.args = command;
         // TODO: get error and add it to throw
-        if (!bSuccess )
+        if (!bSuccess ) {
+            details::metric_add(details::Metric::spawn_errors);
             throw SpawnError("CreateProcess failed");
+        }
+        details::metric_spawned(command, spawn_latency);
         return process;
     }
+
+    /*  CreateProcess takes a single command line string and builds the
+        environment block itself, there is little to compile ahead of time.
+    */
+    struct SpawnPlan {
+        ProcessBuilder              builder;
+        std::string                 program;
+        std::vector<std::size_t>    placeholders;
+    };
+
+    SpawnTemplate::SpawnTemplate(const ProcessBuilder& builder, CommandLine command) {
+        auto plan = std::make_shared<SpawnPlan>();
+        plan->builder = builder;
+        if (!command.empty())
+            plan->builder.command = command;
+        CommandLine& args = plan->builder.command;
+        if (args.empty())
+            throw std::invalid_argument("command should not be empty");
+        plan->program = find_program(args[0]);
+        if (plan->program.empty())
+            throw CommandNotFoundError("command not found " + args[0]);
+        for (std::size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == kPlaceholder)
+                plan->placeholders.push_back(i);
+        }
+        // no anonymous files to redirect to, capture through a pipe instead
+        if (plan->builder.cout_option == PipeOption::memfd)
+            plan->builder.cout_option = PipeOption::pipe;
+        if (plan->builder.cerr_option == PipeOption::memfd)
+            plan->builder.cerr_option = PipeOption::pipe;
+        mPlan = std::move(plan);
+    }
+
+    std::size_t SpawnTemplate::placeholder_count() const {
+        return mPlan->placeholders.size();
+    }
+
+    const std::string& SpawnTemplate::program() const {
+        return mPlan->program;
+    }
+
+    Popen SpawnTemplate::spawn(const std::vector<std::string>& args) const {
+        ProcessBuilder builder = mPlan->builder;
+        if (!args.empty()) {
+            if (args.size() != mPlan->placeholders.size())
+                throw std::invalid_argument("SpawnTemplate::spawn: expected "
+                    + std::to_string(mPlan->placeholders.size()) + " arguments");
+            for (std::size_t i = 0; i < args.size(); ++i)
+                builder.command[mPlan->placeholders[i]] = args[i];
+        }
+        return builder.run();
+    }
 }
 
 #endif
\ No newline at end of file
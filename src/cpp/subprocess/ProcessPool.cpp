@@ -0,0 +1,86 @@
+#ifndef _WIN32
+#include "ProcessPool.hpp"
+
+#include <exception>
+#include <stdexcept>
+
+namespace subprocess {
+    ProcessPool::ProcessPool(std::size_t max_running, bool ordered)
+        : mMaxRunning(max_running), mOrdered(ordered) {
+        if (max_running == 0)
+            throw std::invalid_argument("ProcessPool: max_running must be at least 1");
+    }
+
+    std::size_t ProcessPool::submit(RunBuilder job) {
+        return submit(std::move(job.command), std::move(job.options));
+    }
+
+    std::size_t ProcessPool::submit(CommandLine command, RunOptions options) {
+        std::size_t index = mSubmitted++;
+        mQueue.push_back({index, std::move(command), std::move(options)});
+        return index;
+    }
+
+    void ProcessPool::push(Result result) {
+        if (mOrdered)
+            mDoneOrdered.emplace(result.index, std::move(result));
+        else
+            mDone.push_back(std::move(result));
+    }
+
+    void ProcessPool::fill() {
+        while (!mQueue.empty() && mReactor.size() < mMaxRunning) {
+            Job job = std::move(mQueue.front());
+            mQueue.pop_front();
+            std::size_t index   = job.index;
+            bool check          = job.options.check;
+            try {
+                mReactor.spawn(std::move(job.command), std::move(job.options),
+                    [this, index, check](ProcessReactor::Id, CompletedProcess& completed) {
+                        push({index, check, std::move(completed), nullptr});
+                    });
+            } catch (...) {
+                // thrown from next() in its turn
+                push({index, false, {}, std::current_exception()});
+            }
+        }
+    }
+
+    bool ProcessPool::next(CompletedProcess& completed, std::size_t* job) {
+        Result result;
+        while (true) {
+            if (mReturned >= mSubmitted)
+                return false;
+            fill();
+            if (!mOrdered && !mDone.empty()) {
+                result = std::move(mDone.front());
+                mDone.pop_front();
+                break;
+            }
+            if (mOrdered && !mDoneOrdered.empty()
+                && mDoneOrdered.begin()->first == mReturned) {
+                result = std::move(mDoneOrdered.begin()->second);
+                mDoneOrdered.erase(mDoneOrdered.begin());
+                break;
+            }
+            mReactor.run_once(-1);
+        }
+        ++mReturned;
+        if (job)
+            *job = result.index;
+        if (result.error)
+            std::rethrow_exception(result.error);
+        if (result.check && result.completed.returncode != 0) {
+            CalledProcessError error("failed to execute " + result.completed.args[0]);
+            error.cmd           = result.completed.args;
+            error.returncode    = result.completed.returncode;
+            error.cout          = std::move(result.completed.cout);
+            error.cerr          = std::move(result.completed.cerr);
+            error.usage         = result.completed.usage;
+            throw error;
+        }
+        completed = std::move(result.completed);
+        return true;
+    }
+}
+#endif
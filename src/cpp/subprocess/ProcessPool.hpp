@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <map>
+
+#include "ProcessReactor.hpp"
+
+namespace subprocess {
+    /** Runs queued jobs with at most N processes at a time, like make -j.
+
+        Everything happens in the thread iterating the results, using a
+        ProcessReactor: the next job starts the moment one exits and no
+        thread waits on any child. cin/cout/cerr are handled as the reactor
+        does, PipeOption::pipe cout/cerr is captured into the result.
+
+        Results come in completion order, or submission order if ordered is
+        set. RunOptions::check is honored when the result is returned,
+        RunOptions::timeout is ignored.
+
+        @code
+        ProcessPool pool(8);
+        for (auto& file : files)
+            pool.submit(RunBuilder({"gzip", "-k", file}).check(true));
+        for (CompletedProcess& completed : pool)
+            std::cout << completed.args.back() << " done\n";
+        @endcode
+
+        Not thread safe, use it from a single thread. posix only.
+    */
+    class ProcessPool {
+    public:
+        /** Input iterator over the results, see next(). */
+        class iterator {
+        public:
+            typedef std::input_iterator_tag iterator_category;
+            typedef CompletedProcess        value_type;
+            typedef std::ptrdiff_t          difference_type;
+            typedef CompletedProcess*       pointer;
+            typedef CompletedProcess&       reference;
+
+            iterator(){}
+            explicit iterator(ProcessPool* pool) : mPool(pool) { ++*this; }
+
+            reference operator*() { return mCompleted; }
+            pointer operator->() { return &mCompleted; }
+            iterator& operator++() {
+                if (!mPool->next(mCompleted, &mJob))
+                    mPool = nullptr;
+                return *this;
+            }
+            /** @return index of the job the current result is from */
+            std::size_t job() const { return mJob; }
+
+            bool operator==(const iterator& other) const { return mPool == other.mPool; }
+            bool operator!=(const iterator& other) const { return mPool != other.mPool; }
+        private:
+            ProcessPool*        mPool = nullptr;
+            CompletedProcess    mCompleted;
+            std::size_t         mJob = 0;
+        };
+
+        /** @param max_running  processes to run at once, at least 1.
+            @param ordered      return results in submission order.
+        */
+        explicit ProcessPool(std::size_t max_running, bool ordered=false);
+
+        /** Queues a job, it starts once there is room.
+
+            @return index of the job, counting from 0 in submission order.
+        */
+        std::size_t submit(RunBuilder job);
+        /** Queues a job, it starts once there is room. */
+        std::size_t submit(CommandLine command, RunOptions options={});
+
+        /** Runs jobs until the next result is ready.
+
+            @param completed    set to the result.
+            @param job          if not null set to the index of the job.
+
+            @return false once every submitted job has been returned.
+
+            @throw CalledProcessError   if the job failed and had check set.
+                                        Following results are unaffected.
+            @throw                      same as Popen's constructor if a job
+                                        fails to start.
+        */
+        bool next(CompletedProcess& completed, std::size_t* job=nullptr);
+
+        /** Results are consumed while iterating. */
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(); }
+
+        /** @return number of jobs running */
+        std::size_t running() const { return mReactor.size(); }
+        /** @return number of jobs waiting for room to start */
+        std::size_t queued() const { return mQueue.size(); }
+
+    private:
+        struct Job {
+            std::size_t index;
+            CommandLine command;
+            RunOptions  options;
+        };
+        struct Result {
+            std::size_t         index;
+            bool                check;
+            CompletedProcess    completed;
+            /** the job failed to start */
+            std::exception_ptr  error;
+        };
+        void push(Result result);
+        void fill();
+
+        ProcessReactor      mReactor;
+        std::size_t         mMaxRunning;
+        bool                mOrdered;
+        std::deque<Job>     mQueue;
+        std::size_t         mSubmitted  = 0;
+        std::size_t         mReturned   = 0;
+        /** in completion order */
+        std::deque<Result>  mDone;
+        /** by index for ordered */
+        std::map<std::size_t, Result> mDoneOrdered;
+    };
+}
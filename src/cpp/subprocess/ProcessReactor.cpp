@@ -0,0 +1,375 @@
+#ifndef _WIN32
+#include "ProcessReactor.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <istream>
+#include <ostream>
+
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+using namespace subprocess::details;
+
+namespace subprocess {
+    namespace {
+        enum WatchKind {
+            kWatchCin,
+            kWatchCout,
+            kWatchCerr,
+            kWatchExit,
+            kWatchCount
+        };
+    }
+
+    struct ProcessReactor::Child {
+        struct Watch {
+            Child*  child;
+            int     kind;
+        };
+        struct Output {
+            std::ostream*   stream  = nullptr;
+            FILE*           file    = nullptr;
+            std::string*    capture = nullptr;
+            CaptureMeter    meter;
+
+            void write(const char* data, std::size_t size) {
+                if (stream) {
+                    stream->write(data, size);
+                    metric_add(Metric::stream_bytes, size);
+                } else if (file) {
+                    fwrite(data, 1, size, file);
+                    metric_add(Metric::file_bytes, size);
+                } else if (capture) {
+                    capture->append(data, size);
+                    meter.add(size);
+                }
+            }
+        };
+
+        Id                  id = 0;
+        Popen               popen;
+        ExitCallback        on_exit;
+        CompletedProcess    completed;
+        Watch               watches[kWatchCount] = {};
+        bool                watched[kWatchCount] = {};
+        bool                exited = false;
+        /** on mReady already */
+        bool                ready = false;
+
+        /** bytes waiting to be written to cin */
+        std::string_view    pending;
+        std::string         pending_store;
+        std::istream*       cin_stream  = nullptr;
+        FILE*               cin_file    = nullptr;
+
+        Output              cout;
+        Output              cerr;
+
+        PipeHandle handle(int kind) {
+            switch (kind) {
+            case kWatchCin:     return popen.cin;
+            case kWatchCout:    return popen.cout;
+            case kWatchCerr:    return popen.cerr;
+            default:            return popen.pidfd;
+            }
+        }
+
+        /*  Takes over the redirection if it's something Popen would need a
+            thread for. Popen gets a pipe instead.
+        */
+        bool take_input(PipeVar& option) {
+            switch (static_cast<PipeVarIndex>(option.index())) {
+            case PipeVarIndex::string:
+                pending_store = std::move(std::get<std::string>(option));
+                pending = pending_store;
+                break;
+            case PipeVarIndex::view:
+                pending = std::get<InputView>(option).data;
+                break;
+            case PipeVarIndex::istream:
+                cin_stream = std::get<std::istream*>(option);
+                break;
+            case PipeVarIndex::file:
+                cin_file = std::get<FILE*>(option);
+                break;
+            default:
+                return false;
+            }
+            option = PipeOption::pipe;
+            return true;
+        }
+        void take_output(PipeVar& option, Output& output, std::string& capture) {
+            switch (static_cast<PipeVarIndex>(option.index())) {
+            case PipeVarIndex::option:
+                if (std::get<PipeOption>(option) != PipeOption::pipe)
+                    return;
+                output.capture = &capture;
+                break;
+            case PipeVarIndex::ostream:
+                output.stream = std::get<std::ostream*>(option);
+                break;
+            case PipeVarIndex::file:
+                output.file = std::get<FILE*>(option);
+                break;
+            default:
+                return;
+            }
+            option = PipeOption::pipe;
+        }
+
+        /** Refills pending from cin_stream/cin_file. @return false at the end */
+        bool refill(std::vector<char>& buffer) {
+            std::size_t transferred = 0;
+            if (cin_stream) {
+                cin_stream->read(buffer.data(), buffer.size());
+                transferred = cin_stream->gcount();
+            } else if (cin_file) {
+                transferred = fread(buffer.data(), 1, buffer.size(), cin_file);
+            }
+            pending_store.assign(buffer.data(), transferred);
+            pending = pending_store;
+            return transferred > 0;
+        }
+    };
+
+    ProcessReactor::ProcessReactor() {
+        mBuffer.resize(64*1024);
+#ifdef __linux__
+        mPoller = epoll_create1(EPOLL_CLOEXEC);
+        if (mPoller < 0)
+            throw_os_error("epoll_create1", errno);
+#endif
+    }
+
+    ProcessReactor::~ProcessReactor() {
+        // Popen destructors close the pipes and reap the children.
+        mChildren.clear();
+        if (mPoller >= 0)
+            ::close(mPoller);
+    }
+
+    void ProcessReactor::watch(Child& child, int kind, PipeHandle handle, bool write) {
+        child.watches[kind] = {&child, kind};
+        child.watched[kind] = true;
+        if (kind != kWatchExit)
+            pipe_set_blocking(handle, false);
+#ifdef __linux__
+        epoll_event event = {};
+        event.events    = write? EPOLLOUT : EPOLLIN;
+        event.data.ptr  = &child.watches[kind];
+        if (epoll_ctl(mPoller, EPOLL_CTL_ADD, handle, &event) < 0)
+            throw_os_error("epoll_ctl", errno);
+#else
+        (void)write;
+#endif
+    }
+
+    void ProcessReactor::unwatch(Child& child, int kind) {
+        if (!child.watched[kind])
+            return;
+        child.watched[kind] = false;
+#ifdef __linux__
+        epoll_ctl(mPoller, EPOLL_CTL_DEL, child.handle(kind), nullptr);
+#endif
+    }
+
+    ProcessReactor::Id ProcessReactor::spawn(CommandLine command, RunOptions options,
+        ExitCallback on_exit
+    ) {
+        std::unique_ptr<Child> child = std::make_unique<Child>();
+        bool serviced_cin = child->take_input(options.cin);
+        child->take_output(options.cout, child->cout, child->completed.cout);
+        child->take_output(options.cerr, child->cerr, child->completed.cerr);
+
+        child->completed.args   = command;
+        child->popen            = Popen(command, std::move(options));
+        child->on_exit          = std::move(on_exit);
+        child->id               = mNextId++;
+
+        Popen& popen = child->popen;
+        if (serviced_cin)
+            watch(*child, kWatchCin, popen.cin, true);
+        if (child->cout.stream || child->cout.file || child->cout.capture)
+            watch(*child, kWatchCout, popen.cout, false);
+        if (child->cerr.stream || child->cerr.file || child->cerr.capture)
+            watch(*child, kWatchCerr, popen.cerr, false);
+        Id id = child->id;
+        if (popen.pidfd >= 0)
+            watch(*child, kWatchExit, popen.pidfd, false);
+        else
+            mWithoutPidfd.push_back(id);
+
+        mChildren[id] = std::move(child);
+        return id;
+    }
+
+    Popen* ProcessReactor::get(Id id) {
+        auto it = mChildren.find(id);
+        return it == mChildren.end()? nullptr : &it->second->popen;
+    }
+
+    void ProcessReactor::handle_event(void* watch_ptr, bool ready) {
+        Child::Watch& watch = *static_cast<Child::Watch*>(watch_ptr);
+        Child& child = *watch.child;
+        Popen& popen = child.popen;
+        if (!ready || !child.watched[watch.kind])
+            return;
+
+        if (watch.kind == kWatchExit) {
+            /*  The pidfd stays readable until the exit is collected. With the
+                reaper running that's its thread, so rather than spinning on a
+                level triggered watch until it got there, wait for it.
+            */
+            unwatch(child, kWatchExit);
+            popen.wait();
+            child.exited = true;
+            check_ready(child);
+            return;
+        }
+        if (watch.kind == kWatchCin) {
+            while (true) {
+                if (child.pending.empty() && !child.refill(mBuffer))
+                    break;
+                ssize_t transferred = write_no_sigpipe(popen.cin,
+                    child.pending.data(), child.pending.size());
+                if (transferred < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return;
+                if (transferred < 0 && errno == EINTR)
+                    continue;
+                if (transferred <= 0)
+                    break;
+                child.pending.remove_prefix(transferred);
+                metric_add(Metric::input_bytes, transferred);
+            }
+            unwatch(child, kWatchCin);
+            popen.close_cin();
+            child.pending = {};
+            child.pending_store = {};
+            return;
+        }
+
+        Child::Output& output = watch.kind == kWatchCout? child.cout : child.cerr;
+        while (true) {
+            ssize_t transferred;
+            if (output.stream || output.file) {
+                transferred = ::read(child.handle(watch.kind), mBuffer.data(), mBuffer.size());
+                if (transferred > 0)
+                    output.write(mBuffer.data(), transferred);
+            } else {
+                transferred = pipe_read_append(child.handle(watch.kind), *output.capture);
+                if (transferred > 0)
+                    output.meter.add(transferred);
+            }
+            if (transferred > 0)
+                output_seen(popen);
+            if (transferred < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (transferred < 0 && errno == EINTR)
+                continue;
+            if (transferred <= 0)
+                break;
+        }
+        unwatch(child, watch.kind);
+        if (trace_on())
+            trace_instant(watch.kind == kWatchCout? "cout EOF" : "cerr EOF", popen.pid);
+        PipeHandle& handle = watch.kind == kWatchCout? popen.cout : popen.cerr;
+        pipe_close(handle);
+        handle = kBadPipeValue;
+        check_ready(child);
+    }
+
+    void ProcessReactor::check_ready(Child& child) {
+        if (child.ready || !child.exited || child.watched[kWatchCout]
+                || child.watched[kWatchCerr])
+            return;
+        child.ready = true;
+        mReady.push_back(child.id);
+    }
+
+    int ProcessReactor::run_once(double timeout) {
+        if (mChildren.empty())
+            return 0;
+        // nothing tells us about their exit, check on them regularly
+        if (!mWithoutPidfd.empty() && (timeout < 0 || timeout > 0.01))
+            timeout = 0.01;
+        int ms = timeout < 0? -1 : (int)std::ceil(timeout*1000);
+#ifdef __linux__
+        epoll_event events[64];
+        int count = epoll_wait(mPoller, events, 64, ms);
+        if (count < 0 && errno != EINTR)
+            throw_os_error("epoll_wait", errno);
+        for (int i = 0; i < count; ++i) {
+            handle_event(events[i].data.ptr, !!(events[i].events
+                & (EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR)));
+        }
+#else
+        std::vector<pollfd> fds;
+        std::vector<void*> watches;
+        for (auto& pair : mChildren) {
+            Child& child = *pair.second;
+            for (int kind = 0; kind < kWatchCount; ++kind) {
+                if (!child.watched[kind])
+                    continue;
+                pollfd pfd = {};
+                pfd.fd      = child.handle(kind);
+                pfd.events  = kind == kWatchCin? POLLOUT : POLLIN;
+                fds.push_back(pfd);
+                watches.push_back(&child.watches[kind]);
+            }
+        }
+        int count = ::poll(fds.data(), fds.size(), ms);
+        if (count < 0 && errno != EINTR)
+            throw_os_error("poll", errno);
+        for (std::size_t i = 0; count > 0 && i < fds.size(); ++i)
+            handle_event(watches[i], fds[i].revents != 0);
+#endif
+        for (std::size_t i = 0; i < mWithoutPidfd.size();) {
+            Child& child = *mChildren[mWithoutPidfd[i]];
+            if (!child.popen.poll()) {
+                ++i;
+                continue;
+            }
+            child.exited = true;
+            check_ready(child);
+            mWithoutPidfd[i] = mWithoutPidfd.back();
+            mWithoutPidfd.pop_back();
+        }
+        return finish_ready();
+    }
+
+    int ProcessReactor::finish_ready() {
+        // only the children that became ready, not all of them
+        std::vector<std::unique_ptr<Child>> finished;
+        for (Id id : mReady) {
+            auto it = mChildren.find(id);
+            Child& child = *it->second;
+            // it won't read any more
+            unwatch(child, kWatchCin);
+            child.popen.close_cin();
+            finished.push_back(std::move(it->second));
+            mChildren.erase(it);
+        }
+        mReady.clear();
+        // callbacks may spawn more, so they run after we're done iterating
+        for (auto& child : finished) {
+            child->completed.returncode = child->popen.returncode;
+            child->completed.usage      = child->popen.usage;
+            if (child->on_exit)
+                child->on_exit(child->id, child->completed);
+        }
+        return (int)finished.size();
+    }
+
+    void ProcessReactor::run() {
+        while (!mChildren.empty())
+            run_once(-1);
+    }
+}
+#endif
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "ProcessBuilder.hpp"
+
+namespace subprocess {
+    /** Drives many processes from a single thread.
+
+        Popen services std::string, std::istream*, std::ostream* and FILE*
+        redirections with a thread per stream. ProcessReactor instead does all
+        stdin writes, stdout/stderr reads and exit detection from one
+        epoll loop (poll on non linux) in the thread calling run(). The cost
+        of a child is its pipes and a small bookkeeping struct.
+
+        PipeOption::pipe for cout/cerr is captured into the CompletedProcess
+        given to the exit callback. PipeOption::pipe for cin is left for you
+        to use through get().
+
+        RunOptions::timeout and RunOptions::check are ignored.
+
+        Not thread safe, use it from a single thread. posix only.
+    */
+    class ProcessReactor {
+    public:
+        typedef std::size_t Id;
+        /** Called once the process exited and all its output is drained. */
+        typedef std::function<void(Id id, CompletedProcess& completed)> ExitCallback;
+
+        ProcessReactor();
+        /** Closes all pipes and waits for the remaining processes. */
+        ~ProcessReactor();
+        ProcessReactor(const ProcessReactor&)=delete;
+        ProcessReactor& operator=(const ProcessReactor&)=delete;
+
+        /** Starts command.
+
+            @param on_exit  called from run()/run_once() once the process is
+                            done.
+
+            @return id of the process, valid until on_exit is called.
+
+            @throw  same as Popen's constructor
+        */
+        Id spawn(CommandLine command, RunOptions options, ExitCallback on_exit={});
+
+        /** Waits for and handles events.
+
+            @param timeout  seconds to wait for events, -1 for no limit.
+
+            @return number of processes that completed.
+        */
+        int run_once(double timeout=-1);
+        /** Runs until all processes completed. */
+        void run();
+
+        /** @return the running process for id or nullptr */
+        Popen* get(Id id);
+        /** @return number of processes not yet completed */
+        std::size_t size() const { return mChildren.size(); }
+        bool empty() const { return mChildren.empty(); }
+
+    private:
+        struct Child;
+        void handle_event(void* watch, bool ready);
+        void watch(Child& child, int kind, PipeHandle handle, bool write);
+        void unwatch(Child& child, int kind);
+        void check_ready(Child& child);
+        int finish_ready();
+
+        int         mPoller = -1;
+        Id          mNextId = 1;
+        /** children whose exit has to be polled for, not yet seen exiting */
+        std::vector<Id> mWithoutPidfd;
+        /** exited with all output drained, for finish_ready() */
+        std::vector<Id> mReady;
+        std::vector<char> mBuffer;
+        std::unordered_map<Id, std::unique_ptr<Child>> mChildren;
+    };
+}
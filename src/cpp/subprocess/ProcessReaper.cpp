@@ -0,0 +1,238 @@
+#include "ProcessReaper.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "Metrics.hpp"
+#include "ProcessBuilder.hpp"
+
+#if defined(__linux__) && !defined(P_PIDFD)
+// linux 5.4, missing from older headers
+#define P_PIDFD 3
+#endif
+
+namespace subprocess {
+    namespace {
+        struct Reaper {
+            ~Reaper() { stop(); }
+
+            bool start();
+            void stop();
+            void run();
+            std::shared_ptr<details::ExitState> watch(pid_t pid, int pidfd);
+
+            /** serializes start() & stop() */
+            std::mutex          lifecycle;
+            /** guards watched and registering with poller */
+            std::mutex          mutex;
+            std::atomic<bool>   running{false};
+            int                 poller = -1;
+            /** eventfd to wake the thread up for stopping */
+            int                 wakeup = -1;
+            std::thread         thread;
+            /** the reaper holds a reference until it collected the exit */
+            std::unordered_map<details::ExitState*,
+                std::shared_ptr<details::ExitState>> watched;
+        };
+
+        Reaper g_reaper;
+
+#ifdef __linux__
+        void publish(details::ExitState& state, int value) {
+            state.state.store(value, std::memory_order_release);
+            syscall(SYS_futex, reinterpret_cast<int*>(&state.state),
+                FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+        }
+
+        /** @return true if the process is gone and state was published */
+        bool collect(details::ExitState& state) {
+            siginfo_t info = {};
+            struct rusage usage = {};
+            // the raw syscall also reports rusage, glibc's waitid doesn't
+            long ret = syscall(SYS_waitid, P_PIDFD, state.pidfd, &info,
+                WEXITED | WNOHANG, &usage);
+            if (ret < 0 && errno == EINTR)
+                return false;
+            if (ret == 0 && info.si_pid == 0)
+                return false;
+            if (ret < 0) {
+                // reaped by someone else, python also settles for 0
+                state.returncode = 0;
+            } else if (info.si_code == CLD_EXITED) {
+                state.returncode = info.si_status;
+            } else {
+                state.returncode = -info.si_status;
+            }
+            state.usage     = usage;
+            state.exited    = monotonic_seconds();
+            // a zombie until its Popen collects it, unless it gave up on it
+            int tally = details::ExitState::kTallyOwned;
+            details::metric_add(details::Metric::running, -1);
+            if (state.tally.compare_exchange_strong(tally, details::ExitState::kTallyZombie))
+                details::metric_add(details::Metric::zombie, 1);
+            publish(state, details::ExitState::kExited);
+            return true;
+        }
+
+        bool Reaper::start() {
+            std::lock_guard<std::mutex> guard(lifecycle);
+            if (running)
+                return true;
+            // EBADF if P_PIDFD is understood, EINVAL on kernels before 5.4
+            siginfo_t info = {};
+            if (syscall(SYS_waitid, P_PIDFD, INT_MAX, &info, WEXITED | WNOHANG, nullptr) == 0
+                || errno != EBADF)
+                return false;
+            poller = epoll_create1(EPOLL_CLOEXEC);
+            wakeup = eventfd(0, EFD_CLOEXEC);
+            if (poller < 0 || wakeup < 0) {
+                int error = errno;
+                for (int* fd : {&poller, &wakeup}) {
+                    if (*fd >= 0)
+                        ::close(*fd);
+                    *fd = -1;
+                }
+                details::throw_os_error("reaper_start", error);
+            }
+            epoll_event event = {};
+            event.events    = EPOLLIN;
+            event.data.ptr  = nullptr;
+            epoll_ctl(poller, EPOLL_CTL_ADD, wakeup, &event);
+
+            running = true;
+            thread = std::thread([this] { run(); });
+            return true;
+        }
+
+        void Reaper::stop() {
+            std::lock_guard<std::mutex> guard(lifecycle);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!running)
+                    return;
+                running = false;
+            }
+            uint64_t value = 1;
+            while (::write(wakeup, &value, sizeof(value)) < 0 && errno == EINTR)
+                ;
+            thread.join();
+            for (auto& pair : watched)
+                publish(*pair.first, details::ExitState::kDetached);
+            watched.clear();
+            ::close(poller);
+            ::close(wakeup);
+            poller = wakeup = -1;
+        }
+
+        void Reaper::run() {
+            details::HelperThreadMetric helper;
+            epoll_event events[64];
+            while (true) {
+                int count = epoll_wait(poller, events, 64, -1);
+                for (int i = 0; i < count; ++i) {
+                    if (events[i].data.ptr == nullptr)
+                        return;
+                    auto* state = static_cast<details::ExitState*>(events[i].data.ptr);
+                    if (!collect(*state))
+                        continue;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    epoll_ctl(poller, EPOLL_CTL_DEL, state->pidfd, nullptr);
+                    watched.erase(state);
+                }
+            }
+        }
+
+        std::shared_ptr<details::ExitState> Reaper::watch(pid_t pid, int pidfd) {
+            if (pidfd < 0 || !running.load(std::memory_order_relaxed))
+                return nullptr;
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running)
+                return nullptr;
+            auto state = std::make_shared<details::ExitState>(pid, pidfd);
+            epoll_event event = {};
+            event.events    = EPOLLIN;
+            event.data.ptr  = state.get();
+            if (epoll_ctl(poller, EPOLL_CTL_ADD, pidfd, &event) < 0) {
+                // the caller keeps it
+                state->pidfd = -1;
+                return nullptr;
+            }
+            watched[state.get()] = state;
+            return state;
+        }
+#else
+        bool Reaper::start() { return false; }
+        void Reaper::stop() {}
+        void Reaper::run() {}
+        std::shared_ptr<details::ExitState> Reaper::watch(pid_t, int) {
+            return nullptr;
+        }
+#endif
+    }
+
+    bool reaper_start() {
+        return g_reaper.start();
+    }
+
+    void reaper_stop() {
+        g_reaper.stop();
+    }
+
+    bool reaper_running() {
+        return g_reaper.running;
+    }
+
+    namespace details {
+        ExitState::~ExitState() {
+#ifndef _WIN32
+            if (pidfd >= 0)
+                ::close(pidfd);
+#endif
+        }
+
+        bool ExitState::wait(double timeout) {
+            double deadline = monotonic_seconds() + timeout;
+            while (state.load(std::memory_order_acquire) == kRunning) {
+#ifdef __linux__
+                timespec ts = {};
+                timespec* wait_time = nullptr;
+                if (timeout >= 0) {
+                    double remaining = deadline - monotonic_seconds();
+                    if (remaining <= 0)
+                        return false;
+                    ts.tv_sec   = (time_t)remaining;
+                    ts.tv_nsec  = (long)((remaining - (double)ts.tv_sec)*1e9);
+                    wait_time   = &ts;
+                }
+                syscall(SYS_futex, reinterpret_cast<int*>(&state),
+                    FUTEX_WAIT_PRIVATE, kRunning, wait_time, nullptr, 0);
+#else
+                // never published to without the reaper
+                if (timeout >= 0 && monotonic_seconds() >= deadline)
+                    return false;
+                sleep_seconds(0.001);
+#endif
+            }
+            return true;
+        }
+
+        std::shared_ptr<ExitState> reaper_watch(pid_t pid, int pidfd) {
+            return g_reaper.watch(pid, pidfd);
+        }
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "basic_types.hpp"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace subprocess {
+    /** Starts the process wide reaper.
+
+        One thread collects the exits of every Popen started afterwards from
+        an epoll set of their pidfds and publishes the returncode and rusage
+        to the Popen. Popen::poll() becomes a load of an atomic and
+        Popen::wait() a futex wait, neither makes a syscall per process.
+        Popen::close() no longer blocks until the process exits, the reaper
+        collects it whenever it does.
+
+        Only processes started by this library are reaped, and by pidfd, so
+        code calling waitpid() on its own children is not disturbed. If a
+        process is reaped by someone else anyway the returncode is 0, as the
+        status is lost.
+
+        linux 5.4+ only.
+
+        @return true if the reaper is running.
+    */
+    bool reaper_start();
+    /** Stops the reaper. Processes it hasn't collected yet go back to being
+        waited on by their Popen.
+    */
+    void reaper_stop();
+    /** @return true if new processes are collected by the reaper */
+    bool reaper_running();
+
+    namespace details {
+        /** Exit of a process as published by the reaper. */
+        struct ExitState {
+            enum {
+                kRunning,
+                kExited,
+                /** the reaper stopped, the owner has to reap it */
+                kDetached
+            };
+            ExitState(pid_t pid, int pidfd) : pid(pid), pidfd(pidfd) {}
+            /** Closes pidfd */
+            ~ExitState();
+            ExitState(const ExitState&)=delete;
+            ExitState& operator=(const ExitState&)=delete;
+
+            /** Waits for state to leave kRunning.
+
+                @param timeout  seconds, -1 to wait indefinitely.
+                @return false on timeout.
+            */
+            bool wait(double timeout);
+
+            /** How the metrics count the process once it exits */
+            enum {
+                /** running, its Popen will collect the exit */
+                kTallyOwned,
+                /** the reaper counted the exit as a zombie */
+                kTallyZombie,
+                /** collected or given up by its Popen */
+                kTallyReleased
+            };
+            std::atomic<int>    state{kRunning};
+            std::atomic<int>    tally{kTallyOwned};
+            /** valid once state is kExited */
+            int                 returncode  = kBadReturnCode;
+            /** monotonic_seconds() the reaper collected it, valid once
+                state is kExited
+            */
+            double              exited      = 0;
+#ifndef _WIN32
+            struct rusage       usage       = {};
+#endif
+            pid_t               pid;
+            /** owned, the Popen uses it too */
+            int                 pidfd;
+        };
+
+        /** @return the state the reaper publishes to, or nullptr if the
+                    reaper isn't running. Takes ownership of pidfd on success.
+        */
+        std::shared_ptr<ExitState> reaper_watch(pid_t pid, int pidfd);
+    }
+}
@@ -0,0 +1,162 @@
+#ifndef _WIN32
+#include "ProcessSet.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+using namespace subprocess::details;
+
+namespace subprocess {
+    ProcessSet::ProcessSet() {
+#ifdef __linux__
+        mPoller = epoll_create1(EPOLL_CLOEXEC);
+        if (mPoller < 0)
+            throw_os_error("epoll_create1", errno);
+#endif
+    }
+
+    ProcessSet::~ProcessSet() {
+        // Popen destructors wait for the processes.
+        mSlots.clear();
+        if (mPoller >= 0)
+            ::close(mPoller);
+    }
+
+    ProcessSet::Id ProcessSet::add(Popen&& popen) {
+        // polling it would reap any child
+        if (popen.pid == 0 && popen.returncode == kBadReturnCode)
+            throw std::invalid_argument("ProcessSet::add: no process");
+        Id id;
+        if (!mFree.empty()) {
+            id = mFree.back();
+            mFree.pop_back();
+        } else {
+            id = mSlots.size();
+            mSlots.emplace_back();
+        }
+        Slot& slot  = mSlots[id];
+        slot.popen  = std::move(popen);
+        slot.used   = true;
+        slot.exited = false;
+        ++mSize;
+        ++mRunning;
+
+        if (slot.popen.returncode != kBadReturnCode) {
+            mReady.push_back(id);
+            return id;
+        }
+#ifdef __linux__
+        if (slot.popen.pidfd >= 0) {
+            epoll_event event = {};
+            event.events    = EPOLLIN;
+            event.data.u64  = id;
+            if (epoll_ctl(mPoller, EPOLL_CTL_ADD, slot.popen.pidfd, &event) == 0) {
+                slot.watched = true;
+                return id;
+            }
+        }
+#endif
+        mWithoutPidfd.push_back(id);
+        return id;
+    }
+
+    Popen* ProcessSet::get(Id id) {
+        if (id >= mSlots.size() || !mSlots[id].used)
+            return nullptr;
+        return &mSlots[id].popen;
+    }
+
+    Popen ProcessSet::remove(Id id) {
+        Popen* popen = get(id);
+        if (popen == nullptr)
+            throw std::invalid_argument("ProcessSet::remove: unknown id");
+        Slot& slot = mSlots[id];
+        if (!slot.exited) {
+#ifdef __linux__
+            if (slot.watched)
+                epoll_ctl(mPoller, EPOLL_CTL_DEL, popen->pidfd, nullptr);
+#endif
+            for (auto* ids : {&mReady, &mWithoutPidfd})
+                ids->erase(std::remove(ids->begin(), ids->end(), id), ids->end());
+            --mRunning;
+        }
+        Popen result = std::move(slot.popen);
+        slot.used       = false;
+        slot.watched    = false;
+        --mSize;
+        mFree.push_back(id);
+        return result;
+    }
+
+    void ProcessSet::exited(Id id, std::vector<Id>& finished) {
+        Slot& slot = mSlots[id];
+#ifdef __linux__
+        if (slot.watched)
+            epoll_ctl(mPoller, EPOLL_CTL_DEL, slot.popen.pidfd, nullptr);
+#endif
+        slot.watched    = false;
+        slot.exited     = true;
+        // it's gone, this doesn't block
+        slot.popen.wait();
+        --mRunning;
+        finished.push_back(id);
+    }
+
+    std::vector<ProcessSet::Id> ProcessSet::wait_any(double timeout) {
+        std::vector<Id> finished;
+        for (Id id : mReady)
+            exited(id, finished);
+        mReady.clear();
+        double deadline = monotonic_seconds() + timeout;
+        while (finished.empty() && mRunning > 0) {
+            double remaining = timeout < 0? -1 : std::max(0.0, deadline - monotonic_seconds());
+            // nothing tells us about their exit, check on them regularly
+            if (!mWithoutPidfd.empty() && (remaining < 0 || remaining > 0.01))
+                remaining = 0.01;
+            int ms = remaining < 0? -1 : (int)std::ceil(remaining*1000);
+#ifdef __linux__
+            epoll_event events[256];
+            int count = epoll_wait(mPoller, events, 256, ms);
+            if (count < 0 && errno != EINTR)
+                throw_os_error("epoll_wait", errno);
+            for (int i = 0; i < count; ++i)
+                exited((Id)events[i].data.u64, finished);
+#else
+            if (mWithoutPidfd.empty())
+                break;
+            sleep_seconds(ms/1000.0);
+#endif
+            for (std::size_t i = 0; i < mWithoutPidfd.size();) {
+                Id id = mWithoutPidfd[i];
+                if (mSlots[id].popen.poll()) {
+                    mWithoutPidfd[i] = mWithoutPidfd.back();
+                    mWithoutPidfd.pop_back();
+                    exited(id, finished);
+                } else {
+                    ++i;
+                }
+            }
+            if (timeout >= 0 && monotonic_seconds() >= deadline)
+                break;
+        }
+        return finished;
+    }
+
+    bool ProcessSet::wait_all(double timeout) {
+        double deadline = monotonic_seconds() + timeout;
+        while (mRunning > 0) {
+            double remaining = timeout < 0? -1 : deadline - monotonic_seconds();
+            if (timeout >= 0 && remaining <= 0)
+                return false;
+            wait_any(remaining);
+        }
+        return true;
+    }
+}
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "ProcessBuilder.hpp"
+
+namespace subprocess {
+    /** Many running processes waited on together.
+
+        Exits are collected with one kernel wait over the pidfds of all
+        members, epoll on linux. A wakeup costs in proportion to the
+        processes that exited, not to the size of the set, so it stays cheap
+        with 10k+ members. Members without a pidfd (non linux or kernels
+        before 5.3) are checked every 10ms instead.
+
+        Exited members stay in the set until remove(), their Popen has the
+        returncode.
+
+        Not thread safe, use it from a single thread. posix only.
+    */
+    class ProcessSet {
+    public:
+        typedef std::size_t Id;
+
+        ProcessSet();
+        /** Waits for the remaining processes, like their Popen would. */
+        ~ProcessSet();
+        ProcessSet(const ProcessSet&)=delete;
+        ProcessSet& operator=(const ProcessSet&)=delete;
+
+        /** Takes over popen. Ids of removed members get reused.
+
+            @throw std::invalid_argument if popen has no process, e.g. it
+                was moved from.
+        */
+        Id add(Popen&& popen);
+        /** @return the member or nullptr */
+        Popen* get(Id id);
+        /** Takes the member out of the set. */
+        Popen remove(Id id);
+
+        /** Waits until at least one more member exited.
+
+            @param timeout  seconds to wait, -1 for no limit.
+
+            @return members that exited since the last call, in batches as
+                    the kernel reports them. Empty on timeout or if nothing
+                    is running.
+        */
+        std::vector<Id> wait_any(double timeout=-1);
+        /** Waits until every member exited.
+
+            @param timeout  seconds to wait, -1 for no limit.
+
+            @return false on timeout.
+        */
+        bool wait_all(double timeout=-1);
+
+        /** @return number of members */
+        std::size_t size() const { return mSize; }
+        bool empty() const { return mSize == 0; }
+        /** @return number of members that haven't exited */
+        std::size_t running() const { return mRunning; }
+
+    private:
+        struct Slot {
+            Popen   popen;
+            bool    used    = false;
+            bool    exited  = false;
+            bool    watched = false;
+        };
+        void exited(Id id, std::vector<Id>& finished);
+
+        int                 mPoller = -1;
+        std::deque<Slot>    mSlots;
+        std::vector<Id>     mFree;
+        /** exited before being added */
+        std::vector<Id>     mReady;
+        /** running members that have no pidfd */
+        std::vector<Id>     mWithoutPidfd;
+        std::size_t         mSize       = 0;
+        std::size_t         mRunning    = 0;
+    };
+}
@@ -0,0 +1,199 @@
+#ifndef _WIN32
+#include "ProcessWatcher.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+#include <cerrno>
+#include <cmath>
+
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+using namespace subprocess::details;
+
+namespace subprocess {
+    ProcessWatcher::ProcessWatcher(ExternalLoop& loop, Popen& popen, Callbacks callbacks)
+        : mLoop(loop), mPopen(popen), mCallbacks(std::move(callbacks)) {
+        mBuffer.resize(64*1024);
+        if (mCallbacks.on_cout && mPopen.cout != kBadPipeValue) {
+            pipe_set_blocking(mPopen.cout, false);
+            mLoop.watch(mPopen.cout, false, [this] { on_output(true); });
+            mCoutWatched = true;
+        }
+        if (mCallbacks.on_cerr && mPopen.cerr != kBadPipeValue) {
+            pipe_set_blocking(mPopen.cerr, false);
+            mLoop.watch(mPopen.cerr, false, [this] { on_output(false); });
+            mCerrWatched = true;
+        }
+        mExitHandle = mPopen.exit_handle();
+        if (mExitHandle != kBadPipeValue)
+            mLoop.watch(mExitHandle, false, [this] { on_exit_ready(); });
+    }
+
+    ProcessWatcher::~ProcessWatcher() {
+        if (mCinWatched)
+            mLoop.unwatch(mPopen.cin);
+        if (mCoutWatched)
+            mLoop.unwatch(mPopen.cout);
+        if (mCerrWatched)
+            mLoop.unwatch(mPopen.cerr);
+        if (mExitHandle != kBadPipeValue)
+            mLoop.unwatch(mExitHandle);
+    }
+
+    void ProcessWatcher::write(std::string_view data) {
+        if (mPopen.cin == kBadPipeValue || data.empty())
+            return;
+        mPending.append(data);
+        if (!mCinWatched) {
+            pipe_set_blocking(mPopen.cin, false);
+            mLoop.watch(mPopen.cin, true, [this] { on_cin(); });
+            mCinWatched = true;
+        }
+    }
+
+    void ProcessWatcher::close_cin() {
+        mCloseCin = true;
+        if (mCinWatched)
+            return;
+        mPopen.close_cin();
+    }
+
+    void ProcessWatcher::on_cin() {
+        while (mPendingOffset < mPending.size()) {
+            ssize_t transferred = write_no_sigpipe(mPopen.cin, mPending.data() + mPendingOffset,
+                mPending.size() - mPendingOffset);
+            if (transferred > 0) {
+                mPendingOffset += transferred;
+                metric_add(Metric::input_bytes, transferred);
+                continue;
+            }
+            if (transferred < 0 && errno == EINTR)
+                continue;
+            if (transferred < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            // the reader is gone, nothing more will go through
+            mCloseCin = true;
+            break;
+        }
+        mPending.clear();
+        mPendingOffset = 0;
+        mLoop.unwatch(mPopen.cin);
+        mCinWatched = false;
+        if (mCloseCin)
+            mPopen.close_cin();
+    }
+
+    void ProcessWatcher::on_output(bool is_cout) {
+        PipeHandle& handle = is_cout? mPopen.cout : mPopen.cerr;
+        auto& callback = is_cout? mCallbacks.on_cout : mCallbacks.on_cerr;
+        while (true) {
+            ssize_t transferred = ::read(handle, mBuffer.data(), mBuffer.size());
+            if (transferred > 0) {
+                output_seen(mPopen);
+                metric_add(Metric::callback_bytes, transferred);
+                callback(std::string_view(mBuffer.data(), transferred));
+                continue;
+            }
+            if (transferred < 0 && errno == EINTR)
+                continue;
+            if (transferred < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            break;
+        }
+        mLoop.unwatch(handle);
+        (is_cout? mCoutWatched : mCerrWatched) = false;
+        if (trace_on())
+            trace_instant(is_cout? "cout EOF" : "cerr EOF", mPopen.pid);
+        pipe_close(handle);
+        handle = kBadPipeValue;
+        if (mExitHandle == kBadPipeValue)
+            check_exit();
+        else
+            finish();
+    }
+
+    void ProcessWatcher::on_exit_ready() {
+        mLoop.unwatch(mExitHandle);
+        mExitHandle = kBadPipeValue;
+        // the exit handle is ready, this doesn't block
+        mPopen.wait();
+        mExited = true;
+        finish();
+    }
+
+    void ProcessWatcher::check_exit() {
+        if (!mExited && mExitHandle == kBadPipeValue)
+            mExited = mPopen.poll();
+        finish();
+    }
+
+    void ProcessWatcher::finish() {
+        if (!mExited || mDone || mCoutWatched || mCerrWatched)
+            return;
+        mDone = true;
+        if (mCinWatched) {
+            mLoop.unwatch(mPopen.cin);
+            mCinWatched = false;
+        }
+        mPopen.close_cin();
+        if (mCallbacks.on_exit)
+            mCallbacks.on_exit(mPopen.returncode);
+    }
+
+#ifdef __linux__
+    EpollLoop::EpollLoop() {
+        mPoller = epoll_create1(EPOLL_CLOEXEC);
+        if (mPoller < 0)
+            throw_os_error("epoll_create1", errno);
+    }
+
+    EpollLoop::~EpollLoop() {
+        ::close(mPoller);
+    }
+
+    void EpollLoop::watch(PipeHandle handle, bool write, Callback callback) {
+        auto entry = std::make_unique<Entry>();
+        entry->handle   = handle;
+        entry->callback = std::move(callback);
+        epoll_event event = {};
+        event.events    = write? EPOLLOUT : EPOLLIN;
+        event.data.ptr  = entry.get();
+        if (epoll_ctl(mPoller, EPOLL_CTL_ADD, handle, &event) < 0)
+            throw_os_error("epoll_ctl", errno);
+        mEntries[handle] = std::move(entry);
+    }
+
+    void EpollLoop::unwatch(PipeHandle handle) {
+        auto it = mEntries.find(handle);
+        if (it == mEntries.end())
+            return;
+        epoll_ctl(mPoller, EPOLL_CTL_DEL, handle, nullptr);
+        it->second->removed = true;
+        mRemoved.push_back(std::move(it->second));
+        mEntries.erase(it);
+    }
+
+    std::size_t EpollLoop::dispatch(double timeout) {
+        int ms = timeout < 0? -1 : (int)std::ceil(timeout*1000);
+        epoll_event events[64];
+        int count = epoll_wait(mPoller, events, 64, ms);
+        if (count < 0 && errno != EINTR)
+            throw_os_error("epoll_wait", errno);
+        std::size_t called = 0;
+        for (int i = 0; i < count; ++i) {
+            Entry& entry = *static_cast<Entry*>(events[i].data.ptr);
+            // a callback before this one may have unwatched it
+            if (entry.removed)
+                continue;
+            ++called;
+            entry.callback();
+        }
+        mRemoved.clear();
+        return called;
+    }
+#endif
+}
+#endif
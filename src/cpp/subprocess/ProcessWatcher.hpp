@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "ProcessBuilder.hpp"
+
+namespace subprocess {
+    /** The part of someone else's event loop ProcessWatcher needs.
+
+        Implement it on top of your reactor (asio, libuv, your own epoll
+        loop, ...) to drive processes from it. EpollLoop is a reference
+        implementation.
+    */
+    class ExternalLoop {
+    public:
+        typedef std::function<void()> Callback;
+        virtual ~ExternalLoop(){}
+
+        /** Calls callback from the loop whenever handle is ready, for
+            writing if write is set, for reading otherwise. Level triggered:
+            as long as it stays ready it keeps being called. A handle is
+            watched at most once at a time.
+        */
+        virtual void watch(PipeHandle handle, bool write, Callback callback)=0;
+        /** Stops watching handle. Called before the handle is closed, and
+            possibly from within its own callback.
+        */
+        virtual void unwatch(PipeHandle handle)=0;
+    };
+
+    /** Drives a Popen from an ExternalLoop: cin, cout, cerr and the exit
+        handle are watched by the loop, no thread is involved.
+
+        Only pipes are handled: cout/cerr if there is a callback for them,
+        cin if write() is used. The pipes are switched to non blocking mode.
+        on_exit is called once the process exited and its watched output is
+        drained.
+
+        Without an exit handle (see Popen::exit_handle()) the exit is only
+        noticed when a pipe gets ready or check_exit() is called, call it
+        regularly then.
+
+        on_exit may destroy the watcher, on_cout/on_cerr must not. posix only.
+
+        The example uses c++20 designated initializers, with c++17 assign
+        the Callbacks members one by one.
+
+        @code
+        EpollLoop loop;
+        Popen popen = RunBuilder({"cat"}).cin(PipeOption::pipe)
+            .cout(PipeOption::pipe).popen();
+        ProcessWatcher watcher(loop, popen, {
+            .on_cout = [](std::string_view data) { ... },
+            .on_exit = [](int returncode) { ... },
+        });
+        watcher.write("hello");
+        watcher.close_cin();
+        // add loop.handle() to your loop and call loop.dispatch() when ready
+        @endcode
+    */
+    class ProcessWatcher {
+    public:
+        struct Callbacks {
+            /** called with each chunk read from cout */
+            std::function<void(std::string_view data)> on_cout;
+            /** called with each chunk read from cerr */
+            std::function<void(std::string_view data)> on_cerr;
+            /** called once with the returncode */
+            std::function<void(int returncode)>         on_exit;
+        };
+
+        /** Watches popen, which must outlive the watcher. */
+        ProcessWatcher(ExternalLoop& loop, Popen& popen, Callbacks callbacks);
+        /** Unwatches everything still watched. */
+        ~ProcessWatcher();
+        ProcessWatcher(const ProcessWatcher&)=delete;
+        ProcessWatcher& operator=(const ProcessWatcher&)=delete;
+
+        /** Queues data for cin, written as the pipe has room. */
+        void write(std::string_view data);
+        /** Closes cin once everything queued is written. */
+        void close_cin();
+        /** Checks for the exit of a process without exit handle. */
+        void check_exit();
+
+        /** @return true once on_exit was called */
+        bool done() const { return mDone; }
+
+    private:
+        void on_cin();
+        void on_output(bool is_cout);
+        void on_exit_ready();
+        /** calls on_exit if it's time, must be the last thing done */
+        void finish();
+
+        ExternalLoop&   mLoop;
+        Popen&          mPopen;
+        Callbacks       mCallbacks;
+        std::string     mPending;
+        std::size_t     mPendingOffset  = 0;
+        PipeHandle      mExitHandle     = kBadPipeValue;
+        bool            mCinWatched     = false;
+        bool            mCoutWatched    = false;
+        bool            mCerrWatched    = false;
+        bool            mCloseCin       = false;
+        bool            mExited         = false;
+        bool            mDone           = false;
+        std::vector<char> mBuffer;
+    };
+
+#ifdef __linux__
+    /** Reference ExternalLoop on an epoll set of its own.
+
+        handle() is readable whenever a watched handle is ready, so the whole
+        set fits into any other loop as one handle. Call dispatch() when it's
+        readable. Or use dispatch(timeout) as the loop itself.
+
+        linux only.
+    */
+    class EpollLoop : public ExternalLoop {
+    public:
+        EpollLoop();
+        ~EpollLoop();
+        EpollLoop(const EpollLoop&)=delete;
+        EpollLoop& operator=(const EpollLoop&)=delete;
+
+        /** @return the epoll handle to add to another loop */
+        PipeHandle handle() const { return mPoller; }
+
+        /** Calls the callbacks of ready handles.
+
+            @param timeout  seconds to wait for one to be ready, 0 to not
+                            wait, -1 for no limit.
+
+            @return number of callbacks called.
+        */
+        std::size_t dispatch(double timeout=0);
+        /** @return number of watched handles */
+        std::size_t size() const { return mEntries.size(); }
+
+        void watch(PipeHandle handle, bool write, Callback callback) override;
+        void unwatch(PipeHandle handle) override;
+
+    private:
+        struct Entry {
+            PipeHandle  handle;
+            Callback    callback;
+            bool        removed = false;
+        };
+        int mPoller = -1;
+        std::unordered_map<PipeHandle, std::unique_ptr<Entry>> mEntries;
+        /** unwatched during dispatch(), freed after it */
+        std::vector<std::unique_ptr<Entry>> mRemoved;
+    };
+#endif
+}
@@ -0,0 +1,334 @@
+#include "Trace.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "ProcessBuilder.hpp"
+
+namespace subprocess {
+    namespace details {
+        std::atomic<bool> g_trace_enabled{false};
+    }
+
+    namespace {
+        struct Event {
+            const char* name;
+            /** 'X' for a span, 'i' for an instant */
+            char        phase;
+            double      start;
+            double      duration;
+            pid_t       pid;
+            pid_t       track;
+            std::string detail;
+        };
+
+        constexpr std::size_t kChunkSize = 256;
+        /*  Only the owning thread appends. It fills an event then publishes
+            it by bumping count, readers only look at events below count.
+        */
+        struct Chunk {
+            Event                   events[kChunkSize];
+            std::atomic<std::size_t> count{0};
+            std::atomic<Chunk*>     next{nullptr};
+        };
+
+        struct ThreadBuffer {
+            explicit ThreadBuffer(unsigned tid) : tid(tid) {}
+            ~ThreadBuffer() {
+                Chunk* chunk = head.next.load();
+                while (chunk) {
+                    Chunk* next = chunk->next.load();
+                    delete chunk;
+                    chunk = next;
+                }
+            }
+            void append(Event&& event) {
+                std::size_t count = tail->count.load(std::memory_order_relaxed);
+                if (count == kChunkSize) {
+                    Chunk* chunk = new Chunk();
+                    tail->next.store(chunk, std::memory_order_release);
+                    tail    = chunk;
+                    count   = 0;
+                }
+                tail->events[count] = std::move(event);
+                tail->count.store(count+1, std::memory_order_release);
+            }
+            /** Moves the events out, only the owning thread may. */
+            void move_to(std::vector<Event>& events) {
+                for (Chunk* chunk = &head; chunk; chunk = chunk->next.load()) {
+                    std::size_t count = chunk->count.load();
+                    for (std::size_t i = 0; i < count; ++i)
+                        events.push_back(std::move(chunk->events[i]));
+                }
+            }
+
+            unsigned    tid;
+            Chunk       head;
+            Chunk*      tail = &head;
+        };
+
+        /** Events of an exited thread, without the room to append. */
+        struct RetiredEvents {
+            unsigned            tid;
+            std::vector<Event>  events;
+        };
+
+        struct Registry {
+            /** guards buffers & retired, taken once per thread and by readers */
+            std::mutex  mutex;
+            std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+            std::vector<RetiredEvents> retired;
+            unsigned    last_tid = 0;
+            /** bumped by trace_clear() so threads register again */
+            std::atomic<unsigned> generation{0};
+            /** SUBPROCESS_TRACE, written at exit */
+            std::string exit_path;
+        };
+
+        /*  Never destroyed, helper threads may still trace after static
+            destructors ran.
+        */
+        Registry& registry() {
+            static Registry* registry = new Registry();
+            return *registry;
+        }
+
+        void write_at_exit() {
+            try {
+                trace_write(registry().exit_path);
+            } catch (...) {
+            }
+        }
+
+        /** SUBPROCESS_TRACE=file records from the start and writes file at exit */
+        bool trace_from_environment() {
+            const char* path = std::getenv("SUBPROCESS_TRACE");
+            if (!path || !*path)
+                return false;
+            registry().exit_path = path;
+            details::g_trace_enabled = true;
+            std::atexit(write_at_exit);
+            return true;
+        }
+        const bool g_trace_from_environment = trace_from_environment();
+
+        /** @return where events of tid go once it exited. Hold reg.mutex. */
+        std::vector<Event>& retired_events(Registry& reg, unsigned tid) {
+            for (auto it = reg.retired.rbegin(); it != reg.retired.rend(); ++it) {
+                if (it->tid == tid)
+                    return it->events;
+            }
+            reg.retired.push_back({tid, {}});
+            return reg.retired.back().events;
+        }
+
+        struct ThreadSlot {
+            /*  The thread exits, its events move to reg.retired so the
+                buffer with its mostly empty chunk can go.
+            */
+            ~ThreadSlot() {
+                Registry& reg = registry();
+                std::lock_guard<std::mutex> lock(reg.mutex);
+                retired = true;
+                // trace_clear() already took it
+                if (!buffer || generation != reg.generation.load())
+                    return;
+                buffer->move_to(retired_events(reg, tid));
+                reg.buffers.erase(std::find_if(reg.buffers.begin(), reg.buffers.end(),
+                    [&](auto& owned) { return owned.get() == buffer; }));
+                buffer = nullptr;
+            }
+            ThreadBuffer*   buffer      = nullptr;
+            unsigned        generation  = 0;
+            unsigned        tid         = 0;
+            /** destroyed, later events of the thread go to reg.retired */
+            bool            retired     = false;
+        };
+        thread_local ThreadSlot t_slot;
+
+        void append_event(Event&& event) {
+            Registry& reg = registry();
+            unsigned generation = reg.generation.load(std::memory_order_acquire);
+            if (t_slot.retired) {
+                // thread exit destructors tracing after the slot went
+                std::lock_guard<std::mutex> lock(reg.mutex);
+                if (t_slot.tid == 0 || t_slot.generation != reg.generation.load()) {
+                    t_slot.tid          = ++reg.last_tid;
+                    t_slot.generation   = reg.generation.load();
+                }
+                retired_events(reg, t_slot.tid).push_back(std::move(event));
+                return;
+            }
+            if (!t_slot.buffer || t_slot.generation != generation) {
+                std::lock_guard<std::mutex> lock(reg.mutex);
+                auto buffer = std::make_unique<ThreadBuffer>(++reg.last_tid);
+                t_slot.buffer       = buffer.get();
+                t_slot.generation   = generation;
+                t_slot.tid          = buffer->tid;
+                reg.buffers.push_back(std::move(buffer));
+            }
+            t_slot.buffer->append(std::move(event));
+        }
+
+        void append_json_string(std::string& out, const std::string& str) {
+            out += '"';
+            for (char ch : str) {
+                if (ch == '"' || ch == '\\') {
+                    out += '\\';
+                    out += ch;
+                } else if ((unsigned char)ch < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+                    out += escaped;
+                } else {
+                    out += ch;
+                }
+            }
+            out += '"';
+        }
+
+        /*  snprintf("%.3f") is slow enough to dominate writing a big trace,
+            to_chars isn't.
+        */
+        void append_micros(std::string& out, double seconds) {
+            char buffer[32];
+            auto result = std::to_chars(buffer, buffer + sizeof(buffer), seconds*1e6,
+                std::chars_format::fixed, 3);
+            out.append(buffer, result.ptr);
+        }
+
+        long self_pid() {
+#ifdef _WIN32
+            return (long)GetCurrentProcessId();
+#else
+            return (long)getpid();
+#endif
+        }
+    }
+
+    void trace_enable(bool enable) {
+        details::g_trace_enabled = enable;
+    }
+
+    bool trace_enabled() {
+        return details::trace_on();
+    }
+
+    void trace_clear() {
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        reg.buffers.clear();
+        reg.retired.clear();
+        reg.last_tid = 0;
+        ++reg.generation;
+    }
+
+    std::string trace_json() {
+        std::string self = std::to_string(self_pid());
+        std::string out = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        out += "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " + self
+            + ", \"args\": {\"name\": \"subprocess\"}}";
+        std::set<long> tracks;
+        auto append_thread = [&](unsigned thread) {
+            out += ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " + self
+                + ", \"tid\": " + std::to_string(thread)
+                + ", \"args\": {\"name\": \"thread " + std::to_string(thread) + "\"}}";
+        };
+        auto append_json_event = [&](const Event& event, unsigned thread) {
+            // child tracks are offset so they can't clash with thread ids
+            long tid = event.track? 1000000L + event.track : (long)thread;
+            if (event.track)
+                tracks.insert(event.track);
+            out += ",\n{\"name\": ";
+            append_json_string(out, event.name);
+            out += ", \"cat\": \"subprocess\", \"ph\": \"";
+            out += event.phase;
+            out += "\", \"ts\": ";
+            append_micros(out, event.start);
+            if (event.phase == 'X') {
+                out += ", \"dur\": ";
+                append_micros(out, event.duration);
+            } else {
+                out += ", \"s\": \"t\"";
+            }
+            out += ", \"pid\": " + self + ", \"tid\": " + std::to_string(tid);
+            out += ", \"args\": {\"pid\": " + std::to_string((long)event.pid);
+            if (!event.detail.empty()) {
+                out += ", \"detail\": ";
+                append_json_string(out, event.detail);
+            }
+            out += "}}";
+        };
+        Registry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        for (auto& retired : reg.retired) {
+            append_thread(retired.tid);
+            for (const Event& event : retired.events)
+                append_json_event(event, retired.tid);
+        }
+        for (auto& buffer : reg.buffers) {
+            append_thread(buffer->tid);
+            for (Chunk* chunk = &buffer->head; chunk;
+                    chunk = chunk->next.load(std::memory_order_acquire)) {
+                std::size_t count = chunk->count.load(std::memory_order_acquire);
+                for (std::size_t i = 0; i < count; ++i)
+                    append_json_event(chunk->events[i], buffer->tid);
+            }
+        }
+        for (long track : tracks) {
+            out += ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " + self
+                + ", \"tid\": " + std::to_string(1000000L + track)
+                + ", \"args\": {\"name\": \"child " + std::to_string(track) + "\"}}";
+        }
+        out += "\n]}\n";
+        return out;
+    }
+
+    void trace_write(const std::string& path) {
+        std::string json = trace_json();
+        std::ofstream file(path, std::ios::binary);
+        file.write(json.data(), json.size());
+        file.close();
+        if (!file)
+            throw OSError("trace_write: could not write " + path);
+    }
+
+    namespace details {
+        void trace_span(const char* name, double start, double end, pid_t pid,
+            std::string detail, pid_t track
+        ) {
+            append_event({name, 'X', start, end - start, pid, track, std::move(detail)});
+        }
+
+        void trace_instant(const char* name, pid_t pid) {
+            append_event({name, 'i', monotonic_seconds(), 0, pid, 0, {}});
+        }
+
+        std::string trace_command(const CommandLine& args) {
+            std::string result;
+            for (auto& arg : args) {
+                if (!result.empty())
+                    result += ' ';
+                result += arg;
+            }
+            return result;
+        }
+
+        TraceSpan::TraceSpan(const char* name, pid_t pid) : pid(pid), mName(name) {
+            if (trace_on())
+                mStart = monotonic_seconds();
+        }
+
+        TraceSpan::~TraceSpan() {
+            if (mStart >= 0)
+                trace_span(mName, mStart, monotonic_seconds(), pid, std::move(detail));
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "basic_types.hpp"
+
+namespace subprocess {
+    /** Turns recording of process lifecycle events on or off.
+
+        While on, the library records spans for program lookup (resolve),
+        spawn, the child's lifetime up to the exit being collected
+        (process), wait() and joins of background I/O, and instants for the
+        first output byte and the EOF of cout/cerr. Each is tagged with the
+        child's pid, spawn with its command line.
+
+        Events go to a buffer of the recording thread, no lock is taken to
+        record one. Off, recording costs a relaxed atomic load.
+
+        Setting the environment variable SUBPROCESS_TRACE to a file path
+        turns it on at startup and writes the trace there at exit.
+    */
+    void trace_enable(bool enable=true);
+    /** @return true while recording */
+    bool trace_enabled();
+    /** @return everything recorded so far as trace-event JSON, loads in
+                chrome://tracing and https://ui.perfetto.dev
+    */
+    std::string trace_json();
+    /** Writes trace_json() to path.
+
+        @throw OSError if the file can't be written.
+    */
+    void trace_write(const std::string& path);
+    /** Drops everything recorded. Call while no other thread records. */
+    void trace_clear();
+
+    namespace details {
+        extern std::atomic<bool> g_trace_enabled;
+
+        inline bool trace_on() {
+            return g_trace_enabled.load(std::memory_order_relaxed);
+        }
+        /** Records a span, start & end are monotonic_seconds().
+
+            @param detail   shown as the args of the event, may be empty.
+            @param track    child pid to record it on that child's track
+                            instead of the calling thread's, 0 for none.
+        */
+        void trace_span(const char* name, double start, double end, pid_t pid,
+            std::string detail={}, pid_t track=0);
+        /** Records an instant event now. */
+        void trace_instant(const char* name, pid_t pid);
+        /** @return args joined by spaces, for the detail of an event */
+        std::string trace_command(const CommandLine& args);
+
+        /** Records a span from construction to destruction, if tracing was
+            on at construction.
+        */
+        class TraceSpan {
+        public:
+            explicit TraceSpan(const char* name, pid_t pid=0);
+            ~TraceSpan();
+            TraceSpan(const TraceSpan&)=delete;
+            TraceSpan& operator=(const TraceSpan&)=delete;
+
+            /** @return true if it's recording, worth filling in detail */
+            bool active() const { return mStart >= 0; }
+
+            pid_t       pid = 0;
+            std::string detail;
+        private:
+            const char* mName;
+            double      mStart = -1;
+        };
+    }
+}
@@ -8,9 +8,12 @@
 #include <unistd.h>
 #endif
 
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <csignal>
 
@@ -109,7 +112,14 @@ namespace subprocess {
         */
         specific,
         pipe,       ///< Redirects to a new handle created for you.
-        close       ///< Troll the child by providing a closed pipe.
+        close,      ///< Troll the child by providing a closed pipe.
+        /** cout/cerr only. Redirects to an anonymous in memory file
+            (memfd_create on linux, an unlinked temporary file on other posix)
+            so the child never blocks on a full pipe. Popen::cout/cerr is that
+            file, read it once the process exited. run() and communicate() do
+            so after exit without any reader thread. On windows same as pipe.
+        */
+        memfd
     };
 
     struct SubprocessError : std::runtime_error {
@@ -130,6 +140,45 @@ namespace subprocess {
         using OSError::OSError;
     };
 
+    /** Resources used by a child process, filled in when its exit is
+        collected from the OS (wait4/waitid on posix, GetProcessTimes on
+        windows) at no extra cost.
+    */
+    struct ProcessUsage {
+        /** seconds on cpu in user mode */
+        double      user_cpu            = 0;
+        /** seconds on cpu in the kernel */
+        double      system_cpu          = 0;
+        /** peak resident set size in bytes */
+        int64_t     max_rss             = 0;
+        /** page faults served without I/O. All faults on windows. */
+        int64_t     minor_faults        = 0;
+        /** page faults that needed I/O. 0 on windows. */
+        int64_t     major_faults        = 0;
+        /** times it gave up the cpu to wait. 0 on windows. */
+        int64_t     voluntary_switches  = 0;
+        /** times it was preempted. 0 on windows. */
+        int64_t     involuntary_switches = 0;
+
+        /** system clock at spawn, seconds since the epoch */
+        double      start_time          = 0;
+        /** system clock when the exit was collected, 0 until then. On
+            windows the exit time reported by the OS.
+        */
+        double      exit_time           = 0;
+        /** seconds from spawn until the exit was collected */
+        double      wall_time           = 0;
+        /** seconds from spawn to the first byte of cout or cerr, when the
+            library reads them: communicate(), run(), async_run(),
+            ProcessReactor and ProcessWatcher. -1 otherwise.
+        */
+        double      first_output        = -1;
+        /** monotonic_seconds() at spawn */
+        double      start_monotonic     = 0;
+        /** true once the exit was collected and the fields are filled in */
+        bool        collected           = false;
+    };
+
     struct TimeoutExpired : SubprocessError {
         using SubprocessError::SubprocessError;
         /** The command that was running */
@@ -141,6 +190,11 @@ namespace subprocess {
         std::string cout;
         /** captured stderr */
         std::string cerr;
+        /** Usage of the process. run() kills it on timeout so it's
+            complete. Popen::wait() and communicate() leave it running, only
+            the start and first_output are known then.
+        */
+        ProcessUsage usage;
     };
 
     struct CalledProcessError : SubprocessError {
@@ -158,6 +212,26 @@ namespace subprocess {
         std::string cout;
         /** stderr output if it was captured. */
         std::string cerr;
+        /** Resources the process used */
+        ProcessUsage usage;
+    };
+
+    /** A read only memory mapping of a whole file. */
+    class MappedFile {
+    public:
+        /** Maps the current contents of handle. handle may be closed after.
+
+            @throw OSError if mapping fails.
+        */
+        explicit MappedFile(PipeHandle handle);
+        ~MappedFile();
+        MappedFile(const MappedFile&)=delete;
+        MappedFile& operator=(const MappedFile&)=delete;
+
+        std::string_view view() const { return {mData, mSize}; }
+    private:
+        const char*     mData = nullptr;
+        std::size_t     mSize = 0;
     };
 
     /** Details about a completed process. */
@@ -172,6 +246,23 @@ namespace subprocess {
         std::string     cout;
         /** Captured stderr */
         std::string     cerr;
+        /** Captured stdout mapped in place of cout with PipeOption::memfd
+            and RunOptions::map_output. Shared between copies.
+        */
+        std::shared_ptr<const MappedFile> cout_map;
+        /** Same as cout_map for stderr */
+        std::shared_ptr<const MappedFile> cerr_map;
+        /** Resources the process used */
+        ProcessUsage    usage;
+
+        /** @return captured stdout without copying, valid while this lives */
+        std::string_view cout_view() const {
+            return cout_map? cout_map->view() : std::string_view(cout);
+        }
+        /** @return captured stderr without copying, valid while this lives */
+        std::string_view cerr_view() const {
+            return cerr_map? cerr_map->view() : std::string_view(cerr);
+        }
         explicit operator bool() const {
             return returncode == 0;
         }
@@ -179,5 +270,36 @@ namespace subprocess {
 
     namespace details {
         void throw_os_error(const char* function, int errno_code);
+#ifndef _WIN32
+        /** @return a pidfd for pid, or -1 if the kernel doesn't support them. */
+        int pidfd_open(pid_t pid);
+        /** Sleeps in the kernel until the process exits or seconds elapse.
+
+            The process is not reaped, follow up with waitpid().
+
+            @param pidfd    pidfd of the process or -1 if there is none.
+            @param seconds  maximum time to sleep, -1 to wait indefinitely.
+
+            @return true if the process has exited. May spuriously return
+                    false before seconds have elapsed.
+        */
+        bool wait_for_exit(pid_t pid, int pidfd, double seconds);
+        /** write() that fails with EPIPE instead of raising SIGPIPE when the
+            reader is gone.
+        */
+        ssize_t write_no_sigpipe(PipeHandle handle, const void* buffer, size_t size);
+        /** Moves up to size bytes from the pipe input to output inside the
+            kernel with splice().
+
+            @param nonblocking  fail with EAGAIN rather than wait for input.
+                                splice() waits regardless of O_NONBLOCK.
+
+            @return bytes moved, 0 at end of input, -1 with errno set. errno
+                    is EINVAL or ENOSYS if output can't be spliced to, copy
+                    through user space instead.
+        */
+        ssize_t pipe_splice(PipeHandle input, int output, size_t size,
+            bool nonblocking=false);
+#endif
     }
 }
\ No newline at end of file
@@ -1,7 +1,12 @@
 #include "environ.hpp"
 
 #include <stdlib.h>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
 #include <string>
+#include <string_view>
 
 #include "utf8_to_utf16.hpp"
 using std::to_string;
@@ -15,6 +20,11 @@ extern "C" _DCRTIMP char **environ;
 namespace subprocess {
     Environ cenv;
 
+    namespace {
+        /** bumped on every change through cenv, invalidates EnvOverlay blocks */
+        std::atomic<std::uint64_t> g_env_generation{0};
+    }
+
     EnvironSetter::EnvironSetter(const std::string& name) {
         mName = name;
     }
@@ -37,6 +47,7 @@ namespace subprocess {
         if (mName == "PATH" || mName == "Path" || mName == "path") {
             find_program_clear_cache();
         }
+        ++g_env_generation;
 #ifdef _WIN32
         // if it's empty windows deletes it.
         _putenv_s(mName.c_str(), str? str : "");
@@ -118,6 +129,109 @@ namespace subprocess {
         return env;
     }
 
+    struct EnvOverlay::State {
+        /** nullopt for unset */
+        std::map<std::string, std::optional<std::string>, std::less<>> changes;
+
+        std::mutex                      mutex;
+        std::shared_ptr<const EnvBlock> block;
+        std::uint64_t                   generation = 0;
+    };
+
+    EnvOverlay::EnvOverlay(std::initializer_list<std::pair<const std::string, std::string>> vars) {
+        for (auto& var : vars)
+            set(var.first, var.second);
+    }
+
+    EnvOverlay::State& EnvOverlay::mutate() {
+        if (!mState) {
+            mState = std::make_shared<State>();
+        } else if (mState.use_count() > 1) {
+            auto state = std::make_shared<State>();
+            state->changes = mState->changes;
+            mState = std::move(state);
+        } else {
+            mState->block = nullptr;
+        }
+        return *mState;
+    }
+
+    EnvOverlay& EnvOverlay::set(const std::string& name, const std::string& value) {
+        mutate().changes[name] = value;
+        return *this;
+    }
+
+    EnvOverlay& EnvOverlay::unset(const std::string& name) {
+        mutate().changes[name] = std::nullopt;
+        return *this;
+    }
+
+    bool EnvOverlay::empty() const {
+        return !mState || mState->changes.empty();
+    }
+
+    void EnvOverlay::apply(EnvMap& env) const {
+        if (!mState)
+            return;
+        for (auto& change : mState->changes) {
+            if (change.second)
+                env[change.first] = *change.second;
+            else
+                env.erase(change.first);
+        }
+    }
+
+    EnvMap EnvOverlay::to_map() const {
+        EnvMap env = current_env_copy();
+        apply(env);
+        return env;
+    }
+
+    std::shared_ptr<const EnvBlock> EnvOverlay::block() const {
+        if (!mState)
+            return nullptr;
+        State& state = *mState;
+        std::uint64_t generation = g_env_generation;
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (state.block && state.generation == generation)
+            return state.block;
+
+        auto block = std::make_shared<EnvBlock>();
+#ifdef _WIN32
+        block->block = create_env_block(to_map());
+#else
+        std::vector<std::size_t> offsets;
+        auto add = [&](std::string_view name, std::string_view value) {
+            offsets.push_back(block->arena.size());
+            block->arena.insert(block->arena.end(), name.begin(), name.end());
+            block->arena.push_back('=');
+            block->arena.insert(block->arena.end(), value.begin(), value.end());
+            block->arena.push_back('\0');
+        };
+        for (char** list = environ; *list; ++list) {
+            const char* equal = strchr(*list, '=');
+            if (equal == nullptr || equal == *list)
+                continue;
+            std::string_view name(*list, equal - *list);
+            if (state.changes.find(name) != state.changes.end())
+                continue;
+            add(name, equal+1);
+        }
+        for (auto& change : state.changes) {
+            if (change.second)
+                add(change.first, *change.second);
+        }
+        // arena is complete, pointers into it are stable
+        block->envp.reserve(offsets.size()+1);
+        for (std::size_t offset : offsets)
+            block->envp.push_back(&block->arena[offset]);
+        block->envp.push_back(nullptr);
+#endif
+        state.block         = block;
+        state.generation    = generation;
+        return block;
+    }
+
 #ifdef _WIN32
     std::u16string create_env_block(const EnvMap& map) {
         size_t size = 0;
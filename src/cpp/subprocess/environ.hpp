@@ -1,6 +1,11 @@
 #pragma once
 
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "basic_types.hpp"
@@ -37,6 +42,54 @@ namespace subprocess {
     /** Creates a copy of current environment variables and returns the map */
     EnvMap current_env_copy();
 
+    /** An environment flattened for handing to a new process. */
+    struct EnvBlock {
+#ifdef _WIN32
+        /** as given by create_env_block */
+        std::u16string      block;
+#else
+        /** name=value strings, envp points into it */
+        std::vector<char>   arena;
+        /** null terminated like environ */
+        std::vector<char*>  envp;
+#endif
+    };
+
+    /** The current environment with some variables set or unset.
+
+        Only the changes are stored. Copies share them along with the
+        flattened block from block(), until one of the copies is changed. So
+        putting it in RunOptions and spawning many processes with it doesn't
+        copy the environment per process.
+
+        The block is rebuilt when changed through cenv. Changes made with
+        setenv()/putenv() directly aren't noticed.
+    */
+    class EnvOverlay {
+    public:
+        EnvOverlay() {}
+        /** Sets each of vars */
+        EnvOverlay(std::initializer_list<std::pair<const std::string, std::string>> vars);
+
+        EnvOverlay& set(const std::string& name, const std::string& value);
+        EnvOverlay& unset(const std::string& name);
+
+        /** @return true if there are no changes */
+        bool empty() const;
+        /** Applies the changes to env */
+        void apply(EnvMap& env) const;
+        /** @return current_env_copy() with the changes applied */
+        EnvMap to_map() const;
+        /** @return the current environment with the changes, flattened.
+                    Cached until the changes or cenv change.
+        */
+        std::shared_ptr<const EnvBlock> block() const;
+    private:
+        struct State;
+        State& mutate();
+        std::shared_ptr<State> mState;
+    };
+
 #ifdef _WIN32
     /** Gives an environment block used in Windows APIs. Each item is null
         terminated, end of list is double null-terminated and conforms to
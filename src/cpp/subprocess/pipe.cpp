@@ -1,19 +1,38 @@
 #include "pipe.hpp"
 
+#include <algorithm>
 #include <thread>
 #include <cstring>
+#include <vector>
 
 #ifndef _WIN32
 #include <fcntl.h>
 #include <cerrno>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
+#include "IoPool.hpp"
+#include "shell_utils.hpp"
 #include "utf8_to_utf16.hpp"
 
 using namespace subprocess::details;
 
+namespace {
+    /** read without pipe_read's mapping of EAGAIN to 0 */
+    subprocess::ssize_t pipe_read_raw(subprocess::PipeHandle handle, void* buffer, size_t size) {
+#ifdef _WIN32
+        return subprocess::pipe_read(handle, buffer, size);
+#else
+        return ::read(handle, buffer, size);
+#endif
+    }
+}
+
 namespace subprocess {
     double monotonic_seconds();
     PipePair& PipePair::operator=(PipePair&& other) {
@@ -71,10 +90,9 @@ namespace subprocess {
         return available;
         #else
         int bytes_available = 0;
-        if (ioctl(pipe, FIONREAD, &bytes_available) == -1) {
-            perror("ioctl");
+        // on the read path, the caller just reads without a size hint
+        if (ioctl(pipe, FIONREAD, &bytes_available) == -1)
             return -1;
-        }
         return bytes_available;
         #endif
     }
@@ -215,6 +233,14 @@ namespace subprocess {
 
     PipePair pipe_create(bool inheritable) {
         int fd[2];
+#ifdef __linux__
+        // atomically, so a concurrent spawn can't inherit them
+        bool success =!::pipe2(fd, inheritable? 0 : O_CLOEXEC);
+        if (!success) {
+            throw_os_error("pipe2", errno);
+            return {};
+        }
+#else
         bool success =!::pipe(fd);
         if (!success) {
             throw_os_error("pipe", errno);
@@ -224,6 +250,7 @@ namespace subprocess {
             pipe_set_inheritable(fd[0], false);
             pipe_set_inheritable(fd[1], false);
         }
+#endif
         return {fd[0], fd[1]};
     }
 
@@ -247,6 +274,42 @@ namespace subprocess {
         return transferred;
     }
 
+    ssize_t details::write_no_sigpipe(PipeHandle handle, const void* buffer, size_t size) {
+        // SIGPIPE would take down the whole process for one misbehaving child
+        sigset_t pipe_set, old_set;
+        sigemptyset(&pipe_set);
+        sigaddset(&pipe_set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+        ssize_t transferred = ::write(handle, buffer, size);
+        if (transferred < 0 && errno == EPIPE) {
+            // consume the SIGPIPE we caused unless it was blocked already
+            sigset_t pending;
+            sigpending(&pending);
+            if (sigismember(&pending, SIGPIPE) && !sigismember(&old_set, SIGPIPE)) {
+                int signum;
+                sigwait(&pipe_set, &signum);
+            }
+            errno = EPIPE;
+        }
+        pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+        return transferred;
+    }
+
+    ssize_t details::pipe_splice(PipeHandle input, int output, size_t size,
+        bool nonblocking
+    ) {
+#ifdef __linux__
+        unsigned flags = SPLICE_F_MOVE | SPLICE_F_MORE;
+        if (nonblocking)
+            flags |= SPLICE_F_NONBLOCK;
+        return ::splice(input, nullptr, output, nullptr, size, flags);
+#else
+        (void)input; (void)output; (void)size; (void)nonblocking;
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+
     bool pipe_set_blocking(PipeHandle handle, bool should_block) {
         int state = fcntl(handle, F_GETFL);
         if (should_block) {
@@ -275,33 +338,174 @@ namespace subprocess {
     }
 #endif
 
-    std::string pipe_read_all(PipeHandle handle) {
+    ssize_t details::pipe_read_append(PipeHandle handle, std::string& output) {
+        constexpr std::size_t kMinRead = 64*1024;
+        std::size_t size = output.size();
+        std::size_t want = kMinRead;
+        if (output.capacity() - size < kMinRead) {
+            ssize_t available = pipe_peak_bytes(handle);
+            if (available <= (ssize_t)(output.capacity() - size)) {
+                /*  Could be the end, don't grow until data shows up. append
+                    grows geometrically so reading n bytes costs O(n).
+                */
+                char buffer[kMinRead];
+                ssize_t transferred = pipe_read_raw(handle, buffer, sizeof(buffer));
+                if (transferred > 0)
+                    output.append(buffer, transferred);
+                return transferred;
+            }
+            want = std::max<std::size_t>(kMinRead, available);
+            output.reserve(std::max(output.capacity()*2, size + want));
+        }
+        ssize_t transferred = 0;
+#ifdef __cpp_lib_string_resize_and_overwrite
+        output.resize_and_overwrite(size + want, [&](char* data, std::size_t) {
+            transferred = pipe_read_raw(handle, data + size, want);
+            return size + std::max<ssize_t>(transferred, 0);
+        });
+#else
+        output.resize(size + want);
+        transferred = pipe_read_raw(handle, &output[size], want);
+        output.resize(size + std::max<ssize_t>(transferred, 0));
+#endif
+        return transferred;
+    }
+
+    std::string pipe_read_all(PipeHandle handle, std::size_t size_hint) {
         if (handle == kBadPipeValue)
             return {};
-        constexpr int buf_size = 2048;
-        uint8_t buf[buf_size];
         std::string result;
-        while(true) {
-            ssize_t transfered = pipe_read(handle, buf, buf_size);
-            if(transfered > 0) {
-                result.insert(result.end(), &buf[0], &buf[transfered]);
-            } else {
+        result.reserve(size_hint);
+        while (details::pipe_read_append(handle, result) > 0) {
+        }
+        return result;
+    }
+
+    ssize_t pipe_forward(PipeHandle input, PipeHandle output) {
+        ssize_t total = 0;
+#ifndef _WIN32
+        while (true) {
+            ssize_t transferred = details::pipe_splice(input, output, 1024*1024);
+            if (transferred > 0) {
+                total += transferred;
+                continue;
+            }
+            if (transferred < 0 && errno == EINTR)
+                continue;
+            if (transferred < 0 && (errno == EINVAL || errno == ENOSYS))
                 break;
+            return total;
+        }
+#endif
+        std::vector<char> buffer(64*1024);
+        while (true) {
+            ssize_t transferred = pipe_read(input, &buffer[0], buffer.size());
+            if (transferred <= 0)
+                break;
+            for (ssize_t pos = 0; pos < transferred;) {
+                ssize_t written = pipe_write(output, &buffer[pos], transferred - pos);
+                if (written <= 0)
+                    return total + pos;
+                pos += written;
             }
+            total += transferred;
         }
-        return result;
+        return total;
     }
 
+#ifdef _WIN32
+    MappedFile::MappedFile(PipeHandle) {
+        throw std::domain_error("MappedFile: not supported on windows");
+    }
+    MappedFile::~MappedFile() {}
+#else
+    MappedFile::MappedFile(PipeHandle handle) {
+        struct stat info;
+        if (fstat(handle, &info) != 0)
+            throw_os_error("fstat", errno);
+        if (info.st_size == 0)
+            return;
+        void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, handle, 0);
+        if (data == MAP_FAILED)
+            throw_os_error("mmap", errno);
+        mData = static_cast<const char*>(data);
+        mSize = info.st_size;
+    }
+    MappedFile::~MappedFile() {
+        if (mData)
+            munmap(const_cast<char*>(mData), mSize);
+    }
+#endif
+
+#ifdef _WIN32
+    SharedInput::SharedInput(std::string_view data) : mSize(data.size()), mData(data) {
+    }
+    SharedInput::~SharedInput() {}
+    PipeHandle SharedInput::open() const {
+        throw std::domain_error("SharedInput::open: not supported on windows");
+    }
+#else
+    SharedInput::SharedInput(std::string_view data) : mSize(data.size()) {
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+        mHandle = memfd_create("subprocess-cin", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (mHandle < 0 && errno != ENOSYS)
+            throw_os_error("memfd_create", errno);
+        if (mHandle >= 0)
+            mPath = "/proc/self/fd/" + std::to_string(mHandle);
+#endif
+        if (mHandle < 0) {
+            std::string dir = subprocess::getenv("TMPDIR");
+            mPath = (dir.empty()? "/tmp" : dir) + "/subprocess-cin-XXXXXX";
+            mHandle = mkstemp(&mPath[0]);
+            if (mHandle < 0)
+                throw_os_error("mkstemp", errno);
+            pipe_set_inheritable(mHandle, false);
+#ifdef __linux__
+            // reopened through /proc, nothing is left behind if we crash
+            unlink(mPath.c_str());
+            mPath = "/proc/self/fd/" + std::to_string(mHandle);
+#else
+            mTemporary = true;
+#endif
+        }
+        for (std::size_t pos = 0; pos < data.size();) {
+            ssize_t transferred = ::write(mHandle, data.data() + pos, data.size() - pos);
+            if (transferred < 0 && errno == EINTR)
+                continue;
+            if (transferred < 0) {
+                int error = errno;
+                if (mTemporary)
+                    unlink(mPath.c_str());
+                ::close(mHandle);
+                throw_os_error("write", error);
+            }
+            pos += transferred;
+        }
+#ifdef F_ADD_SEALS
+        // nobody can change it under the processes reading it
+        fcntl(mHandle, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL);
+#endif
+    }
+    SharedInput::~SharedInput() {
+        if (mTemporary)
+            unlink(mPath.c_str());
+        if (mHandle != kBadPipeValue)
+            ::close(mHandle);
+    }
+    PipeHandle SharedInput::open() const {
+        // a new open file description, the offset isn't shared with others
+        int handle = ::open(mPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (handle < 0)
+            throw_os_error("open", errno);
+        return handle;
+    }
+#endif
+
     void pipe_ignore_and_close(PipeHandle handle) {
         if (handle == kBadPipeValue)
             return;
-        std::thread thread([handle]() {
-            std::vector<uint8_t> buffer(1024);
-            while(pipe_read(handle, &buffer[0], buffer.size()) >= 0){
-            }
-            pipe_close(handle);
-        });
-        thread.detach();
+        // left to run, io_pool_drain() waits for it
+        details::io_discard(handle);
     }
 
     ssize_t pipe_read_some(PipeHandle pipe, void* buffer, size_t size) {
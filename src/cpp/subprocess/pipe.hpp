@@ -46,7 +46,10 @@ namespace subprocess {
         }
     };
 
-    /** Peak into how many bytes available in pipe to read. */
+    /** Peak into how many bytes available in pipe to read.
+
+        @return -1 if it can't be told, errno is set on posix.
+    */
     ssize_t pipe_peak_bytes(PipeHandle pipe);
 
     /** Closes a pipe handle.
@@ -108,19 +111,87 @@ namespace subprocess {
     */
     bool pipe_set_blocking(PipeHandle, bool should_block);
 
-    /** Spawns a thread to read from the pipe. When no more data available
-        pipe will be closed.
+    /** Reads from the pipe in the background until no more data is
+        available, then closes it. Serviced by the I/O pool, see
+        io_pool_set_threads().
     */
     void pipe_ignore_and_close(PipeHandle handle);
 
+    /** Read only in memory file holding cin data for any number of
+        processes.
+
+        The data is copied once into a sealed memfd. Without memfd it goes
+        into a temporary file, unlinked right away on linux and otherwise
+        removed when the SharedInput is destroyed. Each process gets its own
+        read only handle to it with its own offset, so many can read it at
+        the same time with no writer threads and no further copies. Only
+        needs to outlive the creation of the processes using it.
+
+        On windows the data is kept in memory and written through a pipe.
+    */
+    class SharedInput {
+    public:
+        /** @throw OSError if the file can't be created */
+        explicit SharedInput(std::string_view data);
+        ~SharedInput();
+        SharedInput(const SharedInput&)=delete;
+        SharedInput& operator=(const SharedInput&)=delete;
+
+        std::size_t size() const { return mSize; }
+        /** @return new read only handle at the start of the data. You
+                    must pipe_close it.
+
+            @throw OSError on failure, std::domain_error on windows.
+        */
+        PipeHandle open() const;
+#ifdef _WIN32
+        std::string_view data() const { return mData; }
+#endif
+    private:
+        std::size_t     mSize = 0;
+#ifdef _WIN32
+        std::string     mData;
+#else
+        PipeHandle      mHandle = kBadPipeValue;
+        /** path open() reopens, /proc/self/fd/N for a memfd */
+        std::string     mPath;
+        bool            mTemporary = false;
+#endif
+    };
+
+    /** Copies everything from input to output until input is closed.
+
+        On linux the data is moved with splice() so it never enters user
+        space. If output can't be spliced to (e.g. opened with O_APPEND) or on
+        other platforms it is copied through a 64KB buffer.
+
+        @return number of bytes transferred.
+    */
+    ssize_t pipe_forward(PipeHandle input, PipeHandle output);
+
     /** Read contents of handle until no more data is available.
 
         If the pipe is non-blocking this will end prematurely.
 
+        @param size_hint    expected size of the data, the result is sized
+                            for it up front.
+
         @return all data read from pipe as a string object. This works fine
                 with binary data.
     */
-    std::string pipe_read_all(PipeHandle handle);
+    std::string pipe_read_all(PipeHandle handle, std::size_t size_hint=0);
+
+    namespace details {
+        /** Reads once from handle straight into the spare capacity of
+            output, appending to it.
+
+            Reads at least 64KB, more if FIONREAD reports more pending.
+            Capacity grows geometrically so reading n bytes costs O(n).
+
+            @return bytes read, 0 at the end, -1 with errno (posix) set.
+        */
+        ssize_t pipe_read_append(PipeHandle handle, std::string& output);
+    }
 
     /** Waits for the pipes to be change state.
 
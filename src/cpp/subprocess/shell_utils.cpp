@@ -13,17 +13,25 @@
 #include <wait.h>
 #endif
 #include <errno.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #endif
 
+#include <atomic>
 #include <cctype>
 #include <stdlib.h>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 #include <sstream>
 
 #include "ProcessBuilder.hpp"
+#include "Trace.hpp"
 using std::isspace;
 
 namespace subprocess {
@@ -172,14 +180,224 @@ namespace subprocess {
         return "";
     }
 
-    static std::mutex g_program_cache_mutex;
-    static std::map<std::string, std::string> g_program_cache;
+    namespace {
+        /*  Index of the programs in each PATH directory, built once by
+            listing the directories. Lookups are hash lookups with no stat()
+            calls. A snapshot is immutable once published, readers only load
+            the shared_ptr.
+        */
+        struct PathDirectories {
+            struct Directory {
+                std::string path;
+                std::filesystem::file_time_type mtime;
+                std::unordered_set<std::string> programs;
+            };
+            std::vector<Directory> directories;
+            /** monotonic time directory mtimes were last compared */
+            mutable std::atomic<double> checked_at{0};
+#ifdef __linux__
+            /** reports changes to the directories, -1 if unavailable */
+            int inotify = -1;
+            /** monotonic time inotify was last drained */
+            mutable std::atomic<double> notified_at{0};
+            ~PathDirectories() {
+                if (inotify >= 0)
+                    ::close(inotify);
+            }
+#endif
+        };
 
-    static std::string find_program_in_path(const std::string& name) {
-        // because of the cache variable is static we do this to be thread safe
-        std::unique_lock lock(g_program_cache_mutex);
+        struct PathIndex {
+            std::string path_env;
+#ifdef _WIN32
+            std::string path_ext;
+#endif
+            std::shared_ptr<const PathDirectories> directories;
+            /** name to full path, "" for names that aren't in PATH */
+            std::unordered_map<std::string, std::string> results;
+        };
+
+        /** Seconds between comparing directory mtimes when inotify isn't
+            there to tell us sooner.
+        */
+        constexpr double kRevalidateSeconds = 1;
+        /** Seconds between draining inotify. A change shows up this late at
+            most, lookups in between make no system call.
+        */
+        constexpr double kNotifySeconds = 0.01;
+
+#ifdef __cpp_lib_atomic_shared_ptr
+        std::atomic<std::shared_ptr<const PathIndex>> g_path_index;
+#else
+        /** std::atomic<std::shared_ptr> is c++20 */
+        struct AtomicPathIndex {
+            std::shared_ptr<const PathIndex> load() const {
+                return std::atomic_load(&ptr);
+            }
+            void store(std::shared_ptr<const PathIndex> index) {
+                std::atomic_store(&ptr, std::move(index));
+            }
+            std::shared_ptr<const PathIndex> ptr;
+        };
+        AtomicPathIndex g_path_index;
+#endif
+        // serializes writers only
+        std::mutex g_path_index_mutex;
+        /** results for g_path_index not published yet, guarded by
+            g_path_index_mutex
+        */
+        std::unordered_map<std::string, std::string> g_pending_results;
+
+        std::string lowercase(std::string str) {
+            for (char& ch : str)
+                ch = (char)std::tolower((unsigned char)ch);
+            return str;
+        }
+
+        std::filesystem::file_time_type directory_mtime(const std::string& path) {
+            std::error_code error;
+            auto mtime = std::filesystem::last_write_time(path, error);
+            return error? std::filesystem::file_time_type::min() : mtime;
+        }
 
-        std::map<std::string, std::string>& cache = g_program_cache;
+        std::shared_ptr<const PathDirectories> list_path(const std::string& path_env) {
+            auto index = std::make_shared<PathDirectories>();
+#ifdef __linux__
+            index->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+            for (std::string& path : split(path_env, kPathDelimiter)) {
+                if (path.empty())
+                    continue;
+                PathDirectories::Directory directory;
+                directory.path  = path;
+#ifdef __linux__
+                // before listing so nothing slips in between
+                if (index->inotify >= 0) {
+                    inotify_add_watch(index->inotify, path.c_str(), IN_CREATE | IN_DELETE
+                        | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+                }
+#endif
+                directory.mtime = directory_mtime(path);
+                std::error_code error;
+                for (std::filesystem::directory_iterator it(path, error), end;
+                        !error && it != end; it.increment(error)) {
+                    std::error_code type_error;
+                    // follows symlinks, uses d_type when it can
+                    if (!it->is_regular_file(type_error))
+                        continue;
+                    std::string name = it->path().filename().string();
+                    directory.programs.insert(kIsWin32? lowercase(name) : name);
+                }
+                index->directories.push_back(std::move(directory));
+            }
+            index->checked_at = monotonic_seconds();
+            return index;
+        }
+
+        bool has_changed(const PathDirectories& index) {
+#ifdef __linux__
+            double now = monotonic_seconds();
+            if (index.inotify >= 0 && now - index.notified_at >= kNotifySeconds) {
+                index.notified_at = now;
+                char events[4096];
+                if (::read(index.inotify, events, sizeof(events)) > 0)
+                    return true;
+            }
+#else
+            double now = monotonic_seconds();
+#endif
+            if (now - index.checked_at < kRevalidateSeconds)
+                return false;
+            index.checked_at = now;
+            for (auto& directory : index.directories) {
+                if (directory_mtime(directory.path) != directory.mtime)
+                    return true;
+            }
+            return false;
+        }
+
+        std::string search_index(const PathIndex& index, const std::string& name) {
+#ifdef _WIN32
+            std::vector<std::string> extensions = {""};
+            for (std::string& ext : split(index.path_ext.empty()? "exe" : index.path_ext, kPathDelimiter)) {
+                if (!ext.empty())
+                    extensions.push_back(ext);
+            }
+            for (auto& directory : index.directories->directories) {
+                for (std::string& ext : extensions) {
+                    if (directory.programs.count(lowercase(name + ext)))
+                        return directory.path + '/' + name + ext;
+                }
+            }
+#else
+            for (auto& directory : index.directories->directories) {
+                if (directory.programs.count(name))
+                    return directory.path + '/' + name;
+            }
+#endif
+            return "";
+        }
+
+        /*  Publishes a new index for path_env if stale is still the current
+            one, otherwise returns whatever another thread published.
+        */
+        std::shared_ptr<const PathIndex> rebuild_path_index(const std::string& path_env,
+            const std::string& path_ext, const std::shared_ptr<const PathIndex>& stale
+        ) {
+            std::unique_lock lock(g_path_index_mutex);
+            std::shared_ptr<const PathIndex> current = g_path_index.load();
+            if (current && current != stale && current->path_env == path_env)
+                return current;
+            auto index = std::make_shared<PathIndex>();
+            index->path_env     = path_env;
+#ifdef _WIN32
+            index->path_ext     = path_ext;
+#else
+            (void)path_ext;
+#endif
+            index->directories  = list_path(path_env);
+            g_pending_results.clear();
+            g_path_index.store(index);
+            return index;
+        }
+
+        /*  Results are published in batches as big as what's published
+            already, so the index is copied O(log n) times for n names and
+            each insert costs O(1) amortized. Until then a name is looked up
+            in the directories again, which is cheap too.
+        */
+        void publish_result(const std::shared_ptr<const PathIndex>& index,
+            const std::string& name, const std::string& result
+        ) {
+            std::unique_lock lock(g_path_index_mutex);
+            // don't resurrect an index that was cleared or replaced
+            if (g_path_index.load() != index)
+                return;
+            g_pending_results[name] = result;
+            if (g_pending_results.size() < index->results.size())
+                return;
+            auto updated = std::make_shared<PathIndex>(*index);
+            for (auto& pair : g_pending_results)
+                updated->results[pair.first] = std::move(pair.second);
+            g_pending_results.clear();
+            g_path_index.store(std::move(updated));
+        }
+
+        std::string search_path_uncached(const std::string& name) {
+            for(std::string test : split(getenv("PATH"), kPathDelimiter)) {
+                if(test.empty())
+                    continue;
+                test += '/';
+                test += name;
+                test = try_exe(test);
+                if(!test.empty() && is_file(test))
+                    return test;
+            }
+            return "";
+        }
+    }
+
+    static std::string find_program_in_path(const std::string& name) {
         if(name.empty())
             return "";
         if(name.size() >= 2) {
@@ -198,24 +416,27 @@ namespace subprocess {
             }
 
         }
-
-        std::map<std::string, std::string>::iterator it = cache.find(name);
-        if(it != cache.end())
-            return it->second;
+        // not a plain file name, the index can't answer for it
+        if (name.find_first_of(kIsWin32? "/\\" : "/") != std::string::npos)
+            return search_path_uncached(name);
 
         std::string path_env = getenv("PATH");
-        for(std::string test : split(path_env, kPathDelimiter)) {
-            if(test.empty())
-                continue;
-            test += '/';
-            test += name;
-            test = try_exe(test);
-            if(!test.empty() && is_file(test)) {
-                cache[name] = test;
-                return test;
-            }
-        }
-        return "";
+        std::string path_ext = kIsWin32? getenv("PATHEXT") : "";
+        std::shared_ptr<const PathIndex> index = g_path_index.load();
+        bool stale = !index || index->path_env != path_env
+            || has_changed(*index->directories);
+#ifdef _WIN32
+        stale = stale || index->path_ext != path_ext;
+#endif
+        if (stale)
+            index = rebuild_path_index(path_env, path_ext, index);
+
+        auto it = index->results.find(name);
+        if (it != index->results.end())
+            return it->second;
+        std::string result = search_index(*index, name);
+        publish_result(index, name, result);
+        return result;
     }
 
     static bool is_python3(std::string path) {
@@ -247,6 +468,9 @@ namespace subprocess {
         return false;
     }
     std::string find_program(const std::string& name) {
+        details::TraceSpan span("resolve");
+        if (span.active())
+            span.detail = name;
         if (name != "python3") {
             return find_program_in_path(name);
         }
@@ -270,8 +494,9 @@ namespace subprocess {
     }
 
     void find_program_clear_cache() {
-        std::unique_lock<std::mutex> lock(g_program_cache_mutex);
-        g_program_cache.clear();
+        std::unique_lock<std::mutex> lock(g_path_index_mutex);
+        g_pending_results.clear();
+        g_path_index.store(nullptr);
     }
     std::string escape_shell_arg(std::string arg) {
         bool needs_quote = false;
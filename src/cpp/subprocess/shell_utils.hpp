@@ -17,11 +17,12 @@ namespace subprocess {
     std::string find_program(const std::string& name);
     /** Clears cache used by find_program.
 
-        find_program uses internal cache to find executables. If you modify PATH
-        using subprocess::cenv this will be called automatically for you. If a
-        new program is added to a folder with the same name as an existing program
-        you may want to clear the cache so that the new program is found as
-        expected instead of the old program being returned.
+        find_program indexes the programs in each PATH directory and caches
+        results, including programs not found. The cache is rebuilt when PATH
+        changes or a PATH directory changes (inotify on linux, otherwise its
+        mtime is checked at most once a second). If you modify PATH using
+        subprocess::cenv this will be called automatically for you. Call it
+        to see a change that needs to be noticed sooner.
     */
     void find_program_clear_cache();
     /** Escapes the argument suitable for use on command line. */
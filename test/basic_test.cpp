@@ -1,4 +1,7 @@
 #include <cxxtest/TestSuite.h>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
 #include <thread>
 
 #include <subprocess.hpp>
@@ -7,6 +10,12 @@
 
 #include <subprocess/utf8_to_utf16.hpp>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
 using subprocess::CommandLine;
 using subprocess::CompletedProcess;
 using subprocess::PipeOption;
@@ -41,6 +50,52 @@ std::string dirname(std::string path) {
     return path.substr(0, slash_pos);
 }
 
+#if !defined(_WIN32) && defined(__cpp_impl_coroutine)
+subprocess::Task<int> wait_sleep(const char* seconds, subprocess::EventLoop& loop) {
+    auto popen = RunBuilder({"sleep", seconds}).popen();
+    co_return co_await popen.async_wait(loop);
+}
+
+subprocess::Task<void> write_and_close(subprocess::Popen& popen, std::string_view input,
+    subprocess::EventLoop& loop
+) {
+    ssize_t written = co_await subprocess::async_write(popen.cin, input, loop);
+    TS_ASSERT_EQUALS(written, (ssize_t)input.size());
+    popen.close_cin();
+}
+
+subprocess::Task<std::string> cat_through(std::string input, subprocess::EventLoop& loop) {
+    auto popen = RunBuilder({"cat"}).cin(PipeOption::pipe).cout(PipeOption::pipe).popen();
+    // more than fits in the pipes, it has to be read while it's written
+    subprocess::Task<void> writer = write_and_close(popen, input, loop);
+    writer.start();
+    std::string output;
+    char buffer[4096];
+    ssize_t transferred;
+    while ((transferred = co_await subprocess::async_read(popen.cout, buffer, sizeof(buffer), loop)) > 0)
+        output.append(buffer, transferred);
+    co_await writer;
+    co_await popen.async_wait(loop);
+    co_return output;
+}
+
+subprocess::Task<int> run_many(subprocess::EventLoop& loop) {
+    std::vector<subprocess::Task<int>> tasks;
+    for (int i = 0; i < 20; ++i) {
+        tasks.push_back(wait_sleep("0.2", loop));
+        tasks.back().start();
+    }
+    std::string big(1024*1024, 'x');
+    subprocess::Task<std::string> cat = cat_through(big, loop);
+    cat.start();
+    int total = 0;
+    for (auto& task : tasks)
+        total += co_await task;
+    TS_ASSERT_EQUALS((co_await cat).size(), big.size());
+    co_return total;
+}
+#endif
+
 std::string g_exe_dir;
 
 void prepend_this_to_path() {
@@ -242,6 +297,47 @@ public:
         TS_ASSERT_EQUALS(completed.cout, "world" EOL);
     }
 
+    void testEnvOverlay() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        subprocess::cenv["SUBPROCESS_INHERITED"] = "before";
+        subprocess::cenv["SUBPROCESS_REMOVED"] = "here";
+
+        subprocess::EnvOverlay overlay = {{"HELLO", "world"}};
+        overlay.unset("SUBPROCESS_REMOVED");
+        auto printenv = [](const subprocess::EnvOverlay& overlay, const std::string& name) {
+            return subprocess::RunBuilder({"printenv", name}).cout(PipeOption::pipe)
+                .env_overlay(overlay).run().cout;
+        };
+        TS_ASSERT_EQUALS(printenv(overlay, "HELLO"), "world" EOL);
+        TS_ASSERT_EQUALS(printenv(overlay, "SUBPROCESS_INHERITED"), "before" EOL);
+        TS_ASSERT_EQUALS(printenv(overlay, "SUBPROCESS_REMOVED"), "");
+        TS_ASSERT_EQUALS(subprocess::cenv["HELLO"].to_string(), "");
+
+        // the cached block must follow changes through cenv
+        auto block = overlay.block();
+        TS_ASSERT_EQUALS(overlay.block(), block);
+        subprocess::cenv["SUBPROCESS_INHERITED"] = "after";
+        TS_ASSERT_DIFFERS(overlay.block(), block);
+        TS_ASSERT_EQUALS(printenv(overlay, "SUBPROCESS_INHERITED"), "after" EOL);
+
+        // copies share until changed
+        subprocess::EnvOverlay copy = overlay;
+        TS_ASSERT_EQUALS(copy.block(), overlay.block());
+        copy.set("HELLO", "there");
+        TS_ASSERT_EQUALS(printenv(copy, "HELLO"), "there" EOL);
+        TS_ASSERT_EQUALS(printenv(overlay, "HELLO"), "world" EOL);
+
+        // on top of a full env
+        subprocess::EnvMap env = subprocess::current_env_copy();
+        env["SUBPROCESS_FROM_MAP"] = "map";
+        auto completed = subprocess::RunBuilder({"printenv", "SUBPROCESS_FROM_MAP"})
+            .cout(PipeOption::pipe).env(env)
+            .env_overlay({{"SUBPROCESS_FROM_MAP", "overlay"}}).run();
+        TS_ASSERT_EQUALS(completed.cout, "overlay" EOL);
+        TS_ASSERT_EQUALS(overlay.to_map()["HELLO"], "world");
+    }
+
     void testSleep() {
         subprocess::StopWatch timer;
         subprocess::sleep_seconds(1);
@@ -344,6 +440,860 @@ public:
 
     }
 
+    void testCwd() {
+        #ifdef _WIN32
+        TS_SKIP("no pwd on windows");
+        return;
+        #endif
+        std::string cwd = subprocess::getcwd();
+        auto completed = RunBuilder({"pwd"}).cwd("/")
+            .cout(PipeOption::pipe).run();
+        TS_ASSERT_EQUALS(completed.cout, "/" EOL);
+        TS_ASSERT_EQUALS(subprocess::getcwd(), cwd);
+    }
+
+    void testSpawnBackends() {
+        #ifdef _WIN32
+        TS_SKIP("spawn backends are posix only");
+        return;
+        #endif
+        using subprocess::SpawnBackend;
+        std::string dir = (std::filesystem::temp_directory_path()
+            / "subprocess_spawn_backends_test").string();
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directory(dir);
+        std::string not_executable = dir + "/not_executable.txt";
+        subprocess::PipeHandle handle = subprocess::pipe_file(not_executable.c_str(), "w");
+        subprocess::pipe_close(handle);
+        for (SpawnBackend backend : {SpawnBackend::posix_spawn,
+                SpawnBackend::vfork, SpawnBackend::clone_pidfd}) {
+            if (!subprocess::spawn_backend_available(backend))
+                continue;
+            auto completed = RunBuilder({"cat"}).spawn_backend(backend)
+                .cin("hello world").cout(PipeOption::pipe).run();
+            TS_ASSERT_EQUALS(completed.cout, "hello world");
+
+            completed = RunBuilder({"pwd"}).spawn_backend(backend).cwd("/")
+                .cout(PipeOption::pipe).run();
+            TS_ASSERT_EQUALS(completed.cout, "/" EOL);
+
+            TS_ASSERT_THROWS(RunBuilder({not_executable})
+                .spawn_backend(backend).run(), subprocess::SpawnError);
+        }
+        std::filesystem::remove_all(dir);
+    }
+
+    void testProcessReactor() {
+        #ifdef _WIN32
+        TS_SKIP("ProcessReactor is posix only");
+        return;
+        #endif
+        subprocess::ProcessReactor reactor;
+        std::vector<std::string> outputs(20);
+        int completed_count = 0;
+        for (int i = 0; i < 20; ++i) {
+            reactor.spawn({"cat"}, RunBuilder().cin("hello " + std::to_string(i))
+                .cout(PipeOption::pipe),
+                [&, i](subprocess::ProcessReactor::Id, CompletedProcess& completed) {
+                    TS_ASSERT_EQUALS(completed.returncode, 0);
+                    outputs[i] = completed.cout;
+                    ++completed_count;
+                });
+        }
+        std::stringstream stream;
+        reactor.spawn({"echo", "hello", "world"}, RunBuilder().cout(static_cast<std::ostream*>(&stream)));
+        TS_ASSERT_EQUALS(reactor.size(), 21);
+        reactor.run();
+
+        TS_ASSERT(reactor.empty());
+        TS_ASSERT_EQUALS(completed_count, 20);
+        for (int i = 0; i < 20; ++i)
+            TS_ASSERT_EQUALS(outputs[i], "hello " + std::to_string(i));
+        TS_ASSERT_EQUALS(stream.str(), "hello world\n");
+    }
+
+    void testCommunicate() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        // bigger than any pipe buffer so both ends must be serviced together
+        std::string input(4*1024*1024, 'x');
+        auto popen = RunBuilder({"cat"}).cin(PipeOption::pipe)
+            .cout(PipeOption::pipe).cerr(PipeOption::pipe).popen();
+        auto [cout, cerr] = popen.communicate(input, 30);
+        TS_ASSERT_EQUALS(cout.size(), input.size());
+        TS_ASSERT(cout == input);
+        TS_ASSERT(cerr.empty());
+        TS_ASSERT_EQUALS(popen.returncode, 0);
+
+        popen = RunBuilder({"sleep", "3"}).cout(PipeOption::pipe).popen();
+        subprocess::StopWatch timer;
+        TS_ASSERT_THROWS(popen.communicate({}, 0.5), subprocess::TimeoutExpired);
+        TS_ASSERT_DELTA(timer.seconds(), 0.5, 0.25);
+        popen.kill();
+        popen.close();
+    }
+
+    void testRunTimeoutCoversOutput() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        // sleep holds cout open, draining it must not outlive the timeout
+        std::stringstream stream;
+        subprocess::StopWatch timer;
+        TS_ASSERT_THROWS(RunBuilder({"sleep", "3"}).timeout(0.5)
+            .cout(static_cast<std::ostream*>(&stream)).run(),
+            subprocess::TimeoutExpired);
+        TS_ASSERT_DELTA(timer.seconds(), 0.5, 0.4);
+
+        timer.start();
+        TS_ASSERT_THROWS(RunBuilder({"sleep", "3"}).timeout(0.5)
+            .timeout_escalation({{subprocess::PSIGINT, 0.1}, {subprocess::PSIGTERM, 0.1}})
+            .cout(PipeOption::pipe).run(),
+            subprocess::TimeoutExpired);
+        TS_ASSERT_DELTA(timer.seconds(), 0.5, 0.4);
+
+#ifndef _WIN32
+        // nor must a cin that has nothing to read yet
+        auto pipe = subprocess::pipe_create();
+        FILE* blocking = fdopen(pipe.input, "r");
+        pipe.disown_input();
+        timer.start();
+        TS_ASSERT_THROWS(RunBuilder({"cat"}).timeout(0.5).cin(blocking)
+            .cout(PipeOption::pipe).run(),
+            subprocess::TimeoutExpired);
+        TS_ASSERT_DELTA(timer.seconds(), 0.5, 0.4);
+
+        struct PipeBuf : std::streambuf {
+            subprocess::PipeHandle input;
+            char buffer[16];
+            int_type underflow() override {
+                ssize_t transferred = ::read(input, buffer, sizeof(buffer));
+                if (transferred <= 0)
+                    return traits_type::eof();
+                setg(buffer, buffer, buffer + transferred);
+                return traits_type::to_int_type(buffer[0]);
+            }
+        };
+        // the abandoned helper reads it until its pipe closes
+        auto stream_pipe = subprocess::pipe_create();
+        static PipeBuf pipe_buf;
+        static std::istream pipe_stream(&pipe_buf);
+        pipe_buf.input = stream_pipe.input;
+        stream_pipe.disown_input();
+        timer.start();
+        TS_ASSERT_THROWS(RunBuilder({"cat"}).timeout(0.5)
+            .cin(static_cast<std::istream*>(&pipe_stream))
+            .cout(PipeOption::pipe).run(),
+            subprocess::TimeoutExpired);
+        TS_ASSERT_DELTA(timer.seconds(), 0.5, 0.4);
+        stream_pipe.close_output();
+
+        subprocess::pipe_write(pipe.output, "late", 4);
+        pipe.close_output();
+        auto streamed = RunBuilder({"cat"}).timeout(5).cin(blocking)
+            .cout(PipeOption::pipe).run();
+        TS_ASSERT_EQUALS(streamed.cout, "late");
+        fclose(blocking);
+#endif
+
+        auto completed = RunBuilder({"echo", "hello"}).timeout(5)
+            .cout(PipeOption::pipe).run();
+        TS_ASSERT_EQUALS(completed.cout, "hello" EOL);
+    }
+
+    void testFileOutput() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        std::string input(1024*1024, 'x');
+        auto read_file = [](FILE* file) {
+            rewind(file);
+            std::string data;
+            char buffer[4096];
+            size_t transferred;
+            while ((transferred = fread(buffer, 1, sizeof(buffer), file)) > 0)
+                data.append(buffer, transferred);
+            return data;
+        };
+
+        FILE* file = std::tmpfile();
+        TS_ASSERT(file != nullptr);
+        fputs("header ", file);
+        auto popen = RunBuilder({"cat"}).cin(input).cout(file).popen();
+        popen.close();
+        TS_ASSERT_EQUALS(read_file(file), "header " + input);
+        fclose(file);
+
+#ifndef _WIN32
+        // O_APPEND can't be spliced to, copied through user space instead
+        FILE* appending = std::tmpfile();
+        FILE* file_append = fdopen(dup(fileno(appending)), "a");
+        fcntl(fileno(file_append), F_SETFL, O_APPEND);
+        RunBuilder({"cat"}).cin(input).cout(file_append).run();
+        fflush(file_append);
+        TS_ASSERT_EQUALS(read_file(appending), input);
+        fclose(file_append);
+        fclose(appending);
+#endif
+    }
+
+    void testMemfdCapture() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        auto completed = RunBuilder({"echo", "hello", "world"})
+            .cout(PipeOption::memfd).run();
+        TS_ASSERT_EQUALS(completed.cout, "hello world" EOL);
+        TS_ASSERT_EQUALS(completed.cout_view(), "hello world" EOL);
+
+        // far more than a pipe holds, cat never blocks writing it
+        std::string input(4*1024*1024, 'x');
+        completed = RunBuilder({"cat"}).cin(input).cout(PipeOption::memfd)
+            .cerr(PipeOption::memfd).map_output(true).run();
+        TS_ASSERT(completed.cout.empty());
+        TS_ASSERT_EQUALS(completed.cout_view().size(), input.size());
+        TS_ASSERT(completed.cout_view() == input);
+        TS_ASSERT(completed.cerr_view().empty());
+        CompletedProcess copy = completed;
+        completed = {};
+        TS_ASSERT(copy.cout_view() == input);
+    }
+
+    void testBorrowedInput() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        std::string data(1024*1024, 'x');
+        std::string_view view(data);
+
+        auto completed = RunBuilder({"cat"}).cin(view).cout(PipeOption::pipe).run();
+        TS_ASSERT(completed.cout == data);
+
+#if __cplusplus >= 202002L
+        std::span<const std::byte> bytes(reinterpret_cast<const std::byte*>(data.data()), 5);
+        auto popen = RunBuilder({"cat"}).cin(bytes).cout(PipeOption::pipe).popen();
+        TS_ASSERT_EQUALS(subprocess::pipe_read_all(popen.cout), "xxxxx");
+        popen.close();
+#endif
+
+        // one copy of the data feeding many children at once
+        subprocess::SharedInput shared(data);
+        TS_ASSERT_EQUALS(shared.size(), data.size());
+        std::vector<subprocess::Popen> children;
+        for (int i = 0; i < 4; ++i) {
+            children.push_back(RunBuilder({"cat"}).cin(&shared)
+                .cout(PipeOption::pipe).popen());
+        }
+        for (auto& child : children) {
+            TS_ASSERT(subprocess::pipe_read_all(child.cout) == data);
+            child.close();
+        }
+        completed = RunBuilder({"cat"}).cin(&shared).cout(PipeOption::pipe).run();
+        TS_ASSERT(completed.cout == data);
+    }
+
+    void testReadAll() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        std::string data(3*1024*1024 + 17, 'x');
+        for (std::size_t hint : {(std::size_t)0, (std::size_t)100, data.size()}) {
+            subprocess::PipePair pipe = subprocess::pipe_create();
+            std::thread writer([&] {
+                subprocess::pipe_write(pipe.output, data.data(), data.size());
+                pipe.close_output();
+            });
+            std::string result = subprocess::pipe_read_all(pipe.input, hint);
+            writer.join();
+            TS_ASSERT_EQUALS(result.size(), data.size());
+        }
+
+        auto completed = RunBuilder({"cat"}).cin(data).cout(PipeOption::pipe)
+            .expected_output_size(data.size()).run();
+        TS_ASSERT(completed.cout == data);
+    }
+
+    void testFindProgramCache() {
+#ifdef _WIN32
+        TS_SKIP("posix file names only");
+#else
+        subprocess::EnvGuard guard;
+        std::string dir = subprocess::getcwd() + "/find_program_cache_test";
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directory(dir);
+        subprocess::cenv["PATH"] = dir + subprocess::kPathDelimiter
+            + subprocess::cenv["PATH"].to_string();
+
+        std::string tool = "subprocess-find-program-test-tool";
+        TS_ASSERT_EQUALS(subprocess::find_program(tool), "");
+        // the miss is cached, but must not outlive the program appearing
+        TS_ASSERT_EQUALS(subprocess::find_program(tool), "");
+        std::ofstream(dir + "/" + tool) << "#!/bin/sh\n";
+        subprocess::StopWatch timer;
+        while (subprocess::find_program(tool).empty() && timer.seconds() < 3)
+            subprocess::sleep_seconds(0.01);
+        TS_ASSERT_EQUALS(subprocess::find_program(tool), dir + "/" + tool);
+
+        std::filesystem::remove(dir + "/" + tool);
+        timer.start();
+        while (!subprocess::find_program(tool).empty() && timer.seconds() < 3)
+            subprocess::sleep_seconds(0.01);
+        TS_ASSERT_EQUALS(subprocess::find_program(tool), "");
+
+        // results are published in batches, all of them must stay right
+        for (int round = 0; round < 2; ++round) {
+            for (int i = 0; i < 100; ++i)
+                TS_ASSERT_EQUALS(subprocess::find_program(tool + std::to_string(i)), "");
+            TS_ASSERT(!subprocess::find_program("echo").empty());
+        }
+        std::filesystem::remove_all(dir);
+#endif
+    }
+
+    void testSpawnTemplate() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        subprocess::ProcessBuilder builder;
+        builder.cout_option = PipeOption::pipe;
+        subprocess::SpawnTemplate spawner(builder, {"echo", "hello",
+            subprocess::SpawnTemplate::kPlaceholder});
+        TS_ASSERT_EQUALS(spawner.placeholder_count(), 1u);
+        TS_ASSERT_EQUALS(spawner.program(), subprocess::find_program("echo"));
+
+        auto echo = [&](const std::vector<std::string>& args) {
+            subprocess::Popen popen = spawner.spawn(args);
+            std::string output = subprocess::pipe_read_all(popen.cout);
+            TS_ASSERT_EQUALS(popen.wait(), 0);
+            return output;
+        };
+        TS_ASSERT_EQUALS(echo({"world"}), "hello world" EOL);
+        TS_ASSERT_EQUALS(echo({"there"}), "hello there" EOL);
+        // without args the placeholder is passed as is
+        TS_ASSERT_EQUALS(echo({}), "hello {}" EOL);
+        TS_ASSERT_THROWS(spawner.spawn({"a", "b"}), std::invalid_argument);
+
+        std::vector<std::thread> threads;
+        std::atomic<int> matched{0};
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&, i] {
+                for (int n = 0; n < 5; ++n) {
+                    std::string word = std::to_string(i*10 + n);
+                    if (echo({word}) == "hello " + word + EOL)
+                        ++matched;
+                }
+            });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        TS_ASSERT_EQUALS(matched.load(), 20);
+
+        TS_ASSERT_THROWS(subprocess::SpawnTemplate(builder,
+            {"subprocess-no-such-program"}), subprocess::CommandNotFoundError);
+    }
+
+    void testReaper() {
+#ifdef _WIN32
+        TS_SKIP("linux only");
+#else
+        if (!subprocess::reaper_start())
+            TS_SKIP("needs linux 5.4+");
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        TS_ASSERT(subprocess::reaper_running());
+
+        auto popen = RunBuilder({"sleep", "0.2"}).popen();
+        TS_ASSERT(!popen.poll());
+        TS_ASSERT_THROWS(popen.wait(0.05), subprocess::TimeoutExpired);
+        TS_ASSERT_EQUALS(popen.wait(5), 0);
+        TS_ASSERT(popen.poll());
+
+        // sleep with no arguments exits with 1
+        TS_ASSERT_EQUALS(RunBuilder({"sleep"}).popen().wait(), 1);
+        popen = RunBuilder({"sleep", "10"}).popen();
+        popen.kill();
+        TS_ASSERT_EQUALS(popen.wait(), -subprocess::PSIGKILL);
+
+        // an exit the reaper collected is taken in, nothing is signalled
+        popen = RunBuilder({"sleep", "0"}).popen();
+        subprocess::sleep_seconds(0.3);
+        TS_ASSERT(!popen.kill());
+        TS_ASSERT_EQUALS(popen.returncode, 0);
+
+        // close doesn't block, the reaper collects it later
+        subprocess::StopWatch timer;
+        popen = RunBuilder({"sleep", "0.5"}).popen();
+        popen.close();
+        TS_ASSERT_LESS_THAN(timer.seconds(), 0.4);
+
+        // still running processes are handed back when it stops
+        popen = RunBuilder({"sleep", "0.2"}).popen();
+        subprocess::reaper_stop();
+        TS_ASSERT(!subprocess::reaper_running());
+        TS_ASSERT_EQUALS(popen.wait(5), 0);
+#endif
+    }
+
+    void testProcessSet() {
+#ifdef _WIN32
+        TS_SKIP("posix only");
+#else
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        subprocess::ProcessSet set;
+        auto slow   = set.add(RunBuilder({"sleep", "0.5"}).popen());
+        auto medium = set.add(RunBuilder({"sleep", "0.2"}).popen());
+        // sleep with no arguments exits with 1 right away
+        auto fast   = set.add(RunBuilder({"sleep"}).popen());
+        TS_ASSERT_EQUALS(set.size(), 3u);
+        TS_ASSERT_EQUALS(set.running(), 3u);
+
+        std::vector<subprocess::ProcessSet::Id> finished = set.wait_any(5);
+        TS_ASSERT_EQUALS(finished, std::vector<subprocess::ProcessSet::Id>{fast});
+        TS_ASSERT_EQUALS(set.get(fast)->returncode, 1);
+        TS_ASSERT_EQUALS(set.wait_any(0.05).size(), 0u);
+
+        finished = set.wait_any(5);
+        TS_ASSERT_EQUALS(finished, std::vector<subprocess::ProcessSet::Id>{medium});
+        TS_ASSERT(set.wait_all(5));
+        TS_ASSERT_EQUALS(set.running(), 0u);
+        TS_ASSERT_EQUALS(set.get(slow)->returncode, 0);
+        TS_ASSERT(set.wait_any(0.05).empty());
+
+        subprocess::Popen popen = set.remove(fast);
+        TS_ASSERT_EQUALS(popen.returncode, 1);
+        TS_ASSERT(set.get(fast) == nullptr);
+        TS_ASSERT_EQUALS(set.size(), 2u);
+
+        auto killed = set.add(RunBuilder({"sleep", "10"}).popen());
+        TS_ASSERT_EQUALS(killed, fast);
+        TS_ASSERT(!set.wait_all(0.1));
+        set.get(killed)->kill();
+        TS_ASSERT(set.wait_all(5));
+        TS_ASSERT_EQUALS(set.get(killed)->returncode, -subprocess::PSIGKILL);
+
+        // nothing to wait for, polling it would reap any child
+        subprocess::Popen empty;
+        TS_ASSERT_THROWS(set.add(std::move(empty)), std::invalid_argument);
+        auto moved = set.add(std::move(popen));
+        TS_ASSERT_THROWS(set.add(std::move(popen)), std::invalid_argument);
+        TS_ASSERT_EQUALS(set.size(), 4u);
+        TS_ASSERT_EQUALS(set.get(moved)->returncode, 1);
+#endif
+    }
+
+    void testProcessPool() {
+#ifdef _WIN32
+        TS_SKIP("posix only");
+#else
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        for (bool ordered : {false, true}) {
+            subprocess::ProcessPool pool(2, ordered);
+            pool.submit(RunBuilder({"sleep", "0.4"}));
+            pool.submit(RunBuilder({"echo", "hello"}).cout(PipeOption::pipe));
+            pool.submit(RunBuilder({"sleep", "0.1"}));
+            pool.submit(CommandLine{"sleep", "0"});
+            TS_ASSERT_EQUALS(pool.queued(), 4u);
+
+            std::vector<std::size_t> jobs;
+            for (auto it = pool.begin(); it != pool.end(); ++it) {
+                TS_ASSERT_LESS_THAN_EQUALS(pool.running(), 2u);
+                TS_ASSERT_EQUALS(it->returncode, 0);
+                if (it.job() == 1) {
+                    TS_ASSERT_EQUALS(it->cout, "hello" EOL);
+                }
+                jobs.push_back(it.job());
+            }
+            std::vector<std::size_t> expected = {1, 2, 3, 0};
+            if (ordered)
+                expected = {0, 1, 2, 3};
+            TS_ASSERT_EQUALS(jobs, expected);
+        }
+
+        // failures come out in their turn, the rest still runs
+        subprocess::ProcessPool pool(4);
+        // sleep with no arguments exits with 1
+        pool.submit(RunBuilder({"sleep"}).check(true));
+        pool.submit(RunBuilder({"subprocess-no-such-program"}));
+        pool.submit(RunBuilder({"sleep", "0.1"}));
+        subprocess::CompletedProcess completed;
+        int called_process_errors = 0;
+        int not_found_errors = 0;
+        int succeeded = 0;
+        while (true) {
+            try {
+                if (!pool.next(completed))
+                    break;
+                ++succeeded;
+            } catch (subprocess::CalledProcessError& error) {
+                TS_ASSERT_EQUALS(error.returncode, 1);
+                ++called_process_errors;
+            } catch (subprocess::CommandNotFoundError&) {
+                ++not_found_errors;
+            }
+        }
+        TS_ASSERT_EQUALS(called_process_errors, 1);
+        TS_ASSERT_EQUALS(not_found_errors, 1);
+        TS_ASSERT_EQUALS(succeeded, 1);
+#endif
+    }
+
+    void testEventLoop() {
+#if defined(_WIN32) || !defined(__cpp_impl_coroutine)
+        TS_SKIP("posix & c++20 only");
+#else
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        subprocess::EventLoop loop;
+
+        TS_ASSERT_EQUALS(loop.run(wait_sleep("0", loop)), 0);
+
+        // started tasks run at once, awaited one after the other
+        subprocess::StopWatch timer;
+        TS_ASSERT_EQUALS(loop.run(run_many(loop)), 0);
+        TS_ASSERT_LESS_THAN(timer.seconds(), 2.0);
+        TS_ASSERT_EQUALS(loop.waiting(), 0u);
+
+        CompletedProcess completed = loop.run(subprocess::async_run({"cat"},
+            RunBuilder().cin("some input").cout(PipeOption::pipe).options, loop));
+        TS_ASSERT_EQUALS(completed.returncode, 0);
+        TS_ASSERT_EQUALS(completed.cout, "some input");
+
+        completed = loop.run(subprocess::async_run({"echo", "to", "cerr"},
+            RunBuilder().cerr(PipeOption::memfd).env_overlay({{"USE_CERR", "1"}}).options, loop));
+        TS_ASSERT_EQUALS(completed.cerr, "to cerr" EOL);
+
+        TS_ASSERT_THROWS(loop.run(subprocess::async_run({"sleep"},
+            RunBuilder().check(true).options, loop)), subprocess::CalledProcessError);
+#endif
+    }
+
+    void testProcessWatcher() {
+#ifndef __linux__
+        TS_SKIP("linux only");
+#else
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        auto sleeper = RunBuilder({"sleep", "0.1"}).popen();
+        subprocess::PipeHandle exit_handle = sleeper.exit_handle();
+        TS_ASSERT_DIFFERS(exit_handle, subprocess::kBadPipeValue);
+        pollfd pfd = {exit_handle, POLLIN, 0};
+        TS_ASSERT_EQUALS(::poll(&pfd, 1, 5000), 1);
+        TS_ASSERT(sleeper.poll());
+        TS_ASSERT_EQUALS(sleeper.returncode, 0);
+
+        subprocess::EpollLoop loop;
+        auto popen = RunBuilder({"cat"}).cin(PipeOption::pipe)
+            .cout(PipeOption::pipe).popen();
+        std::string output;
+        int returncode = -1000;
+        std::string big(1024*1024, 'x');
+        subprocess::ProcessWatcher::Callbacks callbacks;
+        callbacks.on_cout = [&](std::string_view data) { output.append(data); };
+        callbacks.on_exit = [&](int code) { returncode = code; };
+        subprocess::ProcessWatcher watcher(loop, popen, std::move(callbacks));
+        watcher.write(big);
+        watcher.close_cin();
+        // the loop as one handle in someone else's loop
+        pollfd outer = {loop.handle(), POLLIN, 0};
+        subprocess::StopWatch timer;
+        while (!watcher.done() && timer.seconds() < 10) {
+            if (::poll(&outer, 1, 1000) > 0)
+                loop.dispatch();
+        }
+        TS_ASSERT(watcher.done());
+        TS_ASSERT_EQUALS(returncode, 0);
+        TS_ASSERT_EQUALS(output.size(), big.size());
+        TS_ASSERT_EQUALS(loop.size(), 0u);
+#endif
+    }
+
+    void testIoPool() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        subprocess::io_pool_set_threads(2);
+        TS_ASSERT_EQUALS(subprocess::io_pool_threads(), 2u);
+
+        std::string big(256*1024, 'x');
+        std::vector<std::stringstream> streams(8);
+        std::vector<subprocess::Popen> processes;
+        for (auto& stream : streams) {
+            processes.push_back(RunBuilder({"cat"}).cin(big)
+                .cout(static_cast<std::ostream*>(&stream)).popen());
+        }
+        for (auto& popen : processes)
+            TS_ASSERT_EQUALS(popen.wait(), 0);
+        for (auto& popen : processes)
+            popen.close();
+        for (auto& stream : streams)
+            TS_ASSERT_EQUALS(stream.str().size(), big.size());
+
+        // nobody joins this one, drain waits for it
+        auto popen = RunBuilder({"echo", "hello"}).cout(PipeOption::pipe).popen();
+        subprocess::pipe_ignore_and_close(popen.cout);
+        popen.cout = subprocess::kBadPipeValue;
+        subprocess::io_pool_drain();
+        TS_ASSERT_EQUALS(popen.wait(), 0);
+
+#ifndef _WIN32
+        // a FILE* that blocks mustn't hold up the pool
+        subprocess::io_pool_set_threads(1);
+        auto pipe = subprocess::pipe_create();
+        FILE* blocking = fdopen(pipe.input, "r");
+        pipe.disown_input();
+        std::stringstream output;
+        auto waiting = RunBuilder({"cat"}).cin(blocking)
+            .cout(static_cast<std::ostream*>(&output)).popen();
+        auto completed = subprocess::run({"cat"}, RunBuilder().cin("through")
+            .cout(PipeOption::pipe).timeout(5));
+        TS_ASSERT_EQUALS(completed.cout, "through");
+        subprocess::pipe_write(pipe.output, "late", 4);
+        pipe.close_output();
+        TS_ASSERT_EQUALS(waiting.wait(), 0);
+        waiting.close();
+        TS_ASSERT_EQUALS(output.str(), "late");
+        fclose(blocking);
+
+        // stream threads are joined, none is left behind
+        subprocess::io_pool_shutdown();
+        auto threads = subprocess::metrics_snapshot().helper_threads;
+        for (int i = 0; i < 4; ++i) {
+            std::stringstream input("streamed");
+            std::stringstream streamed;
+            auto popen = RunBuilder({"cat"}).cin(static_cast<std::istream*>(&input))
+                .cout(static_cast<std::ostream*>(&streamed)).popen();
+            TS_ASSERT_EQUALS(popen.wait(), 0);
+            popen.close();
+            TS_ASSERT_EQUALS(streamed.str(), "streamed");
+        }
+        subprocess::io_pool_shutdown();
+        TS_ASSERT_EQUALS(subprocess::metrics_snapshot().helper_threads, threads);
+#endif
+
+        subprocess::io_pool_set_threads(0);
+        TS_ASSERT_EQUALS(subprocess::io_pool_threads(), 1u);
+    }
+
+    void testLoadgen() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        auto completed = subprocess::run({"loadgen_child", "--stdout-bytes", "100K",
+            "--stderr-bytes", "3000", "--chunk", "1000", "--line", "80",
+            "--interleave", "--exit-code", "3"}, RunBuilder()
+            .cout(PipeOption::pipe).cerr(PipeOption::pipe).check(false));
+        TS_ASSERT_EQUALS(completed.returncode, 3);
+        TS_ASSERT_EQUALS(completed.cout.size(), 100*1024u);
+        TS_ASSERT_EQUALS(completed.cerr.size(), 3000u);
+        TS_ASSERT_EQUALS(completed.cout.substr(0, 3), "abc");
+        TS_ASSERT_EQUALS(completed.cout[79], '\n');
+        TS_ASSERT_EQUALS(completed.cerr, completed.cout.substr(0, 3000));
+
+        auto popen = RunBuilder({"loadgen_child", "--echo-frames", "--stdout-bytes", "5"})
+            .cin(PipeOption::pipe).cout(PipeOption::pipe).popen();
+        for (std::string payload : {"hello", "world!"}) {
+            std::string frame(4, '\0');
+            frame[0] = (char)payload.size();
+            frame += payload;
+            TS_ASSERT_EQUALS(subprocess::pipe_write(popen.cin, frame.data(), frame.size()),
+                (subprocess::ssize_t)frame.size());
+            std::string answer(frame.size(), '\0');
+            std::size_t got = 0;
+            while (got < answer.size()) {
+                auto transferred = subprocess::pipe_read(popen.cout, &answer[got], answer.size() - got);
+                if (transferred <= 0)
+                    break;
+                got += transferred;
+            }
+            TS_ASSERT_EQUALS(answer, frame);
+        }
+        popen.close_cin();
+        TS_ASSERT_EQUALS(subprocess::pipe_read_all(popen.cout), "abcde");
+        TS_ASSERT_EQUALS(popen.wait(), 0);
+    }
+
+    void testUsage() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        double before = subprocess::system_seconds();
+        auto completed = subprocess::run({"loadgen_child", "--stdout-bytes", "1M",
+            "--delay", "0.2"}, RunBuilder().cout(PipeOption::pipe));
+        const subprocess::ProcessUsage& usage = completed.usage;
+        TS_ASSERT(usage.collected);
+        TS_ASSERT(usage.max_rss > 0);
+        TS_ASSERT(usage.minor_faults > 0);
+#ifndef _WIN32
+        // exec and writing 1M take some, windows only counts in 15ms ticks
+        TS_ASSERT(usage.user_cpu + usage.system_cpu > 0);
+#endif
+        TS_ASSERT_DELTA(usage.start_time, before, 5);
+        TS_ASSERT(usage.exit_time >= usage.start_time + 0.1);
+        TS_ASSERT(usage.wall_time >= 0.2);
+        TS_ASSERT(usage.first_output >= 0);
+        TS_ASSERT(usage.first_output < usage.wall_time);
+
+        // reaped by wait() on its own
+        auto popen = RunBuilder({"loadgen_child", "--exit-code", "2"}).popen();
+        TS_ASSERT(!popen.usage.collected);
+        TS_ASSERT_EQUALS(popen.wait(), 2);
+        TS_ASSERT(popen.usage.collected);
+        TS_ASSERT(popen.usage.max_rss > 0);
+        TS_ASSERT_EQUALS(popen.usage.first_output, -1);
+
+        try {
+            subprocess::run({"loadgen_child", "--exit-code", "3"}, RunBuilder().check(true));
+            TS_FAIL("expected CalledProcessError");
+        } catch (subprocess::CalledProcessError& error) {
+            TS_ASSERT(error.usage.collected);
+        }
+        try {
+            subprocess::run({"loadgen_child", "--delay", "10"}, RunBuilder().timeout(0.2));
+            TS_FAIL("expected TimeoutExpired");
+        } catch (subprocess::TimeoutExpired& error) {
+            // run() killed it, so it was collected
+            TS_ASSERT(error.usage.collected);
+            TS_ASSERT(error.usage.wall_time < 5);
+        }
+    }
+
+    void testTrace() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        subprocess::trace_clear();
+        TS_ASSERT(!subprocess::trace_enabled());
+        subprocess::run({"echo", "untraced"}, RunBuilder().cout(PipeOption::pipe));
+        TS_ASSERT_EQUALS(subprocess::trace_json().find("\"ph\": \"X\""), std::string::npos);
+
+        subprocess::trace_enable();
+        auto completed = subprocess::run({"cat"}, RunBuilder().cin("hello")
+            .cout(PipeOption::pipe));
+        auto popen = RunBuilder({"echo", "traced"}).cout(PipeOption::pipe).popen();
+        std::string child = std::to_string(popen.pid);
+        popen.wait();
+        popen.close();
+        subprocess::trace_enable(false);
+        TS_ASSERT_EQUALS(completed.cout, "hello");
+        std::string json = subprocess::trace_json();
+        for (const char* name : {"\"resolve\"", "\"spawn\"", "\"process\"",
+                "\"wait\"", "\"first output\"", "\"cout EOF\""}) {
+            TSM_ASSERT(name, json.find(name) != std::string::npos);
+        }
+        TS_ASSERT(json.find("\"ph\": \"X\"") != std::string::npos);
+        TS_ASSERT(json.find("\"pid\": " + child) != std::string::npos);
+        TS_ASSERT(json.find("\"child " + child + "\"") != std::string::npos);
+
+        // events of an exited thread outlive its buffer
+        subprocess::trace_enable();
+        std::thread([] {
+            subprocess::run({"echo", "exited"}, RunBuilder().cout(PipeOption::pipe));
+        }).join();
+        subprocess::trace_enable(false);
+        json = subprocess::trace_json();
+        TS_ASSERT(json.find(" exited\"") != std::string::npos);
+        TS_ASSERT(json.find("\"pid\": " + child) != std::string::npos);
+
+        std::string path = "trace_test.json";
+        subprocess::trace_write(path);
+        std::ifstream file(path);
+        std::string written((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+        TS_ASSERT_EQUALS(written, json);
+        std::remove(path.c_str());
+
+        subprocess::trace_clear();
+        TS_ASSERT_EQUALS(subprocess::trace_json().find("\"process\""), std::string::npos);
+    }
+
+    void testMetrics() {
+        using subprocess::Histogram;
+        TS_ASSERT_EQUALS(Histogram::bucket_of(5e-6), 5u);
+        TS_ASSERT_EQUALS(Histogram::bucket_of(1e9), Histogram::kBuckets - 1);
+        for (double seconds : {20e-6, 0.0123, 3.5}) {
+            std::size_t bucket = Histogram::bucket_of(seconds);
+            TS_ASSERT(Histogram::bucket_limit(bucket) > seconds);
+            TS_ASSERT(Histogram::bucket_limit(bucket) <= seconds*1.125 + 1e-6);
+            TS_ASSERT(bucket == 0 || Histogram::bucket_limit(bucket - 1) <= seconds);
+        }
+
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        auto before = subprocess::metrics_snapshot();
+        auto completed = subprocess::run({"loadgen_child", "--stdout-bytes", "100K"},
+            RunBuilder().cin("hello").cout(PipeOption::pipe));
+        TS_ASSERT_EQUALS(completed.cout.size(), 100*1024u);
+        subprocess::run({"loadgen_child", "--exit-code", "3"});
+        TS_ASSERT_THROWS(subprocess::run({"subprocess-no-such-program"}),
+            subprocess::CommandNotFoundError);
+        // counted by a thread that is gone by the snapshot
+        std::thread([] {
+            std::stringstream stream;
+            auto popen = RunBuilder({"loadgen_child", "--stdout-bytes", "1000"})
+                .cout(static_cast<std::ostream*>(&stream)).popen();
+            popen.close();
+        }).join();
+        // counting from thread exit destructors, after the thread's own slot
+        std::thread([] {
+            struct LateCount {
+                ~LateCount() {
+                    subprocess::details::metric_add(subprocess::details::Metric::input_bytes, 7);
+                }
+            };
+            static thread_local LateCount late;
+            (void)&late;
+            subprocess::details::metric_add(subprocess::details::Metric::input_bytes, 0);
+        }).join();
+
+        auto after = subprocess::metrics_snapshot();
+        TS_ASSERT_EQUALS(after.spawned - before.spawned, 3);
+        TS_ASSERT_EQUALS(after.running - before.running, 0);
+        TS_ASSERT_EQUALS(after.failed - before.failed, 1);
+        TS_ASSERT_EQUALS(after.spawn_errors - before.spawn_errors, 1);
+        TS_ASSERT_EQUALS(after.sink_bytes.capture - before.sink_bytes.capture, 100*1024);
+        TS_ASSERT_EQUALS(after.sink_bytes.stream - before.sink_bytes.stream, 1000);
+        TS_ASSERT_EQUALS(after.sink_bytes.input - before.sink_bytes.input, 5 + 7);
+        // handed over to the CompletedProcess, no longer buffered
+        TS_ASSERT_EQUALS(after.capture_buffered, before.capture_buffered);
+        TS_ASSERT(after.helper_threads >= 1);
+
+        auto& program = after.programs["loadgen_child"];
+        auto& previous = before.programs["loadgen_child"];
+        TS_ASSERT_EQUALS(program.spawn_latency.count - previous.spawn_latency.count, 3u);
+        TS_ASSERT_EQUALS(program.run_duration.count - previous.run_duration.count, 3u);
+        TS_ASSERT(program.spawn_latency.percentile(0.5) > 0);
+        TS_ASSERT(program.run_duration.percentile(0.5) <= program.run_duration.max);
+        TS_ASSERT(program.run_duration.mean() > 0);
+
+#ifndef _WIN32
+        bool started = !subprocess::reaper_running();
+        if (!subprocess::reaper_start())
+            return;
+        before = subprocess::metrics_snapshot();
+        auto popen = RunBuilder({"loadgen_child"}).popen();
+        // exited but not collected yet
+        subprocess::StopWatch timer;
+        while (subprocess::metrics_snapshot().zombie == before.zombie && timer.seconds() < 5)
+            subprocess::sleep_seconds(0.01);
+        after = subprocess::metrics_snapshot();
+        TS_ASSERT_EQUALS(after.zombie - before.zombie, 1);
+        TS_ASSERT_EQUALS(after.running - before.running, 0);
+        TS_ASSERT(popen.poll());
+        after = subprocess::metrics_snapshot();
+        TS_ASSERT_EQUALS(after.zombie, before.zombie);
+        TS_ASSERT_EQUALS(after.programs["loadgen_child"].reap_latency.count
+            - before.programs["loadgen_child"].reap_latency.count, 1u);
+        if (started)
+            subprocess::reaper_stop();
+#endif
+    }
+
+    void testWaitTimeoutWakesOnExit() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        auto popen = RunBuilder({"sleep", "1"}).popen();
+        subprocess::StopWatch timer;
+
+        TS_ASSERT_EQUALS(popen.wait(10), 0);
+
+        double timeout = timer.seconds();
+        TS_ASSERT_DELTA(timeout, 1, 0.5);
+    }
+
     void test2ProcessConnect() {
         subprocess::EnvGuard guard;
         prepend_this_to_path();
@@ -363,6 +1313,83 @@ public:
 
     }
 
+    void testPipeline() {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        auto completed = subprocess::Pipeline()
+            .add({"echo", "hello", "world"})
+            .add({"cat"})
+            .add(RunBuilder({"cat"}).cout(PipeOption::pipe))
+            .pipe_size(1024*1024)
+            .run();
+        TS_ASSERT_EQUALS(completed.returncode, 0);
+        TS_ASSERT_EQUALS(completed.stages.size(), 3u);
+        TS_ASSERT_EQUALS(completed.cout(), "hello world" EOL);
+
+        // cin of the first stage, cerr of a middle one
+        completed = subprocess::Pipeline()
+            .add(RunBuilder({"cat"}).cin("some input"))
+            .add(RunBuilder({"echo", "to", "cerr"}).cerr(PipeOption::pipe)
+                .env_overlay({{"USE_CERR", "1"}}))
+            .add(RunBuilder({"cat"}).cout(PipeOption::pipe))
+            .run();
+        TS_ASSERT_EQUALS(completed.stages[1].cerr, "to cerr" EOL);
+        TS_ASSERT_EQUALS(completed.cout(), "");
+
+        // pipefail, sleep with no arguments exits with 1
+        completed = subprocess::Pipeline({{"sleep"}, {"cat"}}).run();
+        TS_ASSERT_EQUALS(completed.stages[0].returncode, 1);
+        TS_ASSERT_EQUALS(completed.stages[1].returncode, 0);
+        TS_ASSERT_EQUALS(completed.returncode, 1);
+        TS_ASSERT_THROWS(subprocess::Pipeline({{"echo"}, {"sleep"}})
+            .check(true).run(), subprocess::CalledProcessError);
+
+        std::vector<subprocess::Popen> processes = subprocess::Pipeline()
+            .add(RunBuilder({"cat"}).cin(PipeOption::pipe))
+            .add(RunBuilder({"cat"}).cout(PipeOption::pipe))
+            .popen();
+        subprocess::pipe_write(processes[0].cin, "direct", 6);
+        processes[0].close_cin();
+        TS_ASSERT_EQUALS(subprocess::pipe_read_all(processes[1].cout), "direct");
+        for (auto& process : processes)
+            TS_ASSERT_EQUALS(process.wait(), 0);
+    }
+
+    void testPipelineConcurrentSpawn() {
+#ifdef _WIN32
+        TS_SKIP("posix only");
+#else
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        // a sleep inheriting a pipe between stages would hold back cat's EOF
+        std::atomic<bool> stop{false};
+        std::vector<subprocess::Popen> sleepers;
+        std::thread spawner([&] {
+            while (!stop && sleepers.size() < 200)
+                sleepers.push_back(RunBuilder({"sleep", "5"}).popen());
+        });
+        subprocess::StopWatch timer;
+        for (int i = 0; i < 20; ++i) {
+            auto completed = subprocess::Pipeline()
+                .add({"echo", "hello"})
+                .add(RunBuilder({"cat"}).cout(PipeOption::pipe))
+                .run();
+            TS_ASSERT_EQUALS(completed.cout(), "hello" EOL);
+        }
+        double seconds = timer.seconds();
+        stop = true;
+        spawner.join();
+        for (auto& sleeper : sleepers) {
+            sleeper.kill();
+            sleeper.wait();
+        }
+        TS_ASSERT(!sleepers.empty());
+        TS_ASSERT_LESS_THAN(seconds, 4);
+#endif
+    }
+
     void testKill() {
         subprocess::EnvGuard guard;
         prepend_this_to_path();
@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
+
+/*  Configurable child for benchmarks and stress tests, the output is a
+    function of the flags only.
+
+    usage: loadgen_child [flags]
+
+    --stdout-bytes N    bytes to write to stdout, default 0
+    --stderr-bytes N    bytes to write to stderr, default 0
+    --chunk N           bytes per write, default 4096
+    --rate N            bytes per second over both streams, default 0 for
+                        no limit
+    --line N            every Nth byte is '\n', default 0 for no lines
+    --interleave        alternate chunks between stdout & stderr instead of
+                        all of stdout first
+    --delay SECONDS     sleep before exiting, with stdout & stderr open
+    --close-early       close stdout & stderr before the delay, so EOF
+                        comes before the exit
+    --linger SECONDS    a grandchild keeps stdout & stderr open for SECONDS
+                        after we exit. posix only.
+    --exit-code N       exit code, default 0
+    --echo-frames       before anything else answer framed requests on
+                        stdin: 4 byte little endian length then payload,
+                        each echoed back the same way on stdout. A zero
+                        length frame or EOF ends it.
+
+    Sizes take a K, M or G suffix. Byte i of a stream is 'a' + i%26 unless
+    it's a line end.
+*/
+
+enum ExitCode {
+    bad_args = 100,
+    write_failed,
+};
+
+namespace {
+    struct Options {
+        std::uint64_t   cout_bytes  = 0;
+        std::uint64_t   cerr_bytes  = 0;
+        std::uint64_t   chunk       = 4096;
+        std::uint64_t   rate        = 0;
+        std::uint64_t   line        = 0;
+        bool            interleave  = false;
+        double          delay       = 0;
+        bool            close_early = false;
+        double          linger      = 0;
+        int             exit_code   = 0;
+        bool            echo_frames = false;
+    };
+
+    std::uint64_t parse_size(const std::string& str) {
+        std::size_t end = 0;
+        std::uint64_t value = std::stoull(str, &end);
+        std::string suffix = str.substr(end);
+        if (suffix == "K" || suffix == "k")
+            value *= 1024;
+        else if (suffix == "M" || suffix == "m")
+            value *= 1024*1024;
+        else if (suffix == "G" || suffix == "g")
+            value *= 1024*1024*1024;
+        else if (!suffix.empty())
+            throw std::invalid_argument("bad size " + str);
+        return value;
+    }
+
+    Options parse_args(int argc, char** argv) {
+        Options options;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i+1 >= argc)
+                    throw std::invalid_argument(arg + " needs a value");
+                return argv[++i];
+            };
+            if (arg == "--stdout-bytes")        options.cout_bytes  = parse_size(value());
+            else if (arg == "--stderr-bytes")   options.cerr_bytes  = parse_size(value());
+            else if (arg == "--chunk")          options.chunk       = parse_size(value());
+            else if (arg == "--rate")           options.rate        = parse_size(value());
+            else if (arg == "--line")           options.line        = parse_size(value());
+            else if (arg == "--interleave")     options.interleave  = true;
+            else if (arg == "--delay")          options.delay       = std::stod(value());
+            else if (arg == "--close-early")    options.close_early = true;
+            else if (arg == "--linger")         options.linger      = std::stod(value());
+            else if (arg == "--exit-code")      options.exit_code   = std::stoi(value());
+            else if (arg == "--echo-frames")    options.echo_frames = true;
+            else
+                throw std::invalid_argument("unknown flag " + arg);
+        }
+        if (options.chunk == 0)
+            options.chunk = 1;
+        return options;
+    }
+
+    void sleep_seconds(double seconds) {
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    }
+
+    bool write_all(int fd, const char* data, std::size_t size) {
+        while (size > 0) {
+            auto transferred = write(fd, data, size);
+            if (transferred <= 0)
+                return false;
+            data += transferred;
+            size -= transferred;
+        }
+        return true;
+    }
+
+    bool read_all(int fd, char* data, std::size_t size) {
+        while (size > 0) {
+            auto transferred = read(fd, data, size);
+            if (transferred <= 0)
+                return false;
+            data += transferred;
+            size -= transferred;
+        }
+        return true;
+    }
+
+    /** @return false if writing failed */
+    bool echo_frames() {
+        std::vector<char> payload;
+        while (true) {
+            unsigned char header[4];
+            if (!read_all(0, (char*)header, sizeof(header)))
+                return true;
+            std::uint32_t size = header[0] | header[1] << 8 | header[2] << 16
+                | (std::uint32_t)header[3] << 24;
+            if (size == 0)
+                return true;
+            payload.resize(size);
+            if (!read_all(0, payload.data(), size))
+                return true;
+            if (!write_all(1, (char*)header, sizeof(header)) || !write_all(1, payload.data(), size))
+                return false;
+        }
+    }
+
+    struct Stream {
+        int             fd;
+        std::uint64_t   total;
+        std::uint64_t   written = 0;
+
+        bool done() const { return written >= total; }
+    };
+
+    /** fills chunk with the next bytes of stream */
+    void fill(std::vector<char>& chunk, const Stream& stream, std::uint64_t line) {
+        for (std::size_t i = 0; i < chunk.size(); ++i) {
+            std::uint64_t offset = stream.written + i;
+            if (line > 0 && offset % line == line-1)
+                chunk[i] = '\n';
+            else
+                chunk[i] = 'a' + offset % 26;
+        }
+    }
+
+    /** @return false if writing failed */
+    bool generate(const Options& options) {
+        Stream streams[2] = {{1, options.cout_bytes}, {2, options.cerr_bytes}};
+        std::vector<char> chunk;
+        std::uint64_t sent = 0;
+        auto start = std::chrono::steady_clock::now();
+        int current = 0;
+        while (!streams[0].done() || !streams[1].done()) {
+            if (streams[current].done())
+                current = 1 - current;
+            Stream& stream = streams[current];
+            chunk.resize((std::size_t)std::min(options.chunk, stream.total - stream.written));
+            fill(chunk, stream, options.line);
+            if (!write_all(stream.fd, chunk.data(), chunk.size()))
+                return false;
+            stream.written  += chunk.size();
+            sent            += chunk.size();
+            if (options.interleave)
+                current = 1 - current;
+            if (options.rate > 0) {
+                auto due = start + std::chrono::duration<double>((double)sent/options.rate);
+                std::this_thread::sleep_until(due);
+            }
+        }
+        return true;
+    }
+}
+
+int main(int argc, char** argv) {
+    #ifdef _WIN32
+    setmode(fileno(stdin), O_BINARY);
+    setmode(fileno(stdout), O_BINARY);
+    setmode(fileno(stderr), O_BINARY);
+    #endif
+    Options options;
+    try {
+        options = parse_args(argc, argv);
+    } catch (std::exception& error) {
+        std::cerr << "loadgen_child: " << error.what() << "\n";
+        return ExitCode::bad_args;
+    }
+
+    if (options.echo_frames && !echo_frames())
+        return ExitCode::write_failed;
+    if (!generate(options))
+        return ExitCode::write_failed;
+
+#ifndef _WIN32
+    if (options.linger > 0 && fork() == 0) {
+        sleep_seconds(options.linger);
+        _exit(0);
+    }
+#endif
+    if (options.close_early) {
+        close(1);
+        close(2);
+    }
+    if (options.delay > 0)
+        sleep_seconds(options.delay);
+    return options.exit_code;
+}
@@ -0,0 +1,1399 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/resource.h>
+#endif
+
+#include <subprocess.hpp>
+
+/*  Micro benchmarks for the library. Not part of the test suite as timings
+    depend too much on the machine.
+
+    usage: subprocess_bench [--json FILE] [name...]
+
+    With no names every benchmark is run. --json also writes every row to
+    FILE as JSON, to compare runs between releases:
+
+    {"benchmarks": [{"name": "wait_latency", "rows": [
+        {"metric": "wait() p50", "value": 153, "unit": "us"}, ...]}, ...]}
+
+    value is null for rows without a number, unit holds the text then.
+*/
+
+using subprocess::CommandLine;
+using subprocess::Popen;
+using subprocess::RunBuilder;
+
+namespace {
+    std::string dirname(std::string path) {
+        size_t slash_pos = path.size();
+        for (size_t i = 0; i < path.size(); ++i) {
+            if (path[i] == '/' || path[i] == '\\')
+                slash_pos = i;
+        }
+        return path.substr(0, slash_pos);
+    }
+
+    double cpu_seconds() {
+        return (double)std::clock() / CLOCKS_PER_SEC;
+    }
+
+    struct Stats {
+        std::vector<double> samples;
+
+        void add(double value) { samples.push_back(value); }
+        double percentile(double p) {
+            if (samples.empty())
+                return 0;
+            std::sort(samples.begin(), samples.end());
+            size_t index = (size_t)(p*(samples.size()-1) + 0.5);
+            return samples[index];
+        }
+    };
+
+    struct Row {
+        std::string metric;
+        std::string value;
+    };
+    struct Result {
+        std::string         name;
+        std::vector<Row>    rows;
+    };
+    /** rows of each benchmark run so far, the last one is running */
+    std::vector<Result> g_results;
+
+    void print_row(const std::string& name, const std::string& value) {
+        if (!g_results.empty())
+            g_results.back().rows.push_back({name, value});
+        std::cout << "  " << name;
+        for (size_t i = name.size(); i < 32; ++i)
+            std::cout << ' ';
+        std::cout << value << "\n";
+    }
+
+    void print_percentiles(const std::string& name, Stats& stats,
+        std::string (*format)(double)
+    ) {
+        print_row(name + " p50", format(stats.percentile(0.5)));
+        print_row(name + " p90", format(stats.percentile(0.9)));
+        print_row(name + " p99", format(stats.percentile(0.99)));
+        print_row(name + " max", format(stats.percentile(1)));
+    }
+
+    /** @return value of key from /proc/self/status, -1 if not available */
+    long long proc_status(const std::string& key) {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, key.size()+1, key + ":") == 0)
+                return std::stoll(line.substr(key.size()+1));
+        }
+        return -1;
+    }
+
+    /** Samples thread count & rss in the background, keeping the peak. */
+    struct PeakSampler {
+        PeakSampler() {
+            thread = std::thread([this] {
+                while (!done) {
+                    threads = std::max(threads, proc_status("Threads") - 1);
+                    rss = std::max(rss, proc_status("VmRSS"));
+                    subprocess::sleep_seconds(0.001);
+                }
+            });
+        }
+        void stop() {
+            done = true;
+            if (thread.joinable())
+                thread.join();
+        }
+        ~PeakSampler() { stop(); }
+
+        std::thread thread;
+        std::atomic<bool> done{false};
+        long long threads = -1;
+        long long rss = -1;
+    };
+
+    void raise_fd_limit() {
+#ifndef _WIN32
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+#endif
+    }
+
+    std::string micros(double seconds) {
+        return std::to_string((long long)(seconds*1e6)) + " us";
+    }
+
+    /*  Time spent on cpu by the waiting thread while the child sleeps. The
+        spin variant is what Popen::wait(timeout) used to do.
+    */
+    void bench_wait_cpu() {
+        std::cout << "wait_cpu: cpu used while waiting 1s for a child\n";
+        {
+            Popen popen = RunBuilder({"sleep", "1"}).popen();
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            while (!popen.poll())
+                subprocess::sleep_seconds(0.00001);
+            double wall = watch.seconds();
+            cpu = cpu_seconds() - cpu;
+            print_row("poll + sleep(10us)", std::to_string(cpu/wall*100) + "% cpu");
+        }
+        {
+            Popen popen = RunBuilder({"sleep", "1"}).popen();
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            popen.wait(10);
+            double wall = watch.seconds();
+            cpu = cpu_seconds() - cpu;
+            print_row("wait(timeout)", std::to_string(cpu/wall*100) + "% cpu");
+        }
+    }
+
+    /*  Cost of one poll() pass over many running children, each poll() a
+        waitpid() syscall vs a load of what the reaper published.
+    */
+    void bench_reaper() {
+#ifdef _WIN32
+        std::cout << "reaper: skipped, linux only\n";
+#else
+        constexpr int kChildren = 500;
+        std::cout << "reaper: poll() passes over " << kChildren << " running children\n";
+        raise_fd_limit();
+        for (bool reaper : {false, true}) {
+            if (reaper && !subprocess::reaper_start()) {
+                print_row("reaper", "skipped, needs linux 5.4+");
+                break;
+            }
+            std::vector<Popen> children;
+            for (int i = 0; i < kChildren; ++i)
+                children.push_back(RunBuilder({"sleep", "10"}).popen());
+            constexpr int kPasses = 200;
+            subprocess::StopWatch watch;
+            for (int pass = 0; pass < kPasses; ++pass) {
+                for (auto& child : children)
+                    child.poll();
+            }
+            double seconds = watch.seconds();
+            std::string label = reaper? "reaper" : "waitpid";
+            print_row(label + " per pass", micros(seconds/kPasses));
+            print_row(label + " polls/s", std::to_string(
+                (long long)(kPasses*kChildren/seconds)));
+
+            for (auto& child : children)
+                child.kill();
+            watch.start();
+            for (auto& child : children)
+                child.wait();
+            print_row(label + " kill+wait all", micros(watch.seconds()));
+            watch.start();
+            children.clear();
+            print_row(label + " close all", micros(watch.seconds()));
+        }
+        subprocess::reaper_stop();
+#endif
+    }
+
+    /*  Waiting for every one of many children: poll() each in turn every
+        1ms vs ProcessSet::wait_any.
+    */
+    void bench_process_set() {
+#ifdef _WIN32
+        std::cout << "process_set: skipped, posix only\n";
+#else
+        std::cout << "process_set: cpu used collecting children that each `sleep 2`\n";
+        raise_fd_limit();
+        for (int count : {100, 1000, 2000}) {
+            std::string label = std::to_string(count) + " ";
+            {
+                std::vector<Popen> children;
+                for (int i = 0; i < count; ++i)
+                    children.push_back(RunBuilder({"sleep", "2"}).popen());
+                double cpu = cpu_seconds();
+                std::size_t remaining = children.size();
+                std::vector<bool> done(children.size());
+                while (remaining > 0) {
+                    for (std::size_t i = 0; i < children.size(); ++i) {
+                        if (!done[i] && children[i].poll()) {
+                            done[i] = true;
+                            --remaining;
+                        }
+                    }
+                    subprocess::sleep_seconds(0.001);
+                }
+                print_row(label + "poll + sleep(1ms)", std::to_string(
+                    (long long)((cpu_seconds() - cpu)*1000)) + " ms cpu");
+            }
+            {
+                subprocess::ProcessSet set;
+                for (int i = 0; i < count; ++i)
+                    set.add(RunBuilder({"sleep", "2"}).popen());
+                double cpu = cpu_seconds();
+                int wakeups = 0;
+                while (set.running() > 0) {
+                    set.wait_any();
+                    ++wakeups;
+                }
+                print_row(label + "ProcessSet::wait_any", std::to_string(
+                    (long long)((cpu_seconds() - cpu)*1000)) + " ms cpu, "
+                    + std::to_string(wakeups) + " wakeups");
+            }
+        }
+#endif
+    }
+
+    /*  Time from killing the child to wait returning. Blocking wait() is
+        the floor set by the kernel tearing down the process.
+    */
+    void bench_wait_latency() {
+        std::cout << "wait_latency: kill() to wait returning\n";
+        for (double timeout : {-1.0, 20.0}) {
+            Stats stats;
+            for (int i = 0; i < 50; ++i) {
+                Popen popen = RunBuilder({"sleep", "10"}).popen();
+                double killed_at = 0;
+                std::thread killer([&] {
+                    subprocess::sleep_seconds(0.02);
+                    killed_at = subprocess::monotonic_seconds();
+                    popen.kill();
+                });
+                popen.wait(timeout);
+                double woke_at = subprocess::monotonic_seconds();
+                killer.join();
+                stats.add(woke_at - killed_at);
+            }
+            std::string name = timeout < 0? "wait()" : "wait(timeout)";
+            print_percentiles(name, stats, micros);
+        }
+    }
+
+    /*  Spawn to exit of `echo`, as seen by the parent: popen() + wait(). */
+    void bench_spawn_latency() {
+        std::cout << "spawn_latency: popen() + wait() of `echo`\n";
+        Stats stats;
+        for (int i = 0; i < 500; ++i) {
+            subprocess::StopWatch watch;
+            Popen popen = RunBuilder({"echo"})
+                .cout(subprocess::PipeOption::close).popen();
+            popen.wait();
+            stats.add(watch.seconds());
+        }
+        print_percentiles("echo", stats, micros);
+    }
+
+    /*  Spawns per second with a cwd set, from many threads at once. */
+    void bench_spawn_threads() {
+        std::cout << "spawn_threads: spawns/sec of `echo` with cwd set\n";
+        std::string cwd = subprocess::getcwd();
+        for (int thread_count : {1, 2, 4, 8, 16, 32, 64}) {
+            constexpr int kSpawnsPerThread = 50;
+            std::vector<std::thread> threads;
+            subprocess::StopWatch watch;
+            for (int i = 0; i < thread_count; ++i) {
+                threads.emplace_back([&] {
+                    for (int n = 0; n < kSpawnsPerThread; ++n) {
+                        Popen popen = RunBuilder({"echo"}).cwd(cwd)
+                            .cout(subprocess::PipeOption::close).popen();
+                        popen.wait();
+                    }
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            double rate = thread_count*kSpawnsPerThread/watch.seconds();
+            print_row(std::to_string(thread_count) + " threads",
+                std::to_string((long long)rate) + " spawns/s");
+        }
+    }
+
+    const char* backend_name(subprocess::SpawnBackend backend) {
+        using subprocess::SpawnBackend;
+        switch (backend) {
+        case SpawnBackend::automatic:   return "automatic";
+        case SpawnBackend::posix_spawn: return "posix_spawn";
+        case SpawnBackend::vfork:       return "vfork";
+        case SpawnBackend::clone_pidfd: return "clone_pidfd";
+        }
+        return "unknown";
+    }
+
+    void spawn_echo(subprocess::SpawnBackend backend) {
+        Popen popen = RunBuilder({"echo"}).spawn_backend(backend)
+            .cout(subprocess::PipeOption::close).popen();
+        popen.wait();
+    }
+
+    /*  Spawn latency per backend as the parent's resident memory grows,
+        then spawn throughput per backend across threads.
+    */
+    void bench_spawn_backends() {
+        using subprocess::SpawnBackend;
+        std::cout << "spawn_backends: spawn-to-exit latency of `echo` vs parent RSS\n";
+        const SpawnBackend backends[] = {SpawnBackend::posix_spawn,
+            SpawnBackend::vfork, SpawnBackend::clone_pidfd};
+        double max_mb = 8192;
+#ifndef _WIN32
+        // touching more than half of ram just benchmarks the swap
+        double ram_mb = (double)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE)/(1024*1024);
+        max_mb = std::min(max_mb, ram_mb/2);
+#endif
+        for (double rss_mb : {1.0, 64.0, 512.0, 2048.0, 8192.0}) {
+            if (rss_mb > max_mb) {
+                print_row(std::to_string((int)rss_mb) + " MB", "skipped, not enough ram");
+                continue;
+            }
+            std::vector<char> ballast((std::size_t)(rss_mb*1024*1024), 1);
+            for (SpawnBackend backend : backends) {
+                if (!subprocess::spawn_backend_available(backend))
+                    continue;
+                Stats stats;
+                for (int i = 0; i < 30; ++i) {
+                    subprocess::StopWatch watch;
+                    spawn_echo(backend);
+                    stats.add(watch.seconds());
+                }
+                print_row(std::to_string((int)rss_mb) + " MB " + backend_name(backend),
+                    micros(stats.percentile(0.5)) + " p50");
+            }
+        }
+
+        std::cout << "spawn_backends: spawns/sec of `echo` vs threads\n";
+        for (SpawnBackend backend : backends) {
+            if (!subprocess::spawn_backend_available(backend))
+                continue;
+            for (int thread_count : {1, 4, 16}) {
+                constexpr int kSpawnsPerThread = 50;
+                std::vector<std::thread> threads;
+                subprocess::StopWatch watch;
+                for (int i = 0; i < thread_count; ++i) {
+                    threads.emplace_back([&] {
+                        for (int n = 0; n < kSpawnsPerThread; ++n)
+                            spawn_echo(backend);
+                    });
+                }
+                for (auto& thread : threads)
+                    thread.join();
+                double rate = thread_count*kSpawnsPerThread/watch.seconds();
+                print_row(std::string(backend_name(backend)) + " "
+                    + std::to_string(thread_count) + " threads",
+                    std::to_string((long long)rate) + " spawns/s");
+            }
+        }
+    }
+
+    /*  Spawns/sec of `echo {}` through ProcessBuilder, which resolves the
+        program and flattens argv/envp every time, vs a SpawnTemplate.
+    */
+    void bench_spawn_template() {
+        std::cout << "spawn_template: spawns/sec of `echo {}`, ProcessBuilder vs SpawnTemplate\n";
+        constexpr int kSpawns = 300;
+        for (int env_size : {0, 500}) {
+            subprocess::ProcessBuilder builder;
+            builder.command     = {"echo", subprocess::SpawnTemplate::kPlaceholder};
+            builder.cout_option = subprocess::PipeOption::close;
+            if (env_size > 0) {
+                builder.env = subprocess::current_env_copy();
+                for (int i = 0; i < env_size; ++i)
+                    builder.env["SUBPROCESS_BENCH_" + std::to_string(i)] = std::string(64, 'x');
+            }
+            std::string env_label = env_size? " env+" + std::to_string(env_size) : "";
+
+            subprocess::StopWatch watch;
+            for (int i = 0; i < kSpawns; ++i) {
+                subprocess::CommandLine command = builder.command;
+                command[1] = std::to_string(i);
+                builder.run_command(command).wait();
+            }
+            print_row("ProcessBuilder" + env_label, std::to_string(
+                (long long)(kSpawns/watch.seconds())) + " spawns/s");
+
+            subprocess::SpawnTemplate spawner(builder);
+            watch.start();
+            for (int i = 0; i < kSpawns; ++i)
+                spawner.spawn({std::to_string(i)}).wait();
+            print_row("SpawnTemplate" + env_label, std::to_string(
+                (long long)(kSpawns/watch.seconds())) + " spawns/s");
+        }
+    }
+
+    /*  Spawns adding 3 variables to a 300 variable environment, with a full
+        EnvMap copy per spawn vs a shared EnvOverlay.
+    */
+    void bench_env_overlay() {
+        std::cout << "env_overlay: spawns/sec of `echo` setting 3 of 300 variables\n";
+        subprocess::EnvGuard guard;
+        for (int i = subprocess::current_env_copy().size(); i < 300; ++i)
+            subprocess::cenv["SUBPROCESS_BENCH_" + std::to_string(i)] = std::string(32, 'x');
+        constexpr int kSpawns = 300;
+
+        subprocess::StopWatch watch;
+        for (int i = 0; i < kSpawns; ++i) {
+            subprocess::EnvMap env = subprocess::current_env_copy();
+            env["JOB_ID"]       = std::to_string(i);
+            env["JOB_QUEUE"]    = "bench";
+            env["JOB_RETRY"]    = "0";
+            RunBuilder({"echo"}).cout(subprocess::PipeOption::close).env(env).popen().wait();
+        }
+        print_row("EnvMap copy", std::to_string(
+            (long long)(kSpawns/watch.seconds())) + " spawns/s");
+
+        subprocess::EnvOverlay overlay = {{"JOB_QUEUE", "bench"}, {"JOB_RETRY", "0"}};
+        watch.start();
+        for (int i = 0; i < kSpawns; ++i) {
+            RunBuilder({"echo"}).cout(subprocess::PipeOption::close)
+                .env_overlay(overlay).popen().wait();
+        }
+        print_row("EnvOverlay shared", std::to_string(
+            (long long)(kSpawns/watch.seconds())) + " spawns/s");
+
+        watch.start();
+        for (int i = 0; i < kSpawns; ++i) {
+            subprocess::EnvOverlay job = overlay;
+            job.set("JOB_ID", std::to_string(i));
+            RunBuilder({"echo"}).cout(subprocess::PipeOption::close)
+                .env_overlay(job).popen().wait();
+        }
+        print_row("EnvOverlay per job", std::to_string(
+            (long long)(kSpawns/watch.seconds())) + " spawns/s");
+
+        // just preparing the environment, no spawn
+        constexpr int kPrepares = 2000;
+        auto per_second = [&](double seconds) {
+            return std::to_string((long long)(kPrepares/seconds)) + " /s";
+        };
+        watch.start();
+        for (int i = 0; i < kPrepares; ++i) {
+            subprocess::EnvMap env = subprocess::current_env_copy();
+            env["JOB_ID"] = std::to_string(i);
+            subprocess::ProcessBuilder builder;
+            builder.env = env;
+        }
+        print_row("prepare EnvMap copy", per_second(watch.seconds()));
+        watch.start();
+        for (int i = 0; i < kPrepares; ++i) {
+            subprocess::EnvOverlay job = overlay;
+            job.set("JOB_ID", std::to_string(i));
+            (void)job.block();
+        }
+        print_row("prepare EnvOverlay per job", per_second(watch.seconds()));
+        watch.start();
+        for (int i = 0; i < kPrepares; ++i)
+            (void)overlay.block();
+        print_row("prepare EnvOverlay cached", per_second(watch.seconds()));
+    }
+
+    /*  Cost of a current_env_copy() call, with the environment as is and
+        grown to 300 variables.
+    */
+    void bench_env_copy() {
+        std::cout << "env_copy: current_env_copy() call\n";
+        subprocess::EnvGuard guard;
+        for (int target : {0, 300}) {
+            for (int i = subprocess::current_env_copy().size(); i < target; ++i)
+                subprocess::cenv["SUBPROCESS_BENCH_" + std::to_string(i)] = std::string(32, 'x');
+            std::size_t count = subprocess::current_env_copy().size();
+            Stats stats;
+            for (int i = 0; i < 2000; ++i) {
+                subprocess::StopWatch watch;
+                subprocess::EnvMap env = subprocess::current_env_copy();
+                stats.add(watch.seconds());
+            }
+            print_percentiles(std::to_string(count) + " variables", stats, micros);
+        }
+    }
+
+    /*  make -j style fan out: N threads each calling run() in turn vs a
+        ProcessPool keeping N children running from one thread.
+    */
+    void bench_pool() {
+#ifdef _WIN32
+        std::cout << "pool: skipped, posix only\n";
+#else
+        constexpr int kJobs         = 400;
+        constexpr int kConcurrency  = 16;
+        std::cout << "pool: " << kJobs << " jobs of `sleep 0.05` + `echo`, "
+            << kConcurrency << " at a time\n";
+        auto job = [](int i) {
+            if (i % 2)
+                return RunBuilder({"echo", std::to_string(i)}).cout(subprocess::PipeOption::pipe);
+            return RunBuilder({"sleep", "0.05"});
+        };
+        {
+            std::atomic<int> next{0};
+            PeakSampler sampler;
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            std::vector<std::thread> threads;
+            for (int t = 0; t < kConcurrency; ++t) {
+                threads.emplace_back([&] {
+                    for (int i = next++; i < kJobs; i = next++)
+                        job(i).run();
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            double seconds = watch.seconds();
+            sampler.stop();
+            print_row("thread pool jobs/s", std::to_string((long long)(kJobs/seconds)));
+            print_row("thread pool cpu", std::to_string(
+                (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+            print_row("thread pool peak threads", std::to_string(sampler.threads));
+        }
+        {
+            PeakSampler sampler;
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            subprocess::ProcessPool pool(kConcurrency);
+            for (int i = 0; i < kJobs; ++i)
+                pool.submit(job(i));
+            int results = 0;
+            for (auto& completed : pool)
+                results += completed.returncode == 0;
+            double seconds = watch.seconds();
+            sampler.stop();
+            print_row("ProcessPool jobs/s", std::to_string((long long)(results/seconds)));
+            print_row("ProcessPool cpu", std::to_string(
+                (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+            print_row("ProcessPool peak threads", std::to_string(sampler.threads));
+        }
+#endif
+    }
+
+#if !defined(_WIN32) && defined(__cpp_impl_coroutine)
+    subprocess::Task<int> await_exit(subprocess::EventLoop& loop) {
+        auto popen = RunBuilder({"sleep", "0.5"}).popen();
+        co_return co_await popen.async_wait(loop);
+    }
+#endif
+
+    /*  Waiting on many children at once: a thread blocked in wait() per
+        child vs a suspended coroutine per child on one EventLoop.
+    */
+    void bench_coroutines() {
+#if defined(_WIN32) || !defined(__cpp_impl_coroutine)
+        std::cout << "coroutines: skipped, posix & c++20 only\n";
+#else
+        constexpr int kChildren = 500;
+        raise_fd_limit();
+        std::cout << "coroutines: " << kChildren << " concurrent `sleep 0.5` waited on\n";
+        {
+            PeakSampler sampler;
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            std::vector<std::thread> threads;
+            for (int i = 0; i < kChildren; ++i) {
+                threads.emplace_back([] {
+                    RunBuilder({"sleep", "0.5"}).popen().wait();
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            double seconds = watch.seconds();
+            sampler.stop();
+            print_row("threads wall", std::to_string((long long)(seconds*1000)) + " ms");
+            print_row("threads cpu", std::to_string(
+                (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+            print_row("threads peak threads", std::to_string(sampler.threads));
+            print_row("threads peak rss", std::to_string(sampler.rss) + " kB");
+        }
+        {
+            PeakSampler sampler;
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            subprocess::EventLoop loop;
+            std::vector<subprocess::Task<int>> tasks;
+            for (int i = 0; i < kChildren; ++i) {
+                tasks.push_back(await_exit(loop));
+                tasks.back().start();
+            }
+            loop.run();
+            double seconds = watch.seconds();
+            sampler.stop();
+            print_row("coroutines wall", std::to_string((long long)(seconds*1000)) + " ms");
+            print_row("coroutines cpu", std::to_string(
+                (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+            print_row("coroutines peak threads", std::to_string(sampler.threads));
+            print_row("coroutines peak rss", std::to_string(sampler.rss) + " kB");
+        }
+#endif
+    }
+
+    /*  Children driven from an outside loop: run() in a thread per child vs
+        ProcessWatcher on an EpollLoop polled as one handle.
+    */
+    void bench_external_loop() {
+#ifndef __linux__
+        std::cout << "external_loop: skipped, linux only\n";
+#else
+        constexpr int kChildren = 200;
+        raise_fd_limit();
+        std::cout << "external_loop: " << kChildren << " concurrent `cat` of 256KB\n";
+        std::string input(256*1024, 'x');
+        {
+            PeakSampler sampler;
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            std::vector<std::thread> threads;
+            for (int i = 0; i < kChildren; ++i) {
+                threads.emplace_back([&] {
+                    subprocess::run({"cat"}, RunBuilder().cin(input)
+                        .cout(subprocess::PipeOption::pipe).options);
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            double seconds = watch.seconds();
+            sampler.stop();
+            print_row("threads wall", std::to_string((long long)(seconds*1000)) + " ms");
+            print_row("threads cpu", std::to_string(
+                (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+            print_row("threads peak threads", std::to_string(sampler.threads));
+        }
+        {
+            PeakSampler sampler;
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            subprocess::EpollLoop loop;
+            std::vector<Popen> processes(kChildren);
+            std::vector<std::unique_ptr<subprocess::ProcessWatcher>> watchers;
+            std::size_t received = 0;
+            int done = 0;
+            for (auto& popen : processes) {
+                popen = RunBuilder({"cat"}).cin(subprocess::PipeOption::pipe)
+                    .cout(subprocess::PipeOption::pipe).popen();
+                subprocess::ProcessWatcher::Callbacks callbacks;
+                callbacks.on_cout = [&](std::string_view data) { received += data.size(); };
+                callbacks.on_exit = [&](int) { ++done; };
+                watchers.push_back(std::make_unique<subprocess::ProcessWatcher>(loop, popen,
+                    std::move(callbacks)));
+                watchers.back()->write(input);
+                watchers.back()->close_cin();
+            }
+            pollfd outer = {loop.handle(), POLLIN, 0};
+            while (done < kChildren) {
+                if (::poll(&outer, 1, -1) > 0)
+                    loop.dispatch();
+            }
+            double seconds = watch.seconds();
+            sampler.stop();
+            print_row("ProcessWatcher wall", std::to_string((long long)(seconds*1000)) + " ms");
+            print_row("ProcessWatcher cpu", std::to_string(
+                (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+            print_row("ProcessWatcher peak threads", std::to_string(sampler.threads));
+        }
+#endif
+    }
+
+    /*  Background stream I/O: string cin and std::ostream* cout are serviced
+        by the I/O pool, no thread per stream.
+    */
+    void bench_io_pool() {
+        constexpr int kChildren = 100;
+        raise_fd_limit();
+        std::cout << "io_pool: `cat` with string cin & ostream cout\n";
+        std::string input(64*1024, 'x');
+        for (std::size_t threads : {1, 4}) {
+            subprocess::io_pool_set_threads(threads);
+            std::string label = std::to_string(threads) + " io thread(s) ";
+            {
+                std::stringstream stream;
+                subprocess::StopWatch watch;
+                for (int i = 0; i < kChildren; ++i) {
+                    subprocess::run({"cat"}, RunBuilder().cin(input)
+                        .cout(static_cast<std::ostream*>(&stream)).options);
+                }
+                double seconds = watch.seconds();
+                print_row(label + "runs/s", std::to_string((long long)(kChildren/seconds)));
+            }
+            {
+                PeakSampler sampler;
+                double cpu = cpu_seconds();
+                subprocess::StopWatch watch;
+                std::vector<std::stringstream> streams(kChildren);
+                std::vector<Popen> processes;
+                for (auto& stream : streams) {
+                    processes.push_back(RunBuilder({"cat"}).cin(input)
+                        .cout(static_cast<std::ostream*>(&stream)).popen());
+                }
+                for (auto& popen : processes)
+                    popen.close();
+                double seconds = watch.seconds();
+                sampler.stop();
+                print_row(label + "wall", std::to_string((long long)(seconds*1000)) + " ms");
+                print_row(label + "cpu", std::to_string(
+                    (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+                print_row(label + "peak", std::to_string(sampler.threads) + " threads");
+            }
+        }
+        subprocess::io_pool_set_threads(1);
+    }
+
+    /*  Latency of short lived run() calls, capture and cin string included. */
+    void bench_run_latency() {
+        std::cout << "run_latency: subprocess::run() of short lived commands\n";
+        Stats echo_stats;
+        Stats cat_stats;
+        for (int i = 0; i < 200; ++i) {
+            subprocess::StopWatch watch;
+            subprocess::run({"echo", "hello", "world"},
+                RunBuilder().cout(subprocess::PipeOption::pipe));
+            echo_stats.add(watch.seconds());
+            watch.start();
+            subprocess::run({"cat"}, RunBuilder().cin("hello world")
+                .cout(subprocess::PipeOption::pipe)
+                .cerr(subprocess::PipeOption::pipe));
+            cat_stats.add(watch.seconds());
+        }
+        print_percentiles("echo capture", echo_stats, micros);
+        print_percentiles("cat cin+capture", cat_stats, micros);
+    }
+
+    /*  Many concurrent `cat` children fed from a std::string and drained into
+        a std::ostream. Popen uses 2 threads per child for that, the reactor
+        none.
+    */
+    void bench_reactor() {
+#ifdef _WIN32
+        std::cout << "reactor: skipped, posix only\n";
+#else
+        constexpr int kChildren = 500;
+        std::cout << "reactor: " << kChildren << " concurrent `cat` children, 1KB in/out each\n";
+        raise_fd_limit();
+        std::string input(1024, 'x');
+        {
+            std::vector<std::unique_ptr<std::stringstream>> outputs;
+            std::vector<Popen> children;
+            PeakSampler sampler;
+            subprocess::StopWatch watch;
+            for (int i = 0; i < kChildren; ++i) {
+                outputs.push_back(std::make_unique<std::stringstream>());
+                children.push_back(RunBuilder({"cat"}).cin(input)
+                    .cout(static_cast<std::ostream*>(outputs.back().get())).popen());
+            }
+            children.clear();
+            double seconds = watch.seconds();
+            sampler.stop();
+            print_row("Popen peak threads", std::to_string(sampler.threads));
+            print_row("Popen peak rss", std::to_string(sampler.rss) + " kB");
+            print_row("Popen throughput", std::to_string((long long)(kChildren/seconds)) + " children/s");
+        }
+        {
+            std::vector<std::unique_ptr<std::stringstream>> outputs;
+            subprocess::ProcessReactor reactor;
+            PeakSampler sampler;
+            subprocess::StopWatch watch;
+            for (int i = 0; i < kChildren; ++i) {
+                outputs.push_back(std::make_unique<std::stringstream>());
+                reactor.spawn({"cat"}, RunBuilder().cin(input)
+                    .cout(static_cast<std::ostream*>(outputs.back().get())));
+            }
+            reactor.run();
+            double seconds = watch.seconds();
+            sampler.stop();
+            print_row("ProcessReactor peak threads", std::to_string(sampler.threads));
+            print_row("ProcessReactor peak rss", std::to_string(sampler.rss) + " kB");
+            print_row("ProcessReactor throughput", std::to_string((long long)(kChildren/seconds)) + " children/s");
+        }
+#endif
+    }
+
+    /*  Throughput of moving a pipe into a FILE*, the 2KB read + fwrite loop
+        pipe_thread used to do vs pipe_forward (splice on linux).
+    */
+    void bench_forward() {
+#ifdef _WIN32
+        std::cout << "forward: skipped, posix only\n";
+#else
+        std::cout << "forward: pipe to FILE* throughput\n";
+        auto measure = [](FILE* sink, std::size_t total, bool splice) {
+            subprocess::PipePair pipe = subprocess::pipe_create();
+            std::thread producer([&] {
+                std::vector<char> chunk(1024*1024, 'x');
+                for (std::size_t sent = 0; sent < total; sent += chunk.size()) {
+                    if (subprocess::pipe_write(pipe.output, chunk.data(), chunk.size()) <= 0)
+                        break;
+                }
+                pipe.close_output();
+            });
+            rewind(sink);
+            subprocess::StopWatch watch;
+            if (splice) {
+                subprocess::pipe_forward(pipe.input, fileno(sink));
+            } else {
+                std::vector<char> buffer(2048);
+                while (true) {
+                    ssize_t transfered = subprocess::pipe_read(pipe.input, &buffer[0], buffer.size());
+                    if (transfered <= 0)
+                        break;
+                    fwrite(&buffer[0], 1, transfered, sink);
+                }
+                fflush(sink);
+            }
+            double seconds = watch.seconds();
+            producer.join();
+            return total/seconds/(1024.0*1024*1024);
+        };
+        struct Sink {
+            const char* name;
+            FILE*       file;
+            std::size_t size;
+        };
+        Sink sinks[] = {
+            {"/dev/null",   fopen("/dev/null", "w"), (std::size_t)4*1024*1024*1024},
+            {"tmpfile",     std::tmpfile(),         (std::size_t)512*1024*1024},
+        };
+        for (Sink& sink : sinks) {
+            if (!sink.file)
+                continue;
+            for (bool splice : {false, true}) {
+                double rate = measure(sink.file, sink.size, splice);
+                print_row(std::string(sink.name) + (splice? " pipe_forward" : " read+fwrite 2KB"),
+                    std::to_string(rate) + " GB/s");
+            }
+            fclose(sink.file);
+        }
+#endif
+    }
+
+    /*  Throughput of `cat | cat | cat`: each stage's output relayed through
+        the parent vs Pipeline connecting the children directly.
+    */
+    void bench_pipeline() {
+#ifdef _WIN32
+        std::cout << "pipeline: skipped, posix only\n";
+#else
+        constexpr std::size_t kTotal = (std::size_t)512*1024*1024;
+        constexpr int kStages = 3;
+        std::cout << "pipeline: 512MB through " << kStages << " `cat` stages into /dev/null\n";
+        FILE* null = fopen("/dev/null", "w");
+        auto produce = [](Popen& first) {
+            std::vector<char> chunk(1024*1024, 'x');
+            for (std::size_t sent = 0; sent < kTotal; sent += chunk.size()) {
+                if (subprocess::pipe_write(first.cin, chunk.data(), chunk.size()) <= 0)
+                    break;
+            }
+            first.close_cin();
+        };
+        {
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            std::vector<Popen> processes;
+            for (int i = 0; i < kStages; ++i) {
+                auto builder = RunBuilder({"cat"}).cin(subprocess::PipeOption::pipe);
+                if (i+1 < kStages)
+                    builder.cout(subprocess::PipeOption::pipe);
+                else
+                    builder.cout((subprocess::PipeHandle)fileno(null));
+                processes.push_back(builder.popen());
+            }
+            std::vector<std::thread> threads;
+            for (int i = 0; i+1 < kStages; ++i) {
+                threads.emplace_back([&, i] {
+                    subprocess::pipe_forward(processes[i].cout, processes[i+1].cin);
+                    processes[i+1].close_cin();
+                });
+            }
+            produce(processes[0]);
+            for (auto& thread : threads)
+                thread.join();
+            for (auto& process : processes)
+                process.wait();
+            double seconds = watch.seconds();
+            print_row("relayed by parent", std::to_string(kTotal/seconds/(1024.0*1024*1024)) + " GB/s");
+            print_row("relayed by parent cpu", std::to_string(
+                (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+        }
+        for (std::size_t pipe_size : {(std::size_t)0, (std::size_t)1024*1024}) {
+            double cpu = cpu_seconds();
+            subprocess::StopWatch watch;
+            subprocess::Pipeline pipeline;
+            pipeline.pipe_size(pipe_size);
+            for (int i = 0; i < kStages; ++i) {
+                auto builder = RunBuilder({"cat"});
+                if (i == 0)
+                    builder.cin(subprocess::PipeOption::pipe);
+                if (i+1 == kStages)
+                    builder.cout((subprocess::PipeHandle)fileno(null));
+                pipeline.add(builder);
+            }
+            std::vector<Popen> processes = pipeline.popen();
+            produce(processes[0]);
+            for (auto& process : processes)
+                process.wait();
+            double seconds = watch.seconds();
+            std::string name = pipe_size? "Pipeline 1MB pipes" : "Pipeline";
+            print_row(name, std::to_string(kTotal/seconds/(1024.0*1024*1024)) + " GB/s");
+            print_row(name + " cpu", std::to_string(
+                (long long)((cpu_seconds() - cpu)*1000)) + " ms");
+        }
+        fclose(null);
+#endif
+    }
+
+    /*  run() capturing a large stdout through a pipe vs a memfd. */
+    void bench_capture() {
+        std::cout << "capture: run() of `cat` echoing 64MB\n";
+        std::string input(64*1024*1024, 'x');
+        struct Mode {
+            const char*             name;
+            subprocess::PipeOption  option;
+            bool                    map;
+        };
+        const Mode modes[] = {
+            {"pipe",            subprocess::PipeOption::pipe,   false},
+            {"memfd copy",      subprocess::PipeOption::memfd,  false},
+            {"memfd map",       subprocess::PipeOption::memfd,  true},
+        };
+        for (const Mode& mode : modes) {
+            Stats stats;
+            for (int i = 0; i < 10; ++i) {
+                subprocess::StopWatch watch;
+                auto completed = RunBuilder({"cat"}).cin(input).cout(mode.option)
+                    .map_output(mode.map).run();
+                stats.add(watch.seconds());
+                if (completed.cout_view().size() != input.size())
+                    std::cout << "  unexpected output size\n";
+            }
+            print_row(std::string(mode.name) + " p50", micros(stats.percentile(0.5)));
+        }
+    }
+
+    /*  Throughput of `cat` from a string cin into each kind of cout sink. */
+    void bench_sinks() {
+        constexpr std::size_t kSize = 64*1024*1024;
+#ifdef _WIN32
+        const char* null_path = "NUL";
+#else
+        const char* null_path = "/dev/null";
+#endif
+        std::cout << "sinks: run() of `cat` echoing 64MB into each cout sink\n";
+        std::string input(kSize, 'x');
+        FILE* null_file = fopen(null_path, "wb");
+        std::ofstream null_stream(null_path, std::ios::binary);
+        std::ostringstream string_stream;
+        auto rate = [](double seconds) {
+            return std::to_string(kSize/seconds/(1024.0*1024*1024)) + " GB/s";
+        };
+        struct Sink {
+            const char*         name;
+            subprocess::PipeVar option;
+        };
+        const Sink sinks[] = {
+            {"pipe capture",        subprocess::PipeOption::pipe},
+            {"memfd capture",       subprocess::PipeOption::memfd},
+            {"PipeHandle",          subprocess::pipe_file(null_path, "w")},
+            {"FILE*",               null_file},
+            {"ostream* ofstream",   static_cast<std::ostream*>(&null_stream)},
+            {"ostream* stringstream", static_cast<std::ostream*>(&string_stream)},
+        };
+        for (const Sink& sink : sinks) {
+            Stats stats;
+            for (int i = 0; i < 5; ++i) {
+                string_stream.str({});
+                subprocess::StopWatch watch;
+                RunBuilder({"cat"}).cin(input).cout(sink.option).run();
+                stats.add(watch.seconds());
+            }
+            // the slowest run is the lowest rate
+            print_row(std::string(sink.name) + " p50", rate(stats.percentile(0.5)));
+            print_row(std::string(sink.name) + " min", rate(stats.percentile(1)));
+        }
+        subprocess::pipe_close(std::get<subprocess::PipeHandle>(sinks[2].option));
+        fclose(null_file);
+    }
+
+    /*  Round trips to a long lived loadgen_child answering framed requests
+        vs a run() of `cat` per request.
+    */
+    void bench_request_response() {
+        constexpr int kRequests = 2000;
+        std::cout << "request_response: 64 byte requests answered by a child\n";
+        std::string frame(4, '\0');
+        frame[0] = 64;
+        frame += std::string(64, 'x');
+        auto read_exactly = [](subprocess::PipeHandle handle, std::string& buffer) {
+            std::size_t got = 0;
+            while (got < buffer.size()) {
+                auto transferred = subprocess::pipe_read(handle, &buffer[got], buffer.size() - got);
+                if (transferred <= 0)
+                    return false;
+                got += transferred;
+            }
+            return true;
+        };
+        {
+            Popen popen = RunBuilder({"loadgen_child", "--echo-frames"})
+                .cin(subprocess::PipeOption::pipe).cout(subprocess::PipeOption::pipe).popen();
+            std::string answer(frame.size(), '\0');
+            Stats stats;
+            for (int i = 0; i < kRequests; ++i) {
+                subprocess::StopWatch watch;
+                subprocess::pipe_write(popen.cin, frame.data(), frame.size());
+                if (!read_exactly(popen.cout, answer) || answer != frame) {
+                    std::cout << "  unexpected answer\n";
+                    break;
+                }
+                stats.add(watch.seconds());
+            }
+            popen.close_cin();
+            popen.wait();
+            print_percentiles("long lived child", stats, micros);
+        }
+        {
+            Stats stats;
+            for (int i = 0; i < kRequests/10; ++i) {
+                subprocess::StopWatch watch;
+                RunBuilder({"cat"}).cin(frame).cout(subprocess::PipeOption::pipe).run();
+                stats.add(watch.seconds());
+            }
+            print_percentiles("run() per request", stats, micros);
+        }
+    }
+
+    /** @return read syscalls made by this process so far, -1 if unknown */
+    long long read_syscalls() {
+        std::ifstream io("/proc/self/io");
+        std::string key;
+        long long value;
+        while (io >> key >> value) {
+            if (key == "syscr:")
+                return value;
+        }
+        return -1;
+    }
+
+    /*  pipe_read_all vs the 2KB read + insert loop it replaced, for output
+        sizes from 1KB to 1GB. A thread writes the data into the pipe.
+    */
+    void bench_read_all() {
+        std::cout << "read_all: draining a pipe into a std::string\n";
+        std::size_t max_size = (std::size_t)1024*1024*1024;
+#ifndef _WIN32
+        // the string may reach twice the data while growing
+        double ram = (double)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGESIZE);
+        if (4.0*max_size > ram)
+            max_size /= 16;
+#endif
+        auto old_read_all = [](subprocess::PipeHandle handle) {
+            uint8_t buf[2048];
+            std::string result;
+            while (true) {
+                ssize_t transfered = subprocess::pipe_read(handle, buf, sizeof(buf));
+                if (transfered <= 0)
+                    break;
+                result.insert(result.end(), &buf[0], &buf[transfered]);
+            }
+            return result;
+        };
+        struct Size {
+            const char* name;
+            std::size_t size;
+        };
+        const Size sizes[] = {
+            {"1KB", 1024},
+            {"1MB", 1024*1024},
+            {"1GB", (std::size_t)1024*1024*1024},
+        };
+        for (const Size& size : sizes) {
+            if (size.size > max_size) {
+                print_row(size.name, "skipped, not enough ram");
+                continue;
+            }
+            for (int mode = 0; mode < 3; ++mode) {
+                subprocess::PipePair pipe = subprocess::pipe_create();
+                std::thread producer([&] {
+                    std::vector<char> chunk(std::min<std::size_t>(size.size, 1024*1024), 'x');
+                    for (std::size_t sent = 0; sent < size.size; sent += chunk.size())
+                        subprocess::pipe_write(pipe.output, chunk.data(), chunk.size());
+                    pipe.close_output();
+                });
+                long long syscalls = read_syscalls();
+                subprocess::StopWatch watch;
+                std::size_t got = 0;
+                if (mode == 0)
+                    got = old_read_all(pipe.input).size();
+                else
+                    got = subprocess::pipe_read_all(pipe.input, mode == 2? size.size : 0).size();
+                double seconds = watch.seconds();
+                syscalls = read_syscalls() - syscalls;
+                producer.join();
+                if (got != size.size)
+                    std::cout << "  unexpected size " << got << "\n";
+                const char* mode_name = mode == 0? " 2KB loop" : mode == 1? " pipe_read_all" : " pipe_read_all hinted";
+                print_row(std::string(size.name) + mode_name, micros(seconds)
+                    + ", " + std::to_string(syscalls) + " reads");
+            }
+        }
+    }
+
+    /*  find_program hits and misses vs stat()ing every PATH entry the way
+        misses used to.
+    */
+    void bench_find_program() {
+        std::cout << "find_program: lookups/sec\n";
+        constexpr int kLookups = 200000;
+        auto rate = [](int count, double seconds) {
+            return std::to_string((long long)(count/seconds)) + " lookups/s";
+        };
+        for (const char* name : {"echo", "no-such-program-here"}) {
+            std::string label = name == std::string("echo")? "hit" : "miss";
+            subprocess::find_program(name);
+            subprocess::StopWatch watch;
+            for (int i = 0; i < kLookups; ++i)
+                subprocess::find_program(name);
+            print_row(label + " indexed", rate(kLookups, watch.seconds()));
+
+            watch.start();
+            constexpr int kStatLookups = kLookups/20;
+            for (int i = 0; i < kStatLookups; ++i) {
+                std::stringstream path(subprocess::cenv["PATH"].to_string());
+                std::string dir;
+                while (std::getline(path, dir, subprocess::kPathDelimiter)) {
+                    std::error_code error;
+                    if (!dir.empty() && std::filesystem::is_regular_file(dir + "/" + name, error))
+                        break;
+                }
+            }
+            print_row(label + " stat per entry", rate(kStatLookups, watch.seconds()));
+        }
+        for (int thread_count : {4, 16}) {
+            std::vector<std::thread> threads;
+            subprocess::StopWatch watch;
+            for (int i = 0; i < thread_count; ++i) {
+                threads.emplace_back([] {
+                    for (int n = 0; n < kLookups/16; ++n)
+                        subprocess::find_program("echo");
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            print_row("hit indexed " + std::to_string(thread_count) + " threads",
+                rate(thread_count*(kLookups/16), watch.seconds()));
+        }
+    }
+
+    /*  What recording a trace costs: run() with tracing off and on, and a
+        single recorded span from one and from several threads.
+    */
+    void bench_trace() {
+        std::cout << "trace: overhead of trace recording\n";
+        for (bool enable : {false, true}) {
+            subprocess::trace_clear();
+            subprocess::trace_enable(enable);
+            Stats stats;
+            for (int i = 0; i < 300; ++i) {
+                subprocess::StopWatch watch;
+                subprocess::run({"echo", "hi"}, RunBuilder().cout(subprocess::PipeOption::pipe));
+                stats.add(watch.seconds());
+            }
+            print_percentiles(enable? "run() traced" : "run() untraced", stats, micros);
+        }
+        constexpr int kSpans = 250000;
+        auto nanos = [](double seconds, double count) {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%.1f ns", seconds*1e9/count);
+            return std::string(buffer);
+        };
+        for (int thread_count : {1, 4}) {
+            subprocess::trace_clear();
+            std::vector<std::thread> threads;
+            subprocess::StopWatch watch;
+            for (int i = 0; i < thread_count; ++i) {
+                threads.emplace_back([] {
+                    for (int n = 0; n < kSpans; ++n)
+                        subprocess::details::trace_span("bench", n, n+1, 0);
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            print_row("span " + std::to_string(thread_count) + " threads",
+                nanos(watch.seconds(), thread_count*(double)kSpans));
+        }
+        subprocess::StopWatch watch;
+        std::string json = subprocess::trace_json();
+        print_row("trace_json per event", nanos(watch.seconds(), 4.0*kSpans));
+        subprocess::trace_enable(false);
+        subprocess::trace_clear();
+    }
+
+    /*  What keeping the metrics costs: a counter add and a spawn & collect
+        record from one and from several threads, and taking a snapshot.
+    */
+    void bench_metrics() {
+        using subprocess::details::Metric;
+        std::cout << "metrics: cost of the always on metrics\n";
+        constexpr int kOps = 1000000;
+        auto nanos = [](double seconds, double count) {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%.1f ns", seconds*1e9/count);
+            return std::string(buffer);
+        };
+        const CommandLine args = {"/usr/bin/bench-program"};
+        for (int thread_count : {1, 4}) {
+            std::vector<std::thread> threads;
+            subprocess::StopWatch watch;
+            for (int i = 0; i < thread_count; ++i) {
+                threads.emplace_back([] {
+                    for (int n = 0; n < kOps; ++n)
+                        subprocess::details::metric_add(Metric::input_bytes, 1);
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            print_row("add " + std::to_string(thread_count) + " threads",
+                nanos(watch.seconds(), thread_count*(double)kOps));
+
+            threads.clear();
+            watch.start();
+            for (int i = 0; i < thread_count; ++i) {
+                threads.emplace_back([&args] {
+                    for (int n = 0; n < kOps/10; ++n) {
+                        subprocess::details::metric_spawned(args, 1e-3);
+                        subprocess::details::metric_collected(args, 0, false, 1e-2, -1);
+                    }
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            print_row("process " + std::to_string(thread_count) + " threads",
+                nanos(watch.seconds(), thread_count*(double)(kOps/10)));
+        }
+        Stats stats;
+        for (int i = 0; i < 100; ++i) {
+            subprocess::StopWatch watch;
+            auto snapshot = subprocess::metrics_snapshot();
+            stats.add(watch.seconds());
+        }
+        print_percentiles("snapshot", stats, micros);
+    }
+
+    std::string json_string(const std::string& str) {
+        std::string result = "\"";
+        for (char ch : str) {
+            if (ch == '"' || ch == '\\') {
+                result += '\\';
+                result += ch;
+            } else if ((unsigned char)ch < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+                result += escaped;
+            } else {
+                result += ch;
+            }
+        }
+        return result + "\"";
+    }
+
+    /** Writes g_results, splitting each value into its number and unit. */
+    void write_json(std::ostream& output) {
+        output << "{\"benchmarks\": [";
+        for (std::size_t i = 0; i < g_results.size(); ++i) {
+            const Result& result = g_results[i];
+            output << (i? ",\n  " : "\n  ") << "{\"name\": " << json_string(result.name)
+                << ", \"rows\": [";
+            for (std::size_t n = 0; n < result.rows.size(); ++n) {
+                const Row& row = result.rows[n];
+                const char* begin = row.value.c_str();
+                char* end = nullptr;
+                double value = std::strtod(begin, &end);
+                std::string unit = end;
+                unit.erase(0, unit.find_first_not_of(' '));
+                output << (n? ",\n    " : "\n    ") << "{\"metric\": "
+                    << json_string(row.metric) << ", \"value\": ";
+                if (end == begin || !std::isfinite(value)) {
+                    output << "null, \"unit\": " << json_string(row.value) << "}";
+                } else {
+                    output << value << ", \"unit\": " << json_string(unit) << "}";
+                }
+            }
+            output << "]}";
+        }
+        output << "\n]}\n";
+    }
+
+    struct Benchmark {
+        const char* name;
+        void (*run)();
+    };
+
+    const Benchmark g_benchmarks[] = {
+        {"wait_cpu",        bench_wait_cpu},
+        {"wait_latency",    bench_wait_latency},
+        {"reaper",          bench_reaper},
+        {"process_set",     bench_process_set},
+        {"spawn_latency",   bench_spawn_latency},
+        {"spawn_threads",   bench_spawn_threads},
+        {"spawn_backends",  bench_spawn_backends},
+        {"spawn_template",  bench_spawn_template},
+        {"env_overlay",     bench_env_overlay},
+        {"env_copy",        bench_env_copy},
+        {"reactor",         bench_reactor},
+        {"run_latency",     bench_run_latency},
+        {"pool",            bench_pool},
+        {"coroutines",      bench_coroutines},
+        {"external_loop",   bench_external_loop},
+        {"io_pool",         bench_io_pool},
+        {"forward",         bench_forward},
+        {"pipeline",        bench_pipeline},
+        {"capture",         bench_capture},
+        {"sinks",           bench_sinks},
+        {"request_response", bench_request_response},
+        {"read_all",        bench_read_all},
+        {"find_program",    bench_find_program},
+        {"trace",           bench_trace},
+        {"metrics",         bench_metrics},
+    };
+}
+
+int main(int argc, char** argv) {
+    std::string path = subprocess::cenv["PATH"];
+    path = dirname(subprocess::abspath(argv[0])) + subprocess::kPathDelimiter + path;
+    subprocess::cenv["PATH"] = path;
+
+    std::string json_path;
+    std::vector<std::string> selected;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json" && i+1 < argc)
+            json_path = argv[++i];
+        else
+            selected.push_back(arg);
+    }
+    for (auto& benchmark : g_benchmarks) {
+        if (!selected.empty() && std::find(selected.begin(), selected.end(),
+                benchmark.name) == selected.end())
+            continue;
+        g_results.push_back({benchmark.name, {}});
+        benchmark.run();
+    }
+    if (!json_path.empty()) {
+        std::ofstream json(json_path);
+        json.precision(10);
+        write_json(json);
+        if (!json) {
+            std::cerr << "failed to write " << json_path << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}